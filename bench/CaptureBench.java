@@ -0,0 +1,133 @@
+/* Copyright 2026 (c) Suneido Software Corp. All rights reserved.
+ * Licensed under GPLv2.
+ */
+
+import java.lang.reflect.Constructor;
+import java.util.concurrent.CountDownLatch;
+import java.util.concurrent.atomic.AtomicBoolean;
+import java.util.concurrent.atomic.LongAdder;
+
+import suneido.SuValue;
+import suneido.compiler.Compiler;
+
+/**
+ * Measures how many stack captures per second the jsdebug agent manages on
+ * platform threads and on virtual threads.
+ *
+ * Each worker calls a compiled Suneido function that recurses to the requested
+ * depth and then calls back into Java, which constructs
+ * {@code suneido.debug.StackInfo} in a loop. So every capture goes through the
+ * agent's breakpoint callback and fetches the locals of that many Suneido
+ * frames, which is where virtual threads take different paths in the agent.
+ *
+ * Run with JDK 21 or later, with jSuneido on the class path and the agent
+ * loaded, e.g. via {@code run.sh}.
+ *
+ * @author agent
+ * @since 20261018
+ */
+public final class CaptureBench {
+
+	private static final int DEFAULT_THREADS = 8;
+	private static final int DEFAULT_SECONDS = 10;
+	private static final int DEFAULT_DEPTH = 32;
+
+	// Takes itself as the first argument, since a function literal has no
+	// name to recurse by
+	private static final String RECURSE =
+			"function (self, n, capture)\n" +
+			"\t{\n" +
+			"\tdepth = n\n" +
+			"\tif n <= 0\n" +
+			"\t\treturn capture()\n" +
+			"\treturn self(self, n - 1, capture)\n" +
+			"\t}";
+
+	private final Constructor<?> stackInfo;
+	private final SuValue recurse;
+	private final int threads;
+	private final int seconds;
+	private final int depth;
+
+	private CaptureBench(int threads, int seconds, int depth) throws Exception {
+		stackInfo = Class.forName("suneido.debug.StackInfo")
+				.getDeclaredConstructor();
+		stackInfo.setAccessible(true);
+		recurse = (SuValue) Compiler.eval(RECURSE);
+		this.threads = threads;
+		this.seconds = seconds;
+		this.depth = depth;
+	}
+
+	private static final class Capture extends SuValue {
+
+		private final Constructor<?> stackInfo;
+		private final AtomicBoolean stop;
+		private final LongAdder count;
+
+		Capture(Constructor<?> stackInfo, AtomicBoolean stop, LongAdder count) {
+			this.stackInfo = stackInfo;
+			this.stop = stop;
+			this.count = count;
+		}
+
+		@Override
+		public Object call(Object... args) {
+			try {
+				while (!stop.get()) {
+					stackInfo.newInstance();
+					count.increment();
+				}
+			} catch (ReflectiveOperationException e) {
+				throw new RuntimeException(e);
+			}
+			return null;
+		}
+	}
+
+	private double run(Thread.Builder builder) throws InterruptedException {
+		AtomicBoolean stop = new AtomicBoolean();
+		LongAdder count = new LongAdder();
+		CountDownLatch done = new CountDownLatch(threads);
+		for (int k = 0; k < threads; ++k) {
+			builder.start(() -> {
+				try {
+					recurse.call(recurse, depth,
+							new Capture(stackInfo, stop, count));
+				} catch (RuntimeException e) {
+					e.printStackTrace();
+				} finally {
+					done.countDown();
+				}
+			});
+		}
+		long start = System.nanoTime();
+		Thread.sleep(seconds * 1000L);
+		stop.set(true);
+		done.await();
+		return count.sum() * 1e9 / (System.nanoTime() - start);
+	}
+
+	private static int arg(String[] args, int index, int defaultValue) {
+		return index < args.length ? Integer.parseInt(args[index])
+				: defaultValue;
+	}
+
+	/**
+	 * Usage: {@code CaptureBench [threads [seconds [depth]]]}. A warm-up round
+	 * of each kind of thread runs first and isn't reported.
+	 */
+	public static void main(String[] args) throws Exception {
+		CaptureBench bench = new CaptureBench(arg(args, 0, DEFAULT_THREADS),
+				arg(args, 1, DEFAULT_SECONDS), arg(args, 2, DEFAULT_DEPTH));
+		bench.run(Thread.ofPlatform());
+		bench.run(Thread.ofVirtual());
+		double platform = bench.run(Thread.ofPlatform());
+		double virtual = bench.run(Thread.ofVirtual());
+		System.out.printf("threads=%d seconds=%d depth=%d%n", bench.threads,
+				bench.seconds, bench.depth);
+		System.out.printf("platform: %12.0f captures/s%n", platform);
+		System.out.printf("virtual:  %12.0f captures/s (%.2fx platform)%n",
+				virtual, virtual / platform);
+	}
+}
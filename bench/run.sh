@@ -0,0 +1,25 @@
+#!/bin/sh
+# Copyright 2026 (c) Suneido Software Corp. All rights reserved.
+# Licensed under GPLv2.
+
+#===============================================================================
+# file: run.sh
+# auth: agent
+# date: 20261018
+# desc: Runs the capture benchmark against the release build of the agent.
+#       Usage: JSUNEIDO_JAR=path/to/jsuneido.jar ./run.sh [threads [seconds
+#       [depth]]]. Needs JDK 21 or later.
+#===============================================================================
+
+set -e
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+AGENT=${AGENT:-$DIR/../make/bin/release/jsdebug.so}
+
+if [ -z "$JSUNEIDO_JAR" ]; then
+    echo "set JSUNEIDO_JAR to the jSuneido jar" >&2
+    exit 1
+fi
+
+exec "${JAVA_HOME:+$JAVA_HOME/bin/}java" "-agentpath:$AGENT" \
+    -cp "$JSUNEIDO_JAR" "$DIR/CaptureBench.java" "$@"
@@ -0,0 +1,100 @@
+/* Copyright 2026 (c) Suneido Software Corp. All rights reserved.
+ * Licensed under GPLv2.
+ */
+
+#ifdef _MSC_VER
+#pragma warning (disable : 4001) /* nonstandard extension: '//-style' comment */
+#endif // _MSC_VER
+
+//==============================================================================
+// file: allocation.c
+// auth: agent
+// date: 20261018
+// desc: Profiles heap allocation by Suneido call stack using the sampled
+//       object allocation events of JDK 11 and later
+//==============================================================================
+
+#include "jsdebug.h"
+
+#include <string.h>
+
+// =============================================================================
+//                               AGENT INIT
+// =============================================================================
+
+// Asks for the capability needed to sample allocations, failing with a useful
+// message if the JVM doesn't have it.
+int addAllocationCapabilities(jvmtiEnv * jvmti_env, jvmtiCapabilities * caps)
+{
+#ifdef JSDEBUG_SAMPLED_ALLOC
+    jvmtiCapabilities potential_caps;
+    memset(&potential_caps, 0, sizeof(potential_caps));
+    if (JVMTI_ERROR_NONE == (*jvmti_env)->GetPotentialCapabilities(
+                                jvmti_env, &potential_caps) &&
+        potential_caps.can_generate_sampled_object_alloc_events)
+    {
+        caps->can_generate_sampled_object_alloc_events = 1;
+        return 1;
+    }
+#endif
+    fatalError1("the alloc option requires a JVM with sampled allocation "
+                "events (JDK 11 or later)");
+    return 0;
+}
+
+int initAllocation(jvmtiEnv * jvmti_env, jint interval)
+{
+#ifdef JSDEBUG_SAMPLED_ALLOC
+    jvmtiError error;
+    if (!initProfile(jvmti_env, PROFILE_ALLOCATION))
+        return 0; // Error already reported
+    error = (*jvmti_env)->SetHeapSamplingInterval(jvmti_env, interval);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        fatalErrorJVMTI(jvmti_env, error, "failed to set sampling interval");
+        return 0;
+    }
+    error = (*jvmti_env)->SetEventNotificationMode(
+        jvmti_env, JVMTI_ENABLE, JVMTI_EVENT_SAMPLED_OBJECT_ALLOC,
+        (jthread)NULL);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        fatalErrorJVMTI(jvmti_env, error,
+                        "failed to enable sampled object alloc events");
+        return 0;
+    }
+    // Return success
+    return 1;
+#else
+    (void)jvmti_env;
+    (void)interval;
+    return 0; // Can't get here, see addAllocationCapabilities()
+#endif
+}
+
+// =============================================================================
+//                                 CALLBACKS
+// =============================================================================
+
+#ifdef JSDEBUG_SAMPLED_ALLOC
+
+#ifdef _MSC_VER
+#pragma warning (push)
+#pragma warning (disable : 4100) // unreferenced formal parameter
+#endif // _MSC_VER
+
+void JNICALL callback_SampledObjectAlloc(jvmtiEnv * jvmti_env,
+                                         JNIEnv * jni_env, jthread thread,
+                                         jobject object, jclass object_klass,
+                                         jlong size)
+{
+    unsigned long long hash;
+    if (profileStack(jvmti_env, jni_env, thread, PROFILE_ALLOCATION, &hash))
+        profileAdd(jvmti_env, PROFILE_ALLOCATION, hash, 1, size);
+}
+
+#ifdef _MSC_VER
+#pragma warning (pop)
+#endif // _MSC_VER
+
+#endif // JSDEBUG_SAMPLED_ALLOC
@@ -0,0 +1,748 @@
+/* Copyright 2026 (c) Suneido Software Corp. All rights reserved.
+ * Licensed under GPLv2.
+ */
+
+#ifdef _MSC_VER
+#pragma warning (disable : 4001) /* nonstandard extension: '//-style' comment */
+#endif // _MSC_VER
+
+//==============================================================================
+// file: breakpoints.c
+// auth: agent
+// date: 20261018
+// desc: Breakpoints on lines of Suneido code, set from Java, whose hit counts
+//       and conditions are checked without leaving native code
+//==============================================================================
+
+#include "jsdebug.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+// =============================================================================
+//                                 CONSTANTS
+// =============================================================================
+
+enum
+{
+    MAX_LOCAL_NAME              = 128,
+    BREAKPOINT_INITIAL_CAPACITY = 16,
+};
+
+static const char * JAVA_LANG_OBJECT_CLASS          = "java/lang/Object";
+static const char * JAVA_LANG_STRING_CLASS          = "java/lang/String";
+static const char * BOXED_VALUE_FIELD_NAME          = "value";
+static const char * EQUALS_METHOD_NAME              = "equals";
+static const char * EQUALS_METHOD_SIGNATURE         = "(Ljava/lang/Object;)Z";
+static const char * BREAKPOINT_HIT_METHOD_NAME      = "breakpointHit";
+static const char * BREAKPOINT_HIT_METHOD_SIGNATURE =
+    "(ILsuneido/debug/StackInfo;)V";
+
+// =============================================================================
+//                                  GLOBALS
+// =============================================================================
+
+// How a condition's value is compared with the local variable's, all without
+// running Java code
+enum condition_kind
+{
+    CONDITION_IDENTITY, /* null, or a class that doesn't override equals() */
+    CONDITION_STRING,   /* same characters */
+    CONDITION_BOXED,    /* same class and same primitive value */
+};
+
+// The boxed primitive classes, whose values are read from their value fields
+struct boxed_type
+{
+    const char * class_name;
+    const char * signature;   // Of the value field
+    jclass       klass;       // Global ref
+    jfieldID     value_field;
+};
+
+struct breakpoint_location
+{
+    jmethodID method;
+    jlocation location;
+};
+
+// A breakpoint on one line, which may have code in more than one method
+struct user_breakpoint
+{
+    jint                         id;             // 0 if slot is free
+    struct breakpoint_location * locations;
+    jint                         location_count;
+    jthread                      thread;         // Global ref, may be NULL
+    char                         local_name[MAX_LOCAL_NAME]; // May be empty
+    jobject                      local_value;    // Global ref, may be NULL
+    enum condition_kind          local_kind;
+    const struct boxed_type *    local_boxed;    // If CONDITION_BOXED
+    jint                         ignore_count;
+    jint                         every;
+    jint                         hits;           // Hits meeting conditions
+};
+
+// What a hit needs from a breakpoint, copied out so that conditions can be
+// checked without holding g_breakpoints_lock
+struct breakpoint_conditions
+{
+    jint                      id;
+    jthread                   thread;      // Local ref, may be NULL
+    char                      local_name[MAX_LOCAL_NAME];
+    jobject                   local_value; // Local ref, may be NULL
+    enum condition_kind       local_kind;
+    const struct boxed_type * local_boxed;
+};
+
+static jrawMonitorID            g_breakpoints_lock;
+static struct user_breakpoint * g_breakpoints;
+static jint                     g_breakpoint_capacity;
+static jint                     g_last_breakpoint_id;
+static jclass                   g_breakpoints_class; // Global ref, NULL
+                                                     // until first set
+static jmethodID                g_breakpoint_hit_method;
+static jmethodID                g_equals_method;
+static jclass                   g_string_class;      // Global ref
+
+static struct boxed_type g_boxed_types[] =
+{
+    { "java/lang/Boolean",   "Z", NULL, NULL },
+    { "java/lang/Character", "C", NULL, NULL },
+    { "java/lang/Byte",      "B", NULL, NULL },
+    { "java/lang/Short",     "S", NULL, NULL },
+    { "java/lang/Integer",   "I", NULL, NULL },
+    { "java/lang/Long",      "J", NULL, NULL },
+    { "java/lang/Float",     "F", NULL, NULL },
+    { "java/lang/Double",    "D", NULL, NULL },
+};
+
+// =============================================================================
+//                             HELPER FUNCTIONS
+// =============================================================================
+
+static void throwIllegalArgument(JNIEnv * jni_env, const char * message)
+{
+    jclass clazz = (*jni_env)->FindClass(jni_env,
+                                         "java/lang/IllegalArgumentException");
+    if (clazz)
+        (*jni_env)->ThrowNew(jni_env, clazz, message);
+}
+
+// Finds the Java method that hits are handed to, the first time a breakpoint
+// is set. Caller must hold g_breakpoints_lock. Since no breakpoint is set
+// until this succeeds, a hit always sees both globals set.
+static int findBreakpointHit(JNIEnv * jni_env, jclass clazz)
+{
+    jmethodID method;
+    jclass    global_class;
+    method = (*jni_env)->GetStaticMethodID(jni_env, clazz,
+                                           BREAKPOINT_HIT_METHOD_NAME,
+                                           BREAKPOINT_HIT_METHOD_SIGNATURE);
+    if (!method)
+        return 0; // NoSuchMethodError pending
+    global_class = (jclass)(*jni_env)->NewGlobalRef(jni_env, clazz);
+    if (!global_class)
+    {
+        error1("failed to create breakpoints class global reference");
+        return 0;
+    }
+    g_breakpoint_hit_method = method;
+    // Set last, since it says everything has been found
+    g_breakpoints_class = global_class;
+    return 1;
+}
+
+static jboolean hasLocation(const struct user_breakpoint * bp,
+                            jmethodID method, jlocation location)
+{
+    jint k;
+    for (k = 0; k < bp->location_count; ++k)
+        if (method == bp->locations[k].method &&
+            location == bp->locations[k].location)
+            return JNI_TRUE;
+    return JNI_FALSE;
+}
+
+// Returns true iff a breakpoint other than the one with the given id is set
+// at the location. Caller must hold g_breakpoints_lock.
+static jboolean isLocationShared(jint id, jmethodID method, jlocation location)
+{
+    jint k;
+    for (k = 0; k < g_breakpoint_capacity; ++k)
+        if (g_breakpoints[k].id && id != g_breakpoints[k].id &&
+            hasLocation(&g_breakpoints[k], method, location))
+            return JNI_TRUE;
+    return JNI_FALSE;
+}
+
+// Returns a free slot, or NULL if out of memory. Caller must hold
+// g_breakpoints_lock.
+static struct user_breakpoint * allocBreakpoint()
+{
+    jint                     new_capacity;
+    struct user_breakpoint * new_breakpoints;
+    jint                     k;
+    for (k = 0; k < g_breakpoint_capacity; ++k)
+        if (!g_breakpoints[k].id)
+            return &g_breakpoints[k];
+    new_capacity = g_breakpoint_capacity ? g_breakpoint_capacity * 2
+                                         : BREAKPOINT_INITIAL_CAPACITY;
+    new_breakpoints = (struct user_breakpoint *)realloc(
+        g_breakpoints, new_capacity * sizeof(struct user_breakpoint));
+    if (!new_breakpoints)
+    {
+        error1("breakpoint table realloc returned NULL");
+        return NULL;
+    }
+    memset(new_breakpoints + g_breakpoint_capacity, 0,
+           (new_capacity - g_breakpoint_capacity) *
+           sizeof(struct user_breakpoint));
+    g_breakpoints = new_breakpoints;
+    k = g_breakpoint_capacity;
+    g_breakpoint_capacity = new_capacity;
+    return &g_breakpoints[k];
+}
+
+// Finds the first location on the given line in each method of a class that
+// has code on the line. The locations array must be freed by the caller.
+static int findLineLocations(jvmtiEnv * jvmti_env, jclass clazz, jint line,
+                             struct breakpoint_location ** plocations,
+                             jint * pcount)
+{
+    int                          result       = 0;
+    jvmtiError                   error;
+    jint                         method_count = 0;
+    jmethodID *                  methods      = NULL;
+    jvmtiLineNumberEntry *       table;
+    jint                         table_count;
+    struct breakpoint_location * locations    = NULL;
+    jint                         count        = 0;
+    jint                         j, k;
+    jlocation                    first;
+    error = (*jvmti_env)->GetClassMethods(jvmti_env, clazz, &method_count,
+                                          &methods);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(jvmti_env, error, "failed to get class methods");
+        goto findLineLocations_end;
+    }
+    locations = (struct breakpoint_location *)malloc(
+        (method_count ? method_count : 1) *
+        sizeof(struct breakpoint_location));
+    if (!locations)
+    {
+        error1("breakpoint locations malloc returned NULL");
+        goto findLineLocations_end;
+    }
+    for (k = 0; k < method_count; ++k)
+    {
+        table = NULL;
+        error = (*jvmti_env)->GetLineNumberTable(jvmti_env, methods[k],
+                                                 &table_count, &table);
+        if (JVMTI_ERROR_ABSENT_INFORMATION == error ||
+            JVMTI_ERROR_NATIVE_METHOD == error)
+            continue;
+        else if (JVMTI_ERROR_NONE != error)
+        {
+            errorJVMTI(jvmti_env, error, "failed to get line number table");
+            goto findLineLocations_end;
+        }
+        first = -1;
+        for (j = 0; j < table_count; ++j)
+            if (line == table[j].line_number &&
+                (first < 0 || table[j].start_location < first))
+                first = table[j].start_location;
+        if (table)
+            (*jvmti_env)->Deallocate(jvmti_env, (unsigned char *)table);
+        if (first < 0)
+            continue;
+        locations[count].method = methods[k];
+        locations[count].location = first;
+        ++count;
+    }
+    *plocations = locations;
+    *pcount = count;
+    locations = NULL;
+    // Finished with success
+    result = 1;
+findLineLocations_end:
+    free(locations);
+    if (methods)
+        (*jvmti_env)->Deallocate(jvmti_env, (unsigned char *)methods);
+    return result;
+}
+
+// Clears the JVMTI breakpoints of a breakpoint, except for locations still
+// used by other breakpoints, and frees the slot. Caller must hold
+// g_breakpoints_lock.
+static void freeBreakpoint(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                           struct user_breakpoint * bp)
+{
+    jvmtiError error;
+    jint       k;
+    for (k = 0; k < bp->location_count; ++k)
+    {
+        if (isLocationShared(bp->id, bp->locations[k].method,
+                             bp->locations[k].location))
+            continue;
+        error = (*jvmti_env)->ClearBreakpoint(jvmti_env,
+                                              bp->locations[k].method,
+                                              bp->locations[k].location);
+        if (JVMTI_ERROR_NONE != error && JVMTI_ERROR_NOT_FOUND != error)
+            errorJVMTI(jvmti_env, error, "failed to clear breakpoint");
+    }
+    free(bp->locations);
+    if (bp->thread)
+        (*jni_env)->DeleteGlobalRef(jni_env, bp->thread);
+    if (bp->local_value)
+        (*jni_env)->DeleteGlobalRef(jni_env, bp->local_value);
+    memset(bp, 0, sizeof(*bp));
+}
+
+// Decides how a condition's value is compared. Returns 0, with an
+// IllegalArgumentException pending, if it can't be compared natively.
+static int classifyCondition(JNIEnv * jni_env, jobject value,
+                             enum condition_kind * pkind,
+                             const struct boxed_type ** pboxed)
+{
+    jclass    klass;
+    jmethodID equals;
+    size_t    k;
+    *pkind = CONDITION_IDENTITY;
+    *pboxed = NULL;
+    if (!value)
+        return 1;
+    if ((*jni_env)->IsInstanceOf(jni_env, value, g_string_class))
+    {
+        *pkind = CONDITION_STRING;
+        return 1;
+    }
+    for (k = 0; k < sizeof(g_boxed_types) / sizeof(g_boxed_types[0]); ++k)
+        if ((*jni_env)->IsInstanceOf(jni_env, value, g_boxed_types[k].klass))
+        {
+            *pkind = CONDITION_BOXED;
+            *pboxed = &g_boxed_types[k];
+            return 1;
+        }
+    // If the class doesn't override equals(), equals() is the same as identity
+    klass = (*jni_env)->GetObjectClass(jni_env, value);
+    equals = (*jni_env)->GetMethodID(jni_env, klass, EQUALS_METHOD_NAME,
+                                     EQUALS_METHOD_SIGNATURE);
+    (*jni_env)->DeleteLocalRef(jni_env, klass);
+    if (equals == g_equals_method)
+        return 1;
+    (*jni_env)->ExceptionClear(jni_env);
+    throwIllegalArgument(jni_env, "local value must be null, a String, a "
+                         "boxed primitive, or an object compared by identity");
+    return 0;
+}
+
+// Returns true iff value.equals(var_value) would, given how the value was
+// classified by classifyCondition(), but without running Java code
+static jboolean isValueEqual(JNIEnv * jni_env, jobject value,
+                             enum condition_kind kind,
+                             const struct boxed_type * boxed,
+                             jobject var_value)
+{
+    jsize         length;
+    const jchar * chars;
+    const jchar * var_chars;
+    jboolean      result;
+    jfieldID      field;
+    jfloat        f, var_f;
+    jdouble       d, var_d;
+    if ((*jni_env)->IsSameObject(jni_env, value, var_value))
+        return JNI_TRUE;
+    else if (CONDITION_IDENTITY == kind || !var_value)
+        return JNI_FALSE;
+    else if (CONDITION_STRING == kind)
+    {
+        if (!(*jni_env)->IsInstanceOf(jni_env, var_value, g_string_class))
+            return JNI_FALSE;
+        length = (*jni_env)->GetStringLength(jni_env, (jstring)value);
+        if (length != (*jni_env)->GetStringLength(jni_env, (jstring)var_value))
+            return JNI_FALSE;
+        chars = (*jni_env)->GetStringCritical(jni_env, (jstring)value, NULL);
+        var_chars = (*jni_env)->GetStringCritical(jni_env, (jstring)var_value,
+                                                  NULL);
+        result = chars && var_chars &&
+                 !memcmp(chars, var_chars, length * sizeof(jchar))
+               ? JNI_TRUE : JNI_FALSE;
+        if (var_chars)
+            (*jni_env)->ReleaseStringCritical(jni_env, (jstring)var_value,
+                                              var_chars);
+        if (chars)
+            (*jni_env)->ReleaseStringCritical(jni_env, (jstring)value, chars);
+        return result;
+    }
+    // The boxed classes are final, so the classes must be the same
+    if (!(*jni_env)->IsInstanceOf(jni_env, var_value, boxed->klass))
+        return JNI_FALSE;
+    field = boxed->value_field;
+    switch (boxed->signature[0])
+    {
+        case 'Z':
+            return (*jni_env)->GetBooleanField(jni_env, value, field) ==
+                   (*jni_env)->GetBooleanField(jni_env, var_value, field);
+        case 'C':
+            return (*jni_env)->GetCharField(jni_env, value, field) ==
+                   (*jni_env)->GetCharField(jni_env, var_value, field);
+        case 'B':
+            return (*jni_env)->GetByteField(jni_env, value, field) ==
+                   (*jni_env)->GetByteField(jni_env, var_value, field);
+        case 'S':
+            return (*jni_env)->GetShortField(jni_env, value, field) ==
+                   (*jni_env)->GetShortField(jni_env, var_value, field);
+        case 'I':
+            return (*jni_env)->GetIntField(jni_env, value, field) ==
+                   (*jni_env)->GetIntField(jni_env, var_value, field);
+        case 'J':
+            return (*jni_env)->GetLongField(jni_env, value, field) ==
+                   (*jni_env)->GetLongField(jni_env, var_value, field);
+        // Like equals(), NaN equals NaN but 0.0 doesn't equal -0.0
+        case 'F':
+            f = (*jni_env)->GetFloatField(jni_env, value, field);
+            var_f = (*jni_env)->GetFloatField(jni_env, var_value, field);
+            return (f != f && var_f != var_f) ||
+                   !memcmp(&f, &var_f, sizeof(f));
+        case 'D':
+            d = (*jni_env)->GetDoubleField(jni_env, value, field);
+            var_d = (*jni_env)->GetDoubleField(jni_env, var_value, field);
+            return (d != d && var_d != var_d) ||
+                   !memcmp(&d, &var_d, sizeof(d));
+        default:
+            return JNI_FALSE;
+    }
+}
+
+// Returns true iff the local variable named name in the top frame of thread
+// equals the condition's value, as decided by isValueEqual()
+static jboolean isLocalEqual(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                             jthread thread, jmethodID method,
+                             jlocation location,
+                             const struct breakpoint_conditions * cond)
+{
+    jboolean                  result      = JNI_FALSE;
+    jvmtiError                error;
+    jvmtiLocalVariableEntry * table       = NULL;
+    jint                      table_count = 0;
+    jobject                   var_value   = (jobject)NULL;
+    jint                      k;
+    error = (*jvmti_env)->GetLocalVariableTable(jvmti_env, method,
+                                                &table_count, &table);
+    if (JVMTI_ERROR_ABSENT_INFORMATION == error)
+        return JNI_FALSE;
+    else if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(jvmti_env, error, "getting local variable table");
+        return JNI_FALSE;
+    }
+    // Same range tests as fetchLocals()
+    for (k = 0; k < table_count; ++k)
+    {
+        if (location < table[k].start_location) continue;
+        if (table[k].start_location + table[k].length < location) continue;
+        if ('L' != table[k].signature[0] && '[' != table[k].signature[0])
+            continue;
+        if (strcmp(cond->local_name, table[k].name)) continue;
+        error = (*jvmti_env)->GetLocalObject(jvmti_env, thread, 0,
+                                             table[k].slot, &var_value);
+        if (JVMTI_ERROR_NONE != error)
+        {
+            errorJVMTI(jvmti_env, error, "failed to get local variable value");
+            goto isLocalEqual_end;
+        }
+        result = isValueEqual(jni_env, cond->local_value, cond->local_kind,
+                              cond->local_boxed, var_value);
+        break;
+    }
+isLocalEqual_end:
+    if (var_value)
+        (*jni_env)->DeleteLocalRef(jni_env, var_value);
+    if (table)
+        deallocateLocalVariableTable(jvmti_env, table, table_count);
+    return result;
+}
+
+// Captures the Suneido stack of the current thread and hands it to Java
+static void stopAtBreakpoint(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                             jthread thread, jint id)
+{
+    struct capture_params params;
+    struct stack_capture  capture;
+    jobject               info = (jobject)NULL;
+    memset(&params, 0, sizeof(params));
+    params.locals = JNI_TRUE;
+    params.hash = JNI_TRUE; // Stopping is rare, so the StackInfo gets it all
+    if (!captureStack(jvmti_env, jni_env, thread, &params, &capture))
+        goto stopAtBreakpoint_cleanup; // Error already reported
+    info = newStackInfo(jni_env, &capture);
+    if (!info)
+        goto stopAtBreakpoint_cleanup; // Error already reported
+    (*jni_env)->CallStaticVoidMethod(jni_env, g_breakpoints_class,
+                                     g_breakpoint_hit_method, id, info);
+    if ((*jni_env)->ExceptionCheck(jni_env))
+    {
+        error1("exception in breakpoint handler");
+        exceptionDescribe(jni_env);
+    }
+    (*jni_env)->DeleteLocalRef(jni_env, info);
+stopAtBreakpoint_cleanup:
+    releaseCapture(jvmti_env, jni_env, &capture);
+}
+
+// =============================================================================
+//                               AGENT INIT
+// =============================================================================
+
+// Must be called from the VM init callback
+int initBreakpoints(jvmtiEnv * jvmti_env, JNIEnv * jni_env)
+{
+    jvmtiError          error;
+    jclass              object_class;
+    struct boxed_type * boxed;
+    size_t              k;
+    error = (*jvmti_env)->CreateRawMonitor(jvmti_env, "jsdebug breakpoints",
+                                           &g_breakpoints_lock);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        fatalErrorJVMTI(jvmti_env, error, "failed to create breakpoints lock");
+        return 0;
+    }
+    // Conditions on local variables are compared natively, like equals()
+    object_class = (*jni_env)->FindClass(jni_env, JAVA_LANG_OBJECT_CLASS);
+    if (object_class)
+    {
+        g_equals_method = (*jni_env)->GetMethodID(jni_env, object_class,
+                                                  EQUALS_METHOD_NAME,
+                                                  EQUALS_METHOD_SIGNATURE);
+        (*jni_env)->DeleteLocalRef(jni_env, object_class);
+    }
+    if (!g_equals_method)
+    {
+        fatalError1("failed to find Object.equals()");
+        exceptionDescribe(jni_env);
+        return 0;
+    }
+    if (!getClassGlobalRef(jni_env, &g_string_class, JAVA_LANG_STRING_CLASS))
+        return 0; // Error already reported
+    for (k = 0; k < sizeof(g_boxed_types) / sizeof(g_boxed_types[0]); ++k)
+    {
+        boxed = &g_boxed_types[k];
+        if (!getClassGlobalRef(jni_env, &boxed->klass, boxed->class_name))
+            return 0; // Error already reported
+        boxed->value_field = (*jni_env)->GetFieldID(
+            jni_env, boxed->klass, BOXED_VALUE_FIELD_NAME, boxed->signature);
+        if (!boxed->value_field)
+        {
+            fatalError1("failed to find boxed primitive value field");
+            exceptionDescribe(jni_env);
+            return 0;
+        }
+    }
+    // Return success
+    return 1;
+}
+
+// =============================================================================
+//                               EVENT HANDLING
+// =============================================================================
+
+// Handles a hit on a breakpoint set by setBreakpoint(). Conditions and hit
+// counts are checked here, so Java only hears about hits that stop.
+void handleUserBreakpoint(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                          jthread thread, jmethodID method,
+                          jlocation location)
+{
+    struct breakpoint_conditions cond;
+    struct user_breakpoint *     bp;
+    jboolean                     stop;
+    jint                         k;
+    // Several breakpoints may share the location. Since the lock isn't held
+    // while conditions read locals through JVMTI, look at them one at a time.
+    for (k = 0; ; ++k)
+    {
+        memset(&cond, 0, sizeof(cond));
+        enterMonitor(jvmti_env, g_breakpoints_lock);
+        for (; k < g_breakpoint_capacity; ++k)
+        {
+            bp = &g_breakpoints[k];
+            if (bp->id && hasLocation(bp, method, location))
+            {
+                cond.id = bp->id;
+                if (bp->thread)
+                    cond.thread = (*jni_env)->NewLocalRef(jni_env, bp->thread);
+                strcpy(cond.local_name, bp->local_name);
+                if (bp->local_value)
+                    cond.local_value = (*jni_env)->NewLocalRef(
+                        jni_env, bp->local_value);
+                cond.local_kind = bp->local_kind;
+                cond.local_boxed = bp->local_boxed;
+                break;
+            }
+        }
+        exitMonitor(jvmti_env, g_breakpoints_lock);
+        if (!cond.id)
+            return;
+        stop = JNI_TRUE;
+        if (cond.thread &&
+            !(*jni_env)->IsSameObject(jni_env, thread, cond.thread))
+            stop = JNI_FALSE;
+        else if (cond.local_name[0] &&
+                 !isLocalEqual(jvmti_env, jni_env, thread, method, location,
+                               &cond))
+            stop = JNI_FALSE;
+        if (cond.thread)
+            (*jni_env)->DeleteLocalRef(jni_env, cond.thread);
+        if (cond.local_value)
+            (*jni_env)->DeleteLocalRef(jni_env, cond.local_value);
+        if (!stop)
+            continue;
+        // Count the hit, unless the breakpoint was cleared meanwhile
+        stop = JNI_FALSE;
+        enterMonitor(jvmti_env, g_breakpoints_lock);
+        if (k < g_breakpoint_capacity && cond.id == g_breakpoints[k].id)
+        {
+            bp = &g_breakpoints[k];
+            ++bp->hits;
+            stop = bp->ignore_count < bp->hits &&
+                   (bp->every <= 0 ||
+                    0 == (bp->hits - bp->ignore_count - 1) % bp->every);
+        }
+        exitMonitor(jvmti_env, g_breakpoints_lock);
+        if (stop)
+            stopAtBreakpoint(jvmti_env, jni_env, thread, cond.id);
+    }
+}
+
+// =============================================================================
+//                              JAVA INTERFACE
+// =============================================================================
+
+#ifdef _MSC_VER
+#pragma warning (push)
+#pragma warning (disable : 4100) // unreferenced formal parameter
+#endif // _MSC_VER
+
+// Sets a breakpoint on a line of a Suneido callable class and returns its id,
+// or 0 if no code in the class is on the line. When a thread hits the line,
+// the breakpoint is ignored unless the thread is the given thread (if thread
+// isn't null) and the local variable named localName equals localValue (if
+// localName isn't null). So that hits are checked without running Java code,
+// localValue must be null, a String, a boxed primitive, or an object whose
+// class doesn't override equals(). Of the remaining hits, the first
+// ignoreCount are skipped and after that, if every is positive, only every
+// every'th hit stops.
+// Stopping calls breakpointHit(id, stackInfo) in the thread that hit.
+// private static native int setBreakpoint(Class<?> callable, int line,
+//     Thread thread, String localName, Object localValue, int ignoreCount,
+//     int every);
+JNIEXPORT jint JNICALL Java_suneido_debug_Breakpoints_setBreakpoint(
+    JNIEnv * jni_env, jclass clazz, jclass callable, jint line,
+    jthread thread, jstring local_name, jobject local_value, jint ignore_count,
+    jint every)
+{
+    jint                         result         = 0;
+    jvmtiError                   error;
+    struct breakpoint_location * locations      = NULL;
+    jint                         location_count = 0;
+    struct user_breakpoint *     bp;
+    const char *                 name_chars;
+    enum condition_kind          local_kind;
+    const struct boxed_type *    local_boxed;
+    jint                         k;
+    if (!callable || !g_stack_frame_class ||
+        !(*jni_env)->IsAssignableFrom(jni_env, callable, g_stack_frame_class))
+    {
+        throwIllegalArgument(jni_env, "not a Suneido callable class");
+        return 0;
+    }
+    if (local_name &&
+        MAX_LOCAL_NAME <= (*jni_env)->GetStringUTFLength(jni_env, local_name))
+    {
+        throwIllegalArgument(jni_env, "local variable name too long");
+        return 0;
+    }
+    if (!classifyCondition(jni_env, local_name ? local_value : (jobject)NULL,
+                           &local_kind, &local_boxed))
+        return 0; // IllegalArgumentException pending
+    if (!findLineLocations(g_jvmti, callable, line, &locations,
+                           &location_count))
+        return 0; // Error already reported
+    if (0 == location_count)
+    {
+        free(locations);
+        return 0;
+    }
+    enterMonitor(g_jvmti, g_breakpoints_lock);
+    // The Java side of the interface is found the first time it's used
+    if (!g_breakpoints_class && !findBreakpointHit(jni_env, clazz))
+        goto setBreakpoint_end; // Error already reported
+    bp = allocBreakpoint();
+    if (!bp)
+        goto setBreakpoint_end; // Error already reported
+    bp->locations = locations;
+    bp->location_count = location_count;
+    locations = NULL;
+    if (thread)
+        bp->thread = (jthread)(*jni_env)->NewGlobalRef(jni_env, thread);
+    if (local_name)
+    {
+        name_chars = (*jni_env)->GetStringUTFChars(jni_env, local_name, NULL);
+        if (!name_chars)
+            goto setBreakpoint_free; // OutOfMemoryError pending
+        strcpy(bp->local_name, name_chars);
+        (*jni_env)->ReleaseStringUTFChars(jni_env, local_name, name_chars);
+        if (local_value)
+            bp->local_value = (*jni_env)->NewGlobalRef(jni_env, local_value);
+        bp->local_kind = local_kind;
+        bp->local_boxed = local_boxed;
+    }
+    bp->ignore_count = ignore_count;
+    bp->every = every;
+    bp->id = ++g_last_breakpoint_id;
+    for (k = 0; k < bp->location_count; ++k)
+    {
+        error = (*g_jvmti)->SetBreakpoint(g_jvmti, bp->locations[k].method,
+                                          bp->locations[k].location);
+        if (JVMTI_ERROR_NONE != error && JVMTI_ERROR_DUPLICATE != error)
+        {
+            errorJVMTI(g_jvmti, error, "failed to set breakpoint");
+            goto setBreakpoint_free;
+        }
+    }
+    result = bp->id;
+    goto setBreakpoint_end;
+setBreakpoint_free:
+    freeBreakpoint(g_jvmti, jni_env, bp);
+setBreakpoint_end:
+    exitMonitor(g_jvmti, g_breakpoints_lock);
+    free(locations);
+    return result;
+}
+
+// Clears a breakpoint set by setBreakpoint(). Returns false if there is no
+// breakpoint with the given id.
+// private static native boolean clearBreakpoint(int id);
+JNIEXPORT jboolean JNICALL Java_suneido_debug_Breakpoints_clearBreakpoint(
+    JNIEnv * jni_env, jclass clazz, jint id)
+{
+    jboolean result = JNI_FALSE;
+    jint     k;
+    if (!g_breakpoints_lock || id <= 0)
+        return JNI_FALSE;
+    enterMonitor(g_jvmti, g_breakpoints_lock);
+    for (k = 0; k < g_breakpoint_capacity; ++k)
+        if (id == g_breakpoints[k].id)
+        {
+            freeBreakpoint(g_jvmti, jni_env, &g_breakpoints[k]);
+            result = JNI_TRUE;
+            break;
+        }
+    exitMonitor(g_jvmti, g_breakpoints_lock);
+    return result;
+}
+
+#ifdef _MSC_VER
+#pragma warning (pop)
+#endif // _MSC_VER
@@ -0,0 +1,566 @@
+/* Copyright 2026 (c) Suneido Software Corp. All rights reserved.
+ * Licensed under GPLv2.
+ */
+
+#ifdef _MSC_VER
+#pragma warning (disable : 4001) /* nonstandard extension: '//-style' comment */
+#endif // _MSC_VER
+
+//==============================================================================
+// file: capture.c
+// auth: agent
+// date: 20261018
+// desc: Capture core: walks a thread's stack once into a plain C snapshot of
+//       its Suneido frames and their locals, plus the sinks that turn a
+//       snapshot into a log line or a binary buffer. The StackInfo sink lives
+//       in locals.c and the profile sink in profile.c.
+//==============================================================================
+
+#include "jsdebug.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+// =============================================================================
+//                                 CONSTANTS
+// =============================================================================
+
+// Parameters for compressing runs of repeated Suneido frames (recursion)
+enum
+{
+    COMPRESS_MAX_PERIOD       = 16, /* longest (method, line) cycle detected */
+    COMPRESS_KEEP_OCCURRENCES = 2,  /* full occurrences kept at each end */
+    COMPRESS_MIN_REPEATS      = 2 * COMPRESS_KEEP_OCCURRENCES + 2,
+};
+
+enum
+{
+    MAX_FRAME_NAME        = 256,
+    TEXT_INITIAL_CAPACITY = 1024,
+};
+
+// =============================================================================
+//                             HELPER FUNCTIONS
+// =============================================================================
+
+int appendText(struct text_buf * buf, const char * str, size_t length)
+{
+    if (buf->capacity < buf->length + length + 1)
+    {
+        size_t new_capacity = buf->capacity ? buf->capacity
+                                            : TEXT_INITIAL_CAPACITY;
+        char * new_data;
+        while (new_capacity < buf->length + length + 1)
+            new_capacity *= 2;
+        new_data = (char *)realloc(buf->data, new_capacity);
+        if (!new_data)
+        {
+            error1("text buffer realloc returned NULL");
+            return 0;
+        }
+        buf->data = new_data;
+        buf->capacity = new_capacity;
+    }
+    memcpy(buf->data + buf->length, str, length);
+    buf->length += length;
+    buf->data[buf->length] = '\0';
+    return 1;
+}
+
+// Appends a big-endian integer of the given number of bytes, as read by
+// java.io.DataInputStream
+static int appendBigEndian(struct text_buf * buf, unsigned long long x,
+                           int bytes)
+{
+    char data[8];
+    int  k;
+    assert(0 < bytes && bytes <= (int)sizeof(data));
+    for (k = bytes - 1; 0 <= k; --k, x >>= 8)
+        data[k] = (char)(x & 0xff);
+    return appendText(buf, data, (size_t)bytes);
+}
+
+void deallocateLocalVariableTable(jvmtiEnv * jvmti_env,
+                                  jvmtiLocalVariableEntry * table, jint count)
+
+{
+    jint k;
+    assert(table || !"Local variable table should not be null");
+    for (k = 0; k < count; ++k)
+    {
+        (*jvmti_env)->Deallocate(jvmti_env, (unsigned char *)table[k].name);
+        (*jvmti_env)->Deallocate(jvmti_env,
+                                (unsigned char *)table[k].signature);
+        (*jvmti_env)->Deallocate(jvmti_env,
+                                 (unsigned char *)table[k].generic_signature);
+    }
+    (*jvmti_env)->Deallocate(jvmti_env, (unsigned char *)table);
+}
+
+static jint countRepeats(const struct suneido_frame * frames, jint count,
+                         jint start, jint period)
+{
+    jint repeats = 1;
+    jint j;
+    for (; start + (repeats + 1) * period <= count; ++repeats)
+    {
+        for (j = 0; j < period; ++j)
+        {
+            const struct suneido_frame * a = &frames[start + j];
+            const struct suneido_frame * b =
+                &frames[start + repeats * period + j];
+            if (a->method != b->method || a->line_number != b->line_number)
+                return repeats;
+        }
+    }
+    return repeats;
+}
+
+// Finds runs in which a cycle of up to COMPRESS_MAX_PERIOD Suneido frames,
+// identified by (method, line number), repeats itself. The first and last
+// COMPRESS_KEEP_OCCURRENCES occurrences of the cycle are left alone. The
+// occurrence after the first kept ones is the representative of all the
+// occurrences in the middle: each of its frames gets a repeat_count equal to
+// the number of occurrences it stands for. The remaining middle occurrences
+// are marked REPEAT_ELIDED and are not output at all.
+static void compressRecursion(struct suneido_frame * frames, jint count)
+{
+    jint i = 0;
+    jint period, repeats;
+    jint best_period, best_repeats;
+    jint first, last, k;
+    while (i < count)
+    {
+        // Prefer the period covering the most frames. On a tie the shortest
+        // period wins, since e.g. "ABABAB" is also "ABAB" repeated.
+        best_period = 0;
+        best_repeats = 0;
+        for (period = 1; period <= COMPRESS_MAX_PERIOD &&
+                         i + COMPRESS_MIN_REPEATS * period <= count; ++period)
+        {
+            repeats = countRepeats(frames, count, i, period);
+            if (COMPRESS_MIN_REPEATS <= repeats &&
+                best_period * best_repeats < period * repeats)
+            {
+                best_period = period;
+                best_repeats = repeats;
+            }
+        }
+        if (!best_period)
+        {
+            ++i;
+            continue;
+        }
+        first = i + COMPRESS_KEEP_OCCURRENCES * best_period;
+        last = i + (best_repeats - COMPRESS_KEEP_OCCURRENCES) * best_period;
+        for (k = first; k < first + best_period; ++k)
+            frames[k].repeat_count =
+                best_repeats - 2 * COMPRESS_KEEP_OCCURRENCES;
+        for (; k < last; ++k)
+            frames[k].repeat_count = REPEAT_ELIDED;
+        i += best_repeats * best_period;
+    }
+}
+
+// Keeps the value of the local variable in the given slot of the frame at the
+// given depth if it is a non-null reference. Returns 1 on success, 0 on error,
+// and -1 if the frame's locals can't be read at all.
+static int fetchLocal(jvmtiEnv * jvmti_env, jthread thread, jint depth,
+                      jint slot, const char * name,
+                      struct captured_locals * locals)
+{
+    jvmtiError error;
+    jobject    var_value = (jobject)NULL;
+    error = (*jvmti_env)->GetLocalObject(jvmti_env, thread, depth, slot,
+                                         &var_value);
+    if (JVMTI_ERROR_TYPE_MISMATCH == error) return 1; // Not an Object
+    // A virtual thread frame whose locals the VM can't expose. Keep the
+    // (possibly empty) locals we have so far rather than failing the whole
+    // capture.
+    if (JVMTI_ERROR_OPAQUE_FRAME == error) return -1;
+    if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(jvmti_env, error, "failed to get local variable value");
+        return 0;
+    }
+    if (!var_value) return 1; // Don't keep null values
+    locals->names[locals->count] = name;
+    locals->values[locals->count] = var_value;
+    ++locals->count;
+    return 1;
+}
+
+// Fetches the non-null reference locals of a frame using the method index's
+// local variable table, whose names are never freed. Returns -1 if the method
+// isn't indexed.
+static int fetchIndexedLocals(jvmtiEnv * jvmti_env, jthread thread,
+                              jint depth, jmethodID method, jlocation location,
+                              struct captured_locals * locals)
+{
+    int                          result = 0;
+    const struct indexed_local * table;
+    jint                         table_count;
+    jint                         k;
+    int                          fetched;
+    if (!lookupIndexedLocals(method, &table, &table_count))
+        return -1;
+    if (table_count < 0)
+        return 0; // The method has no local variable table
+    locals->fetched = JNI_TRUE;
+    if (table_count < 1)
+        return 1;
+    noteCapturedFrame(jvmti_env, method);
+    locals->names = (const char **)malloc(table_count * sizeof(const char *));
+    locals->values = (jobject *)malloc(table_count * sizeof(jobject));
+    if (!locals->names || !locals->values)
+    {
+        error1("captured locals malloc returned NULL");
+        goto fetchIndexedLocals_end;
+    }
+    for (k = 0; k < table_count; ++k)
+    {
+        if (location < table[k].start_location) continue;
+        if (table[k].start_location + table[k].length < location) continue;
+        fetched = fetchLocal(jvmti_env, thread, depth, table[k].slot,
+                             table[k].name, locals);
+        if (!fetched) goto fetchIndexedLocals_end;
+        if (fetched < 0) break;
+    }
+    result = 1;
+fetchIndexedLocals_end:
+    return result;
+}
+
+// Fetches the non-null reference locals of the frame at the given depth.
+static int fetchLocals(jvmtiEnv * jvmti_env, jthread thread, jint depth,
+                       jmethodID method, jlocation location,
+                       struct captured_locals * locals)
+{
+    jvmtiError error;
+    jint       table_index;
+    int        fetched;
+    // Methods of indexed classes don't need to ask JVMTI
+    fetched = fetchIndexedLocals(jvmti_env, thread, depth, method, location,
+                                 locals);
+    if (0 <= fetched)
+        return fetched;
+    // Get the local variable table for this method
+    error = (*jvmti_env)->GetLocalVariableTable(jvmti_env, method,
+        &locals->table_count,
+        &locals->table);
+    if (JVMTI_ERROR_ABSENT_INFORMATION == error)
+        return 0;
+    else if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(jvmti_env, error, "getting local variable table");
+        return 0;
+    }
+    locals->fetched = JNI_TRUE;
+    // NOTE: If the entry count is zero, GetLocalVariableTable() sometimes
+    //       doesn't allocate memory for the table itself. This function is
+    //       robust in that scenario and will simply find no locals.
+    assert(0 <= locals->table_count ||
+           !"local table may not have negative size");
+    if (locals->table_count < 1)
+        return 1;
+    noteCapturedFrame(jvmti_env, method);
+    locals->names = (const char **)malloc(locals->table_count *
+                                          sizeof(const char *));
+    locals->values = (jobject *)malloc(locals->table_count * sizeof(jobject));
+    if (!locals->names || !locals->values)
+    {
+        error1("captured locals malloc returned NULL");
+        return 0;
+    }
+    // Iterate over the entries in the local variables table. For every
+    // valid entry that is a non-null reference to an Object, keep its name and
+    // value.
+    for (table_index = 0; table_index < locals->table_count; ++table_index)
+    {
+        jvmtiLocalVariableEntry * entry = &locals->table[table_index];
+        if (location < entry->start_location) continue;
+        if (entry->start_location + entry->length < location) continue;
+        if ('L' != entry->signature[0] && '[' != entry->signature[0]) continue;
+        fetched = fetchLocal(jvmti_env, thread, depth, entry->slot,
+                             entry->name, locals);
+        if (!fetched) return 0;
+        if (fetched < 0) break;
+    } // for
+    return 1;
+}
+
+// =============================================================================
+//                               CAPTURE CORE
+// =============================================================================
+
+// Captures the Suneido stack of the given thread, which must be the current
+// thread or suspended. Whether or not it succeeds, the capture must be
+// released with releaseCapture().
+int captureStack(jvmtiEnv * jvmti_env, JNIEnv * jni_env, jthread thread,
+                 const struct capture_params * params,
+                 struct stack_capture * capture)
+{
+    jvmtiError error;
+    jint       frame_count        = 0;
+    jint       locals_frame_count = 0;
+    jint       k;
+    capture->java_frame_count = 0;
+    capture->count = 0;
+    capture->frames = capture->frames_stack;
+    capture->locals = NULL;
+    capture->hash = 0;
+    capture->frame_buffer = capture->frame_buffer_stack;
+    // There are no Suneido frames until the VM is initialized
+    if (g_stack_frame_class)
+    {
+        // Fetch the thread's frame count
+        error = (*jvmti_env)->GetFrameCount(jvmti_env, thread, &frame_count);
+        if (JVMTI_ERROR_NONE != error)
+        {
+            errorJVMTI(jvmti_env, error, "from GetFrameCount()");
+            return 0;
+        }
+    }
+    if (params->start_depth < frame_count)
+        frame_count -= params->start_depth;
+    else
+        frame_count = 0;
+    if (CAPTURE_STACK_FRAMES < frame_count)
+    {
+        capture->frame_buffer = (jvmtiFrameInfo *)malloc(
+                                    frame_count * sizeof(jvmtiFrameInfo));
+        capture->frames = (struct suneido_frame *)malloc(
+                              frame_count * sizeof(struct suneido_frame));
+        if (!capture->frame_buffer || !capture->frames)
+        {
+            error1("stack capture malloc returned NULL");
+            return 0;
+        }
+    }
+    // Fetch the basic stack trace. If the thread is a virtual thread, JVMTI
+    // gives us only the virtual thread's own frames, never those of the
+    // carrier thread it is mounted on.
+    if (0 < frame_count)
+    {
+        error = (*jvmti_env)->GetStackTrace(jvmti_env, thread,
+                                            params->start_depth, frame_count,
+                                            capture->frame_buffer,
+                                            &frame_count);
+        if (JVMTI_ERROR_NONE != error)
+        {
+            errorJVMTI(jvmti_env, error, "from GetStackTrace()");
+            return 0;
+        }
+    }
+    capture->java_frame_count = frame_count;
+    // Find the Suneido frames and, if wanted, the stack signature hash
+    if (!findSuneidoFrames(jvmti_env, jni_env, thread, params->start_depth,
+                           capture->frame_buffer, frame_count,
+                           params->minimize_deopt, capture->frames,
+                           &capture->count,
+                           params->hash ? &capture->hash : NULL))
+        return 0; // Error already reported
+    if (params->compress)
+        compressRecursion(capture->frames, capture->count);
+    if (!params->locals)
+        return 1;
+    // Fetch the locals of the frames that want them
+    capture->locals = (struct captured_locals *)calloc(
+                          capture->count + 1, sizeof(struct captured_locals));
+    if (!capture->locals)
+    {
+        error1("captured locals calloc returned NULL");
+        return 0;
+    }
+    for (k = 0; k < capture->count; ++k)
+    {
+        const struct suneido_frame * f = &capture->frames[k];
+        // The representative of a run of repeated frames gets a repeat count
+        // but no locals.
+        if (f->repeat_count)
+            continue;
+        // Only the top localsFrameLimit frames get locals, if there's a limit
+        if (0 < params->locals_frame_limit &&
+            params->locals_frame_limit <= locals_frame_count)
+            continue;
+        ++locals_frame_count;
+        if (!fetchLocals(jvmti_env, thread,
+                         params->start_depth + f->frame_index, f->method,
+                         f->location, &capture->locals[k]))
+            return 0; // Error already reported
+    } // for k in [0 .. capture->count)
+    return 1;
+}
+
+void releaseCapture(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                    struct stack_capture * capture)
+{
+    jint k, j;
+    if (capture->locals)
+    {
+        for (k = 0; k < capture->count; ++k)
+        {
+            struct captured_locals * l = &capture->locals[k];
+            for (j = 0; j < l->count; ++j)
+                (*jni_env)->DeleteLocalRef(jni_env, l->values[j]);
+            free((void *)l->names);
+            free(l->values);
+            if (l->table)
+                deallocateLocalVariableTable(jvmti_env, l->table,
+                                             l->table_count);
+            else
+                assert(0 == l->table_count);
+        }
+        free(capture->locals);
+    }
+    if (capture->frame_buffer != capture->frame_buffer_stack)
+        free(capture->frame_buffer);
+    if (capture->frames != capture->frames_stack)
+        free(capture->frames);
+}
+
+// Writes the name of a Suneido frame, "Callable:line", into buffer,
+// truncating if necessary.
+int captureFrameName(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                     const struct suneido_frame * frame, char * buffer,
+                     size_t size)
+{
+    int        result = 0;
+    jvmtiError error;
+    jclass     declaring_class = (jclass)NULL;
+    char *     class_signature = NULL;
+    char       line[16];
+    size_t     length;
+    error = (*jvmti_env)->GetMethodDeclaringClass(jvmti_env, frame->method,
+                                                  &declaring_class);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(jvmti_env, error, "failed to get method declaring class");
+        goto captureFrameName_end;
+    }
+    error = (*jvmti_env)->GetClassSignature(jvmti_env, declaring_class,
+                                            &class_signature, NULL);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(jvmti_env, error, "failed to get class signature");
+        goto captureFrameName_end;
+    }
+    formatClassName(class_signature, JNI_TRUE, buffer, size);
+    if (0 <= frame->line_number)
+    {
+        sprintf(line, ":%d", (int)frame->line_number);
+        length = strlen(buffer);
+        strncpy(buffer + length, line, size - length - 1);
+        buffer[size - 1] = '\0';
+    }
+    // Finished with success
+    result = 1;
+captureFrameName_end:
+    if (class_signature)
+        (*jvmti_env)->Deallocate(jvmti_env, (unsigned char *)class_signature);
+    if (declaring_class)
+        (*jni_env)->DeleteLocalRef(jni_env, declaring_class);
+    return result;
+}
+
+// =============================================================================
+//                                   SINKS
+// =============================================================================
+
+// Writes a capture to stderr, one line per Suneido frame, innermost first
+void logCapture(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                const struct stack_capture * capture, const char * title)
+{
+    char name[MAX_FRAME_NAME];
+    char number[32];
+    jint k, j;
+    fputs("jsdebug: ", stderr);
+    fputs(title, stderr);
+    sprintf(number, " [%016llx]\n", capture->hash);
+    fputs(number, stderr);
+    for (k = 0; k < capture->count; ++k)
+    {
+        const struct suneido_frame * f = &capture->frames[k];
+        if (REPEAT_ELIDED == f->repeat_count)
+            continue;
+        if (!captureFrameName(jvmti_env, jni_env, f, name, sizeof(name)))
+            strcpy(name, "?");
+        fputs("    ", stderr);
+        fputs(name, stderr);
+        if (0 < f->repeat_count)
+        {
+            sprintf(number, " (repeated %d times)", (int)f->repeat_count);
+            fputs(number, stderr);
+        }
+        if (capture->locals && 0 < capture->locals[k].count)
+        {
+            fputs(" locals:", stderr);
+            for (j = 0; j < capture->locals[k].count; ++j)
+            {
+                fputc(' ', stderr);
+                fputs(capture->locals[k].names[j], stderr);
+            }
+        }
+        fputc('\n', stderr);
+    }
+    fflush(stderr);
+}
+
+// Serializes a capture, without locals, into a Java byte array readable with
+// java.io.DataInputStream:
+//
+//     long  stack hash
+//     int   number of frames that follow, innermost first, each being:
+//         int   index of the Java frame (as in the StackInfo arrays)
+//         int   line number
+//         int   repeat count (0 if the frame isn't a repeat representative)
+//         byte  1 if the frame is a call, 0 if it is an eval
+//         UTF   "Callable:line" frame name (see DataInputStream.readUTF())
+//
+// Returns NULL on failure.
+jbyteArray captureToBytes(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                          const struct stack_capture * capture)
+{
+    struct text_buf buf;
+    char            name[MAX_FRAME_NAME];
+    size_t          name_length;
+    jint            count = 0;
+    jint            k;
+    jbyteArray      result = (jbyteArray)NULL;
+    memset(&buf, 0, sizeof(buf));
+    for (k = 0; k < capture->count; ++k)
+        if (REPEAT_ELIDED != capture->frames[k].repeat_count)
+            ++count;
+    if (!appendBigEndian(&buf, capture->hash, 8) ||
+        !appendBigEndian(&buf, (unsigned long long)count, 4))
+        goto captureToBytes_end;
+    for (k = 0; k < capture->count; ++k)
+    {
+        const struct suneido_frame * f = &capture->frames[k];
+        if (REPEAT_ELIDED == f->repeat_count)
+            continue;
+        if (!captureFrameName(jvmti_env, jni_env, f, name, sizeof(name)))
+            goto captureToBytes_end; // Error already reported
+        name_length = strlen(name);
+        if (!appendBigEndian(&buf, (unsigned int)f->frame_index, 4) ||
+            !appendBigEndian(&buf, (unsigned int)f->line_number, 4) ||
+            !appendBigEndian(&buf, (unsigned int)f->repeat_count, 4) ||
+            !appendBigEndian(&buf, f->is_call ? 1 : 0, 1) ||
+            !appendBigEndian(&buf, name_length, 2) ||
+            !appendText(&buf, name, name_length))
+            goto captureToBytes_end;
+    }
+    result = (*jni_env)->NewByteArray(jni_env, (jsize)buf.length);
+    if (!result)
+    {
+        error1("failed to create stack bytes array");
+        goto captureToBytes_end;
+    }
+    (*jni_env)->SetByteArrayRegion(jni_env, result, 0, (jsize)buf.length,
+                                   (const jbyte *)buf.data);
+captureToBytes_end:
+    free(buf.data);
+    return result;
+}
@@ -0,0 +1,289 @@
+/* Copyright 2026 (c) Suneido Software Corp. All rights reserved.
+ * Licensed under GPLv2.
+ */
+
+#ifdef _MSC_VER
+#pragma warning (disable : 4001) /* nonstandard extension: '//-style' comment */
+#endif // _MSC_VER
+
+//==============================================================================
+// file: compiled.c
+// auth: agent
+// date: 20261018
+// desc: Receives compiled method events and, if the jitcounts option is on,
+//       tracks JIT-compiled methods so the damage stack captures may do to
+//       compiled code (deoptimization followed by recompilation) can be
+//       estimated
+//==============================================================================
+
+#include "jsdebug.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+// =============================================================================
+//                                 CONSTANTS
+// =============================================================================
+
+enum
+{
+    COMPILED_TABLE_INITIAL_CAPACITY = 1024, /* must be a power of 2 */
+};
+
+// Indices into the array returned by StackInfo.getJitCounts(). These must be
+// kept in sync with the equivalent constants in suneido/debug/StackInfo.java.
+//
+// JVMTI doesn't report deoptimizations, so these are only a heuristic. The
+// "after" counts include everything that happened to the compiled code
+// of a touched method afterwards, whether the capture caused it or not, e.g.
+// ordinary tiered recompilation from C1 to C2, or unloading of code that was
+// about to be thrown away anyway. They are an upper bound on the damage done
+// by captures, best compared between runs with and without captures.
+enum jit_count
+{
+    JIT_COUNT_FRAMES_TOUCHED   = 0, /* compiled frames we read from */
+    JIT_COUNT_UNLOADED_AFTER   = 1, /* touched code later unloaded */
+    JIT_COUNT_RECOMPILED_AFTER = 2, /* touched methods later compiled again */
+    JIT_COUNT_SIZE,
+};
+
+// =============================================================================
+//                                  GLOBALS
+// =============================================================================
+
+// One entry per method that has ever been compiled. Entries are never removed,
+// so the table is bounded by the number of distinct compiled methods.
+struct compiled_method
+{
+    jmethodID method;     // NULL if the slot is empty
+    jint      load_count; // Number of compiled versions currently loaded
+    jboolean  touched;    // Captured while compiled, not recompiled since
+};
+
+static jrawMonitorID            g_compiled_lock;
+static struct compiled_method * g_compiled_table;
+static jint                     g_compiled_capacity;
+static jint                     g_compiled_size;
+static jlong                    g_jit_counts[JIT_COUNT_SIZE];
+
+// =============================================================================
+//                             HELPER FUNCTIONS
+// =============================================================================
+
+// Returns the slot containing method or, if it isn't in the table, the empty
+// slot where it belongs. Caller must hold g_compiled_lock.
+static struct compiled_method * findSlot(struct compiled_method * table,
+                                         jint capacity, jmethodID method)
+{
+    size_t mask = (size_t)capacity - 1;
+    size_t k    = hashMethodID(method) & mask;
+    while (table[k].method && table[k].method != method)
+        k = (k + 1) & mask;
+    return &table[k];
+}
+
+static int growTable()
+{
+    jint                     new_capacity = g_compiled_capacity * 2;
+    struct compiled_method * new_table;
+    jint                     k;
+    new_table = (struct compiled_method *)calloc(
+                    new_capacity, sizeof(struct compiled_method));
+    if (!new_table)
+    {
+        error1("compiled method table calloc returned NULL");
+        return 0;
+    }
+    for (k = 0; k < g_compiled_capacity; ++k)
+        if (g_compiled_table[k].method)
+            *findSlot(new_table, new_capacity, g_compiled_table[k].method) =
+                g_compiled_table[k];
+    free(g_compiled_table);
+    g_compiled_table = new_table;
+    g_compiled_capacity = new_capacity;
+    return 1;
+}
+
+// Caller must hold g_compiled_lock. Returns NULL if out of memory.
+static struct compiled_method * findOrInsert(jmethodID method)
+{
+    struct compiled_method * entry;
+    entry = findSlot(g_compiled_table, g_compiled_capacity, method);
+    if (entry->method)
+        return entry;
+    // Keep the load factor at or below 3/4
+    if (g_compiled_capacity * 3 <= (g_compiled_size + 1) * 4)
+    {
+        if (!growTable())
+            return NULL;
+        entry = findSlot(g_compiled_table, g_compiled_capacity, method);
+    }
+    entry->method = method;
+    ++g_compiled_size;
+    return entry;
+}
+
+// =============================================================================
+//                               AGENT INIT
+// =============================================================================
+
+void addCompiledMethodCapabilities(jvmtiCapabilities * caps)
+{
+    caps->can_generate_compiled_method_load_events = 1;
+}
+
+// Enables compiled method events, which are needed by the jitcounts and
+// perfmap options. The methods are only tracked if jitcounts is on.
+int initCompiledMethods(jvmtiEnv * jvmti_env)
+{
+    jvmtiError error;
+    if (!g_options.jit_counts)
+        goto initCompiledMethods_events;
+    error = (*jvmti_env)->CreateRawMonitor(jvmti_env, "jsdebug compiled",
+                                           &g_compiled_lock);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        fatalErrorJVMTI(jvmti_env, error,
+                        "failed to create compiled method lock");
+        return 0;
+    }
+    g_compiled_table = (struct compiled_method *)calloc(
+        COMPILED_TABLE_INITIAL_CAPACITY, sizeof(struct compiled_method));
+    if (!g_compiled_table)
+    {
+        fatalError1("compiled method table calloc returned NULL");
+        return 0;
+    }
+    g_compiled_capacity = COMPILED_TABLE_INITIAL_CAPACITY;
+initCompiledMethods_events:
+    // Start listening for compilations straight away so the table is complete
+    // by the time the first capture happens.
+    error = (*jvmti_env)->SetEventNotificationMode(
+        jvmti_env, JVMTI_ENABLE, JVMTI_EVENT_COMPILED_METHOD_LOAD,
+        (jthread)NULL);
+    if (JVMTI_ERROR_NONE == error)
+        error = (*jvmti_env)->SetEventNotificationMode(
+            jvmti_env, JVMTI_ENABLE, JVMTI_EVENT_COMPILED_METHOD_UNLOAD,
+            (jthread)NULL);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        fatalErrorJVMTI(jvmti_env, error,
+                        "failed to enable compiled method events");
+        return 0;
+    }
+    // Return success
+    return 1;
+}
+
+// =============================================================================
+//                              CAPTURE HOOK
+// =============================================================================
+
+// Called by the capture code whenever it is about to read "this" or a local
+// variable from a frame executing the given method. If the method currently
+// has compiled code, HotSpot may have to deoptimize the frame to satisfy the
+// read, so the read is counted and the method is watched for recompilation.
+// Because JVMTI doesn't say whether a particular frame is compiled, this
+// over-counts frames of methods that are compiled but still have interpreted
+// activations on the stack. Does nothing unless the jitcounts option is on.
+void noteCapturedFrame(jvmtiEnv * jvmti_env, jmethodID method)
+{
+    struct compiled_method * entry;
+    if (!g_options.jit_counts)
+        return;
+    enterMonitor(jvmti_env, g_compiled_lock);
+    entry = findSlot(g_compiled_table, g_compiled_capacity, method);
+    if (entry->method && 0 < entry->load_count)
+    {
+        ++g_jit_counts[JIT_COUNT_FRAMES_TOUCHED];
+        entry->touched = JNI_TRUE;
+    }
+    exitMonitor(jvmti_env, g_compiled_lock);
+}
+
+// =============================================================================
+//                         COMPILED METHOD CALLBACKS
+// =============================================================================
+
+#ifdef _MSC_VER
+#pragma warning (push)
+#pragma warning (disable : 4100) // unreferenced formal parameter
+#endif // _MSC_VER
+
+void JNICALL callback_CompiledMethodLoad(jvmtiEnv * jvmti_env,
+                                         jmethodID method, jint code_size,
+                                         const void * code_addr,
+                                         jint map_length,
+                                         const jvmtiAddrLocationMap * map,
+                                         const void * compile_info)
+{
+    struct compiled_method * entry;
+    if (!g_options.jit_counts)
+        goto callback_CompiledMethodLoad_perf_map;
+    enterMonitor(jvmti_env, g_compiled_lock);
+    entry = findOrInsert(method);
+    if (entry)
+    {
+        if (entry->touched)
+        {
+            ++g_jit_counts[JIT_COUNT_RECOMPILED_AFTER];
+            entry->touched = JNI_FALSE;
+        }
+        ++entry->load_count;
+    }
+    exitMonitor(jvmti_env, g_compiled_lock);
+callback_CompiledMethodLoad_perf_map:
+    // Name the code for Linux perf if requested
+    perfMapCompiledMethod(jvmti_env, method, code_addr, code_size);
+}
+
+void JNICALL callback_CompiledMethodUnload(jvmtiEnv * jvmti_env,
+                                           jmethodID method,
+                                           const void * code_addr)
+{
+    struct compiled_method * entry;
+    if (!g_options.jit_counts)
+        return;
+    enterMonitor(jvmti_env, g_compiled_lock);
+    entry = findSlot(g_compiled_table, g_compiled_capacity, method);
+    if (entry->method)
+    {
+        if (0 < entry->load_count)
+            --entry->load_count;
+        // Leave the touched flag set so that the recompilation which usually
+        // follows is counted too.
+        if (entry->touched)
+            ++g_jit_counts[JIT_COUNT_UNLOADED_AFTER];
+    }
+    exitMonitor(jvmti_env, g_compiled_lock);
+}
+
+// =============================================================================
+//                              JAVA INTERFACE
+// =============================================================================
+
+// Gets the counts indexed by enum jit_count, which are all zero unless the
+// jitcounts option is on.
+// private static native long[] getJitCounts();
+JNIEXPORT jlongArray JNICALL Java_suneido_debug_StackInfo_getJitCounts(
+    JNIEnv * jni_env, jclass clazz)
+{
+    jlong      counts[JIT_COUNT_SIZE];
+    jlongArray result;
+    memset(counts, 0, sizeof(counts));
+    if (g_options.jit_counts)
+    {
+        enterMonitor(g_jvmti, g_compiled_lock);
+        memcpy(counts, g_jit_counts, sizeof(counts));
+        exitMonitor(g_jvmti, g_compiled_lock);
+    }
+    result = (*jni_env)->NewLongArray(jni_env, JIT_COUNT_SIZE);
+    if (result)
+        (*jni_env)->SetLongArrayRegion(jni_env, result, 0, JIT_COUNT_SIZE,
+                                       counts);
+    return result; // If NULL, an exception is pending
+}
+
+#ifdef _MSC_VER
+#pragma warning (pop)
+#endif // _MSC_VER
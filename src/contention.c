@@ -0,0 +1,96 @@
+/* Copyright 2026 (c) Suneido Software Corp. All rights reserved.
+ * Licensed under GPLv2.
+ */
+
+#ifdef _MSC_VER
+#pragma warning (disable : 4001) /* nonstandard extension: '//-style' comment */
+#endif // _MSC_VER
+
+//==============================================================================
+// file: contention.c
+// auth: agent
+// date: 20261018
+// desc: Profiles time spent waiting to enter contended Java monitors by the
+//       Suneido call stack of the waiting thread
+//==============================================================================
+
+#include "jsdebug.h"
+
+// =============================================================================
+//                               AGENT INIT
+// =============================================================================
+
+void addContentionCapabilities(jvmtiCapabilities * caps)
+{
+    caps->can_generate_monitor_events = 1;
+}
+
+int initContention(jvmtiEnv * jvmti_env)
+{
+    jvmtiError error;
+    if (!initThreadStates(jvmti_env) ||
+        !initProfile(jvmti_env, PROFILE_CONTENTION))
+        return 0; // Error already reported
+    error = (*jvmti_env)->SetEventNotificationMode(
+        jvmti_env, JVMTI_ENABLE, JVMTI_EVENT_MONITOR_CONTENDED_ENTER,
+        (jthread)NULL);
+    if (JVMTI_ERROR_NONE == error)
+        error = (*jvmti_env)->SetEventNotificationMode(
+            jvmti_env, JVMTI_ENABLE, JVMTI_EVENT_MONITOR_CONTENDED_ENTERED,
+            (jthread)NULL);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        fatalErrorJVMTI(jvmti_env, error,
+                        "failed to enable monitor contention events");
+        return 0;
+    }
+    // Return success
+    return 1;
+}
+
+// =============================================================================
+//                                 CALLBACKS
+// =============================================================================
+
+#ifdef _MSC_VER
+#pragma warning (push)
+#pragma warning (disable : 4100) // unreferenced formal parameter
+#endif // _MSC_VER
+
+void JNICALL callback_MonitorContendedEnter(jvmtiEnv * jvmti_env,
+                                            JNIEnv * jni_env, jthread thread,
+                                            jobject object)
+{
+    struct thread_state * state = getThreadState(jvmti_env, thread);
+    if (!state)
+        return; // Error already reported
+    // Walk the stack now rather than once the monitor is entered: the thread
+    // is about to wait anyway, whereas afterwards it would be holding the
+    // monitor everyone else is waiting for.
+    state->contended = JNI_FALSE;
+    if (!profileStack(jvmti_env, jni_env, thread, PROFILE_CONTENTION,
+                      &state->contended_hash))
+        return; // Error already reported
+    // Start the clock after the walk so only the wait itself is counted
+    if (JVMTI_ERROR_NONE ==
+        (*jvmti_env)->GetTime(jvmti_env, &state->contended_since))
+        state->contended = JNI_TRUE;
+}
+
+void JNICALL callback_MonitorContendedEntered(jvmtiEnv * jvmti_env,
+                                              JNIEnv * jni_env, jthread thread,
+                                              jobject object)
+{
+    struct thread_state * state = getThreadState(jvmti_env, thread);
+    jlong                 now;
+    if (!state || !state->contended)
+        return;
+    state->contended = JNI_FALSE;
+    if (JVMTI_ERROR_NONE == (*jvmti_env)->GetTime(jvmti_env, &now))
+        profileAdd(jvmti_env, PROFILE_CONTENTION, state->contended_hash, 1,
+                   now - state->contended_since);
+}
+
+#ifdef _MSC_VER
+#pragma warning (pop)
+#endif // _MSC_VER
@@ -0,0 +1,617 @@
+/* Copyright 2026 (c) Suneido Software Corp. All rights reserved.
+ * Licensed under GPLv2.
+ */
+
+#ifdef _MSC_VER
+#pragma warning (disable : 4001) /* nonstandard extension: '//-style' comment */
+#endif // _MSC_VER
+
+//==============================================================================
+// file: cpu.c
+// auth: agent
+// date: 20261018
+// desc: Profiles CPU use by Suneido call stack by sampling threads from a
+//       profiling timer signal with AsyncGetCallTrace(), which, unlike
+//       GetStackTrace(), doesn't have to wait for the thread to reach a
+//       safepoint
+//==============================================================================
+
+#include "jsdebug.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#ifdef __linux__
+#include <dlfcn.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif // __linux__
+
+#ifdef __linux__
+
+// =============================================================================
+//                                 CONSTANTS
+// =============================================================================
+
+enum
+{
+    CPU_METHOD_TABLE_CAPACITY = 65536, /* must be a power of 2 */
+    CPU_RING_SIZE             = 1024,  /* samples awaiting the drain thread */
+    CPU_TRACE_FRAMES          = 128,   /* Java frames walked per sample */
+    CPU_SAMPLE_FRAMES         = CAPTURE_STACK_FRAMES, /* Suneido frames kept */
+    CPU_DRAIN_INTERVAL_MS     = 100,
+};
+
+enum
+{
+    ACC_PUBLIC = 0x0001,
+    ACC_STATIC = 0x0008,
+};
+
+// States of a sample in the ring buffer
+enum sample_state
+{
+    SAMPLE_EMPTY = 0,
+    SAMPLE_BUSY  = 1, /* being written by a signal handler or being drained */
+    SAMPLE_FULL  = 2,
+};
+
+static const char * ASYNC_GET_CALL_TRACE_NAME = "AsyncGetCallTrace";
+static const char * DRAIN_THREAD_NAME         = "jsdebug CPU sampler";
+
+// =============================================================================
+//                                  GLOBALS
+// =============================================================================
+
+// AsyncGetCallTrace() isn't declared in any JDK header, but HotSpot exports
+// it from libjvm. A frame's lineno is really the bytecode index, or negative
+// for frames without one, such as native frames.
+typedef struct
+{
+    jint      lineno;
+    jmethodID method_id;
+} ASGCT_CallFrame;
+
+typedef struct
+{
+    JNIEnv *          env_id;
+    jint              num_frames; // If not positive, the walk failed
+    ASGCT_CallFrame * frames;
+} ASGCT_CallTrace;
+
+typedef void (*async_get_call_trace_fn)(ASGCT_CallTrace * trace, jint depth,
+                                        void * ucontext);
+
+// A method that can be the top Java frame of a Suneido callable invocation.
+// The table of these is filled in as classes are prepared, and read without
+// locking by the signal handler, so entries are never moved or removed and the
+// method field is written last.
+struct cpu_method
+{
+    jmethodID        method;   // NULL if the slot is empty
+    enum method_name name;
+    jint             class_id; // Same for all the methods of a class
+};
+
+struct cpu_frame
+{
+    jmethodID method;
+    jint      bci;
+    jboolean  is_call;
+};
+
+struct cpu_sample
+{
+    volatile int     state; // See enum sample_state
+    jint             count;
+    struct cpu_frame frames[CPU_SAMPLE_FRAMES]; // Innermost first
+};
+
+static async_get_call_trace_fn g_async_get_call_trace;
+static jrawMonitorID           g_cpu_lock;
+static struct cpu_method *     g_cpu_methods;
+static jint                    g_cpu_method_count;
+static jboolean                g_cpu_methods_full;
+static jint                    g_cpu_class_count;
+static struct cpu_sample *     g_cpu_samples;
+static volatile unsigned int   g_cpu_next_sample;
+static volatile unsigned int   g_cpu_lost;       // Ring buffer was full
+static volatile unsigned int   g_cpu_unwalkable; // AsyncGetCallTrace() failed
+static volatile unsigned int   g_cpu_truncated;  // Outer frames not walked
+static jlong                   g_cpu_period;     // Nanoseconds per sample
+static jboolean                g_cpu_started;
+static jboolean                g_cpu_stopped;
+static jboolean                g_cpu_draining;   // Drain thread is recording
+
+// =============================================================================
+//                             HELPER FUNCTIONS
+// =============================================================================
+
+// Signal safe. Returns NULL if the method isn't in the table.
+static const struct cpu_method * findMethod(jmethodID method)
+{
+    size_t    mask = CPU_METHOD_TABLE_CAPACITY - 1;
+    size_t    k    = hashMethodID(method) & mask;
+    jmethodID m;
+    for (;; k = (k + 1) & mask)
+    {
+        m = __atomic_load_n(&g_cpu_methods[k].method, __ATOMIC_ACQUIRE);
+        if (!m)
+            return NULL;
+        else if (m == method)
+            return &g_cpu_methods[k];
+    }
+}
+
+// Caller must hold g_cpu_lock
+static void insertMethod(jmethodID method, enum method_name name,
+                         jint class_id)
+{
+    size_t              mask = CPU_METHOD_TABLE_CAPACITY - 1;
+    size_t              k    = hashMethodID(method) & mask;
+    struct cpu_method * entry;
+    while (g_cpu_methods[k].method && g_cpu_methods[k].method != method)
+        k = (k + 1) & mask;
+    entry = &g_cpu_methods[k];
+    if (entry->method)
+        return;
+    // The table can't grow under the signal handler's feet, so keep the load
+    // factor at or below 3/4 by leaving out further methods
+    if (CPU_METHOD_TABLE_CAPACITY * 3 <= (g_cpu_method_count + 1) * 4)
+    {
+        if (!g_cpu_methods_full)
+            error1("CPU sampler method table is full");
+        g_cpu_methods_full = JNI_TRUE;
+        return;
+    }
+    entry->name = name;
+    entry->class_id = class_id;
+    __atomic_store_n(&entry->method, method, __ATOMIC_RELEASE);
+    ++g_cpu_method_count;
+}
+
+// Adds the methods of a Suneido callable class that can be the top Java frame
+// of an invocation to the method table. Other classes are ignored. The JVMTI
+// calls are made first, so the lock is only taken once per class, to insert.
+static int indexClass(jvmtiEnv * jvmti_env, JNIEnv * jni_env, jclass klass)
+{
+    int                result       = 0;
+    jvmtiError         error;
+    jint               method_count = 0;
+    jmethodID *        methods      = NULL;
+    enum method_name * names        = NULL;
+    jint               found        = 0;
+    jint               modifiers;
+    char *             method_name;
+    enum method_name   name;
+    jint               class_id;
+    jint               k;
+    if (!(*jni_env)->IsAssignableFrom(jni_env, klass, g_stack_frame_class))
+        return 1;
+    // This also makes sure every method has a jmethodID, without which
+    // AsyncGetCallTrace() can't name the method's frames
+    error = (*jvmti_env)->GetClassMethods(jvmti_env, klass, &method_count,
+                                          &methods);
+    if (JVMTI_ERROR_CLASS_NOT_PREPARED == error)
+        return 1; // Indexed when the class prepare event arrives
+    else if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(jvmti_env, error, "failed to get class methods");
+        return 0;
+    }
+    names = (enum method_name *)calloc(method_count ? method_count : 1,
+                                       sizeof(enum method_name));
+    if (!names)
+    {
+        error1("CPU sampler calloc returned NULL");
+        goto indexClass_end;
+    }
+    // Same tests as findSuneidoFrames(), except that "this" can't be looked
+    // at from a signal handler, so only the declaring class can be used
+    for (k = 0; k < method_count; ++k)
+    {
+        error = (*jvmti_env)->GetMethodModifiers(jvmti_env, methods[k],
+                                                 &modifiers);
+        if (JVMTI_ERROR_NONE != error)
+        {
+            errorJVMTI(jvmti_env, error, "failed to get method modifiers");
+            goto indexClass_end;
+        }
+        if (ACC_PUBLIC != (modifiers & (ACC_PUBLIC | ACC_STATIC)))
+            continue;
+        error = (*jvmti_env)->GetMethodName(jvmti_env, methods[k],
+                                            &method_name, NULL, NULL);
+        if (JVMTI_ERROR_NONE != error)
+        {
+            errorJVMTI(jvmti_env, error, "failed to get method name");
+            goto indexClass_end;
+        }
+        name = classifyMethodName(method_name);
+        (*jvmti_env)->Deallocate(jvmti_env, (unsigned char *)method_name);
+        if (METHOD_NAME_UNKNOWN == name)
+            continue;
+        // Keep the wanted methods at the front of the array
+        methods[found] = methods[k];
+        names[found] = name;
+        ++found;
+    }
+    enterMonitor(jvmti_env, g_cpu_lock);
+    class_id = ++g_cpu_class_count;
+    for (k = 0; k < found; ++k)
+        insertMethod(methods[k], names[k], class_id);
+    exitMonitor(jvmti_env, g_cpu_lock);
+    // Finished with success
+    result = 1;
+indexClass_end:
+    free(names);
+    (*jvmti_env)->Deallocate(jvmti_env, (unsigned char *)methods);
+    return result;
+}
+
+static int indexLoadedClasses(jvmtiEnv * jvmti_env, JNIEnv * jni_env)
+{
+    int        result      = 0;
+    jvmtiError error;
+    jint       class_count = 0;
+    jclass *   classes     = NULL;
+    jint       k;
+    error = (*jvmti_env)->GetLoadedClasses(jvmti_env, &class_count, &classes);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        fatalErrorJVMTI(jvmti_env, error, "failed to get loaded classes");
+        return 0;
+    }
+    for (k = 0; k < class_count; ++k)
+        if (!indexClass(jvmti_env, jni_env, classes[k]))
+            goto indexLoadedClasses_end; // Error already reported
+    // Finished with success
+    result = 1;
+indexLoadedClasses_end:
+    for (k = 0; k < class_count; ++k)
+        (*jni_env)->DeleteLocalRef(jni_env, classes[k]);
+    (*jvmti_env)->Deallocate(jvmti_env, (unsigned char *)classes);
+    return result;
+}
+
+// =============================================================================
+//                              SIGNAL HANDLER
+// =============================================================================
+
+// Only does things that are safe in a signal handler: walks the stack with
+// AsyncGetCallTrace(), picks out the Suneido frames using the method table,
+// and leaves them in the ring buffer for the drain thread to name.
+//
+// The cost of a sample is dominated by the walk, which is proportional to the
+// number of frames walked, so only the innermost CPU_TRACE_FRAMES are walked.
+// That also keeps the frame buffer on the signal handler's stack at 2 KB.
+// Since ITIMER_PROF fires per CPU-second of the process, not per thread, the
+// overhead at 100 Hz is 100 times the cost of one sample as a fraction of the
+// CPU time used, however many threads there are. Staying under 1% needs a
+// sample to cost less than 100 microseconds, which leaves a wide margin for a
+// 128 frame walk. A Suneido call takes two or three Java frames, so the walk
+// still sees the innermost 40 or so Suneido frames, which are the ones that
+// matter for CPU use. Deeper stacks lose their outermost frames and are
+// counted as truncated.
+static void handleProfSignal(int signo, siginfo_t * info, void * ucontext)
+{
+    int                       saved_errno = errno;
+    JNIEnv *                  jni_env;
+    ASGCT_CallFrame           trace_frames[CPU_TRACE_FRAMES];
+    ASGCT_CallTrace           trace;
+    struct cpu_sample *       sample;
+    const struct cpu_method * method_cur;
+    const struct cpu_method * method_above = NULL;
+    jint                      count        = 0;
+    jint                      k;
+    (void)signo;
+    (void)info;
+    // Threads the JVM doesn't know about have no Java stack
+    if (JNI_OK != (*g_jvm)->GetEnv(g_jvm, (void **)&jni_env, JNI_VERSION_1_6))
+        goto handleProfSignal_end;
+    trace.env_id = jni_env;
+    trace.num_frames = 0;
+    trace.frames = trace_frames;
+    g_async_get_call_trace(&trace, CPU_TRACE_FRAMES, ucontext);
+    if (trace.num_frames <= 0)
+    {
+        __sync_fetch_and_add(&g_cpu_unwalkable, 1);
+        goto handleProfSignal_end;
+    }
+    if (CPU_TRACE_FRAMES == trace.num_frames)
+        __sync_fetch_and_add(&g_cpu_truncated, 1);
+    sample = &g_cpu_samples[__sync_fetch_and_add(&g_cpu_next_sample, 1) &
+                            (CPU_RING_SIZE - 1)];
+    if (!__sync_bool_compare_and_swap(&sample->state, SAMPLE_EMPTY,
+                                      SAMPLE_BUSY))
+    {
+        __sync_fetch_and_add(&g_cpu_lost, 1);
+        goto handleProfSignal_end;
+    }
+    for (k = 0; k < trace.num_frames && count < CPU_SAMPLE_FRAMES; ++k)
+    {
+        method_cur = trace_frames[k].method_id && 0 <= trace_frames[k].lineno
+                   ? findMethod(trace_frames[k].method_id) : NULL;
+        // As in findSuneidoFrames(), only the top Java frame of an invocation
+        // that spans several Java frames is wanted. Without "this", a frame
+        // of the same class stands in for a frame of the same object.
+        if (method_cur &&
+            !(method_above && method_above->class_id == method_cur->class_id &&
+              method_above->name != method_cur->name))
+        {
+            sample->frames[count].method = trace_frames[k].method_id;
+            sample->frames[count].bci = trace_frames[k].lineno;
+            sample->frames[count].is_call =
+                (METHOD_NAME_CALL & method_cur->name) ? JNI_TRUE : JNI_FALSE;
+            ++count;
+        }
+        method_above = method_cur;
+    }
+    sample->count = count;
+    __sync_synchronize();
+    sample->state = SAMPLE_FULL;
+handleProfSignal_end:
+    errno = saved_errno;
+}
+
+// =============================================================================
+//                               DRAIN THREAD
+// =============================================================================
+
+// Names the frames of a sample and adds it to the CPU profile
+static void recordSample(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                         const struct cpu_sample * sample)
+{
+    struct suneido_frame frames[CPU_SAMPLE_FRAMES];
+    unsigned long long   hash = FNV1A_64_OFFSET_BASIS;
+    jint                 k;
+    for (k = 0; k < sample->count; ++k)
+    {
+        frames[k].method = sample->frames[k].method;
+        frames[k].location = sample->frames[k].bci;
+        frames[k].frame_index = k;
+        frames[k].repeat_count = 0;
+        frames[k].is_call = sample->frames[k].is_call;
+        if (!fetchLineNumbers(jvmti_env, frames[k].method, frames[k].location,
+                              &frames[k].line_number))
+            return; // Error already reported
+        // The profile is only kept for this run, so the jmethodID will do
+        // as the identity of the method
+        hash = hashBytes(hash, (const unsigned char *)&frames[k].method,
+                         sizeof(frames[k].method));
+        hash = hashBytes(hash, (const unsigned char *)&frames[k].line_number,
+                         sizeof(frames[k].line_number));
+    }
+    if (profileFrames(jvmti_env, jni_env, PROFILE_CPU, frames, sample->count,
+                      &hash))
+        profileAdd(jvmti_env, PROFILE_CPU, hash, 1, g_cpu_period);
+}
+
+// Records every sample in the ring buffer. Called without g_cpu_lock, since
+// naming the frames takes JVMTI calls. Each sample is claimed by swapping its
+// state, so the drain thread and the VM death callback can't record it twice.
+static void drainSamples(jvmtiEnv * jvmti_env, JNIEnv * jni_env)
+{
+    jint k;
+    // A sampled method's class may have been unloaded since the sample was
+    // taken, so keep the index from freeing its entries while they are read.
+    pinIndex();
+    for (k = 0; k < CPU_RING_SIZE; ++k)
+    {
+        struct cpu_sample * sample = &g_cpu_samples[k];
+        if (!__sync_bool_compare_and_swap(&sample->state, SAMPLE_FULL,
+                                          SAMPLE_BUSY))
+            continue;
+        recordSample(jvmti_env, jni_env, sample);
+        __sync_synchronize();
+        sample->state = SAMPLE_EMPTY;
+    }
+    unpinIndex();
+}
+
+#ifdef _MSC_VER
+#pragma warning (push)
+#pragma warning (disable : 4100) // unreferenced formal parameter
+#endif // _MSC_VER
+
+static void JNICALL drainThread(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                                void * arg)
+{
+    jboolean stopped;
+    for (;;)
+    {
+        // The lock only guards the stop and draining flags. g_cpu_draining
+        // lets the VM death callback wait for a drain in progress to finish
+        // before it writes the profile out.
+        enterMonitor(jvmti_env, g_cpu_lock);
+        g_cpu_draining = JNI_FALSE;
+        (*jvmti_env)->RawMonitorNotifyAll(jvmti_env, g_cpu_lock);
+        if (!g_cpu_stopped)
+            (*jvmti_env)->RawMonitorWait(jvmti_env, g_cpu_lock,
+                                         CPU_DRAIN_INTERVAL_MS);
+        stopped = g_cpu_stopped;
+        g_cpu_draining = !stopped;
+        exitMonitor(jvmti_env, g_cpu_lock);
+        if (stopped)
+            break;
+        drainSamples(jvmti_env, jni_env);
+    }
+}
+
+#ifdef _MSC_VER
+#pragma warning (pop)
+#endif // _MSC_VER
+
+static void stopTimer()
+{
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+#endif // __linux__
+
+// =============================================================================
+//                               AGENT INIT
+// =============================================================================
+
+// Must be called from Agent_OnLoad()
+int initCpuSampler(jvmtiEnv * jvmti_env, jint rate)
+{
+#ifdef __linux__
+    jvmtiError error;
+    g_async_get_call_trace = (async_get_call_trace_fn)dlsym(
+        RTLD_DEFAULT, ASYNC_GET_CALL_TRACE_NAME);
+    if (!g_async_get_call_trace)
+    {
+        fatalError1("the cpu option requires a JVM that exports "
+                    "AsyncGetCallTrace()");
+        return 0;
+    }
+    if (!initProfile(jvmti_env, PROFILE_CPU))
+        return 0; // Error already reported
+    error = (*jvmti_env)->CreateRawMonitor(jvmti_env, "jsdebug CPU sampler",
+                                           &g_cpu_lock);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        fatalErrorJVMTI(jvmti_env, error, "failed to create CPU sampler lock");
+        return 0;
+    }
+    g_cpu_methods = (struct cpu_method *)calloc(CPU_METHOD_TABLE_CAPACITY,
+                                                sizeof(struct cpu_method));
+    g_cpu_samples = (struct cpu_sample *)calloc(CPU_RING_SIZE,
+                                                sizeof(struct cpu_sample));
+    if (!g_cpu_methods || !g_cpu_samples)
+    {
+        fatalError1("CPU sampler calloc returned NULL");
+        return 0;
+    }
+    g_cpu_period = 1000000000 / rate;
+    // The profile is written out when the VM dies
+    error = (*jvmti_env)->SetEventNotificationMode(
+        jvmti_env, JVMTI_ENABLE, JVMTI_EVENT_VM_DEATH, (jthread)NULL);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        fatalErrorJVMTI(jvmti_env, error, "failed to enable VM death events");
+        return 0;
+    }
+    // Return success
+    return 1;
+#else
+    (void)jvmti_env;
+    (void)rate;
+    fatalError1("the cpu option is only supported on Linux");
+    return 0;
+#endif // __linux__
+}
+
+// Starts sampling. Must be called from the VM init callback, once
+// g_stack_frame_class is known.
+int startCpuSampler(jvmtiEnv * jvmti_env, JNIEnv * jni_env)
+{
+#ifdef __linux__
+    jvmtiError       error;
+    struct sigaction action;
+    struct itimerval timer;
+    // Index the classes that are already loaded, and any loaded from now on.
+    // Turn on the events first so no class slips between the two.
+    error = (*jvmti_env)->SetEventNotificationMode(
+        jvmti_env, JVMTI_ENABLE, JVMTI_EVENT_CLASS_PREPARE, (jthread)NULL);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        fatalErrorJVMTI(jvmti_env, error,
+                        "failed to enable class prepare events");
+        return 0;
+    }
+    if (!indexLoadedClasses(jvmti_env, jni_env))
+        return 0; // Error already reported
+    if (!startAgentThread(jvmti_env, jni_env, DRAIN_THREAD_NAME, drainThread,
+                          NULL))
+        return 0; // Error already reported
+    // ITIMER_PROF counts the CPU time of the whole process, and the kernel
+    // delivers the signal to a thread that is using CPU at the time
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = handleProfSignal;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (0 != sigaction(SIGPROF, &action, NULL))
+    {
+        fatalError1("failed to install the SIGPROF handler");
+        return 0;
+    }
+    memset(&timer, 0, sizeof(timer));
+    timer.it_interval.tv_usec = (long)(g_cpu_period / 1000);
+    if (timer.it_interval.tv_usec <= 0)
+        timer.it_interval.tv_usec = 1;
+    else if (1000000 <= timer.it_interval.tv_usec)
+    {
+        timer.it_interval.tv_sec = timer.it_interval.tv_usec / 1000000;
+        timer.it_interval.tv_usec %= 1000000;
+    }
+    timer.it_value = timer.it_interval;
+    if (0 != setitimer(ITIMER_PROF, &timer, NULL))
+    {
+        fatalError1("failed to start the profiling timer");
+        return 0;
+    }
+    g_cpu_started = JNI_TRUE;
+    // Return success
+    return 1;
+#else
+    (void)jvmti_env;
+    (void)jni_env;
+    return 0; // Can't get here, see initCpuSampler()
+#endif // __linux__
+}
+
+// =============================================================================
+//                                 CALLBACKS
+// =============================================================================
+
+#ifdef _MSC_VER
+#pragma warning (push)
+#pragma warning (disable : 4100) // unreferenced formal parameter
+#endif // _MSC_VER
+
+// Called for every class prepare event if the cpu option is on, see index.c
+void handleCpuClassPrepare(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                           jclass klass)
+{
+#ifdef __linux__
+    indexClass(jvmti_env, jni_env, klass);
+#endif // __linux__
+}
+
+// Stops sampling and writes the CPU profile to /tmp/jsdebug-cpu-<pid>.folded
+// as folded stacks whose values are sample counts.
+void JNICALL callback_VMDeath(jvmtiEnv * jvmti_env, JNIEnv * jni_env)
+{
+#ifdef __linux__
+    char path[64];
+    if (!g_cpu_started)
+        return;
+    // Leave the signal handler installed: restoring the default action would
+    // let a signal that is already pending kill the process
+    stopTimer();
+    enterMonitor(jvmti_env, g_cpu_lock);
+    g_cpu_stopped = JNI_TRUE;
+    (*jvmti_env)->RawMonitorNotifyAll(jvmti_env, g_cpu_lock);
+    while (g_cpu_draining)
+        (*jvmti_env)->RawMonitorWait(jvmti_env, g_cpu_lock, 0);
+    exitMonitor(jvmti_env, g_cpu_lock);
+    drainSamples(jvmti_env, jni_env);
+    sprintf(path, "/tmp/jsdebug-cpu-%d.folded", (int)getpid());
+    writeProfile(PROFILE_CPU, JNI_FALSE, path);
+    if (g_cpu_lost || g_cpu_unwalkable || g_cpu_truncated)
+        fprintf(stderr, "jsdebug: %u CPU samples lost, %u not walkable, "
+                "%u truncated\n", (unsigned int)g_cpu_lost,
+                (unsigned int)g_cpu_unwalkable,
+                (unsigned int)g_cpu_truncated);
+#endif // __linux__
+}
+
+#ifdef _MSC_VER
+#pragma warning (pop)
+#endif // _MSC_VER
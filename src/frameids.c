@@ -0,0 +1,361 @@
+/* Copyright 2026 (c) Suneido Software Corp. All rights reserved.
+ * Licensed under GPLv2.
+ */
+
+#ifdef _MSC_VER
+#pragma warning (disable : 4001) /* nonstandard extension: '//-style' comment */
+#endif // _MSC_VER
+
+//==============================================================================
+// file: frameids.c
+// auth: agent
+// date: 20261018
+// desc: Gives the methods of captured Suneido frames small int ids, whose
+//       class and method names Java fetches incrementally, so a capture alone
+//       tells Java which callable each frame belongs to
+//==============================================================================
+
+#include "jsdebug.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// =============================================================================
+//                                 CONSTANTS
+// =============================================================================
+
+enum
+{
+    FRAME_ID_TABLE_CAPACITY = 1024, /* initial size, must be a power of 2 */
+    FRAME_NAME_CAPACITY     = 256,  /* initial size */
+    MAX_FRAME_CLASS_NAME    = 512,
+};
+
+static const char * JAVA_LANG_STRING_CLASS = "java/lang/String";
+
+// =============================================================================
+//                                  GLOBALS
+// =============================================================================
+
+// The id is always written before the method, so a reader that finds the
+// method sees its id
+struct frame_id
+{
+    jmethodID volatile method; // NULL if the slot is empty
+    jint volatile      id;
+};
+
+struct frame_id_table
+{
+    size_t            capacity; // A power of 2
+    struct frame_id * slots;
+};
+
+// Ids are never reused, even if a method's class is unloaded, so that Java
+// can keep the names it has already fetched. Id k names g_frame_names[k - 1].
+struct frame_name
+{
+    char * class_name;
+    char * method_name;
+};
+
+// Captures look ids up without locking. Ids are only added holding
+// g_frame_ids_lock, and the table is replaced, not changed in place, when it
+// grows. Old tables are never freed, since a reader may still be probing one,
+// but they add up to less than the current table.
+static jrawMonitorID                   g_frame_ids_lock;
+static struct frame_id_table * volatile g_frame_ids;
+static struct frame_name *             g_frame_names;
+static jint                            g_frame_name_count;
+static jint                            g_frame_name_capacity;
+
+// =============================================================================
+//                             HELPER FUNCTIONS
+// =============================================================================
+
+static struct frame_id_table * newFrameIdTable(size_t capacity)
+{
+    struct frame_id_table * table;
+    table = (struct frame_id_table *)calloc(
+        1, sizeof(struct frame_id_table) + capacity * sizeof(struct frame_id));
+    if (table)
+    {
+        table->capacity = capacity;
+        table->slots = (struct frame_id *)(table + 1);
+    }
+    return table;
+}
+
+// Lock free. Returns 0 if the method doesn't have an id yet.
+static jint findFrameId(jmethodID method)
+{
+    const struct frame_id_table * table = LOAD_ACQUIRE(&g_frame_ids);
+    size_t                        mask  = table->capacity - 1;
+    size_t                        k     = hashMethodID(method) & mask;
+    jmethodID                     slot_method;
+    for (;; k = (k + 1) & mask)
+    {
+        slot_method = LOAD_ACQUIRE(&table->slots[k].method);
+        if (!slot_method)
+            return 0;
+        else if (slot_method == method)
+            return table->slots[k].id;
+    }
+}
+
+// Caller must hold g_frame_ids_lock. The method mustn't be in the table.
+static void insertFrameId(struct frame_id_table * table, jmethodID method,
+                          jint id)
+{
+    size_t mask = table->capacity - 1;
+    size_t k    = hashMethodID(method) & mask;
+    while (table->slots[k].method)
+        k = (k + 1) & mask;
+    STORE_RELEASE(&table->slots[k].id, id);
+    STORE_RELEASE(&table->slots[k].method, method);
+}
+
+static char * copyString(const char * str)
+{
+    char * copy = (char *)malloc(strlen(str) + 1);
+    if (copy)
+        strcpy(copy, str);
+    return copy;
+}
+
+// Caller must hold g_frame_ids_lock. Adds a name to the end of the name list
+// and a slot pointing at it, keeping the load factor at or below 3/4. On
+// success, ownership of the name strings passes to the table.
+static jint addFrameId(jmethodID method, char * class_name,
+                       char * method_name)
+{
+    struct frame_id_table * old = g_frame_ids;
+    struct frame_id_table * table;
+    struct frame_name *     names;
+    size_t                  k;
+    if (g_frame_name_count == g_frame_name_capacity)
+    {
+        names = (struct frame_name *)realloc(g_frame_names,
+            2 * g_frame_name_capacity * sizeof(struct frame_name));
+        if (!names)
+        {
+            error1("frame names realloc returned NULL");
+            return 0;
+        }
+        g_frame_names = names;
+        g_frame_name_capacity *= 2;
+    }
+    if (old->capacity * 3 <= ((size_t)g_frame_name_count + 1) * 4)
+    {
+        table = newFrameIdTable(old->capacity * 2);
+        if (!table)
+        {
+            error1("frame id table calloc returned NULL");
+            return 0;
+        }
+        for (k = 0; k < old->capacity; ++k)
+            if (old->slots[k].method)
+                insertFrameId(table, old->slots[k].method,
+                              old->slots[k].id);
+        STORE_RELEASE(&g_frame_ids, table);
+    }
+    g_frame_names[g_frame_name_count].class_name = class_name;
+    g_frame_names[g_frame_name_count].method_name = method_name;
+    ++g_frame_name_count;
+    insertFrameId(g_frame_ids, method, g_frame_name_count);
+    return g_frame_name_count;
+}
+
+// Gets the dotted name of the method's declaring class and the method's name,
+// both newly malloc'd.
+static int fetchFrameNames(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                           jmethodID method, char ** pclass_name,
+                           char ** pmethod_name)
+{
+    int        result          = 0;
+    jvmtiError error;
+    jclass     declaring_class = (jclass)NULL;
+    char *     class_signature = NULL;
+    char *     method_name     = NULL;
+    char       buffer[MAX_FRAME_CLASS_NAME];
+    error = (*jvmti_env)->GetMethodDeclaringClass(jvmti_env, method,
+                                                  &declaring_class);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(jvmti_env, error, "failed to get method declaring class");
+        goto fetchFrameNames_end;
+    }
+    error = (*jvmti_env)->GetClassSignature(jvmti_env, declaring_class,
+                                            &class_signature, NULL);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(jvmti_env, error, "failed to get class signature");
+        goto fetchFrameNames_end;
+    }
+    error = (*jvmti_env)->GetMethodName(jvmti_env, method, &method_name, NULL,
+                                        NULL);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(jvmti_env, error, "failed to get method name");
+        goto fetchFrameNames_end;
+    }
+    formatClassName(class_signature, JNI_FALSE, buffer, sizeof(buffer));
+    *pclass_name = copyString(buffer);
+    *pmethod_name = copyString(method_name);
+    if (!*pclass_name || !*pmethod_name)
+    {
+        error1("frame name malloc returned NULL");
+        free(*pclass_name);
+        free(*pmethod_name);
+        goto fetchFrameNames_end;
+    }
+    // Finished with success
+    result = 1;
+fetchFrameNames_end:
+    if (method_name)
+        (*jvmti_env)->Deallocate(jvmti_env, (unsigned char *)method_name);
+    if (class_signature)
+        (*jvmti_env)->Deallocate(jvmti_env, (unsigned char *)class_signature);
+    if (declaring_class)
+        (*jni_env)->DeleteLocalRef(jni_env, declaring_class);
+    return result;
+}
+
+// =============================================================================
+//                               AGENT INIT
+// =============================================================================
+
+// Must be called from the VM init callback
+int initFrameIds(jvmtiEnv * jvmti_env)
+{
+    jvmtiError error;
+    error = (*jvmti_env)->CreateRawMonitor(jvmti_env, "jsdebug frame ids",
+                                           &g_frame_ids_lock);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        fatalErrorJVMTI(jvmti_env, error, "failed to create frame ids lock");
+        return 0;
+    }
+    g_frame_ids = newFrameIdTable(FRAME_ID_TABLE_CAPACITY);
+    g_frame_names = (struct frame_name *)malloc(
+        FRAME_NAME_CAPACITY * sizeof(struct frame_name));
+    if (!g_frame_ids || !g_frame_names)
+    {
+        fatalError1("frame ids calloc returned NULL");
+        return 0;
+    }
+    g_frame_name_capacity = FRAME_NAME_CAPACITY;
+    // Return success
+    return 1;
+}
+
+// =============================================================================
+//                                  LOOKUP
+// =============================================================================
+
+// Gets the id of a method, giving it the next id if it doesn't have one yet.
+// Only giving a method an id locks. Returns 0 on error, since ids start at 1.
+jint frameId(jvmtiEnv * jvmti_env, JNIEnv * jni_env, jmethodID method)
+{
+    jint     id;
+    char *   class_name;
+    char *   method_name;
+    jboolean added = JNI_FALSE;
+    id = findFrameId(method);
+    if (id)
+        return id;
+    // JVMTI isn't called while holding the lock
+    if (!fetchFrameNames(jvmti_env, jni_env, method, &class_name,
+                         &method_name))
+        return 0; // Error already reported
+    enterMonitor(jvmti_env, g_frame_ids_lock);
+    // Another thread may have added the method meanwhile
+    id = findFrameId(method);
+    if (!id)
+    {
+        id = addFrameId(method, class_name, method_name);
+        added = 0 != id;
+    }
+    exitMonitor(jvmti_env, g_frame_ids_lock);
+    if (!added)
+    {
+        free(class_name);
+        free(method_name);
+    }
+    return id;
+}
+
+// =============================================================================
+//                              JAVA INTERFACE
+// =============================================================================
+
+#ifdef _MSC_VER
+#pragma warning (push)
+#pragma warning (disable : 4100) // unreferenced formal parameter
+#endif // _MSC_VER
+
+// Gets the names of the frame ids from fromId on, which can be called again
+// later with one more than the last id seen to fetch only the new names. The
+// result holds two strings per id, the declaring class name (e.g.
+// "suneido.user.Foo") followed by the method name (e.g. "eval").
+// private static native String[] getFrameNames(int fromId);
+JNIEXPORT jobjectArray JNICALL Java_suneido_debug_StackInfo_getFrameNames(
+    JNIEnv * jni_env, jclass clazz, jint from_id)
+{
+    jobjectArray        result = (jobjectArray)NULL;
+    jclass              string_class;
+    struct frame_name * names = NULL;
+    jint                count = 0;
+    jint                k;
+    jstring             str;
+    if (!g_frame_ids_lock)
+        return (jobjectArray)NULL;
+    if (from_id < 1)
+        from_id = 1;
+    // Copy the pointers out, since the list may be reallocated by another
+    // thread. The strings themselves are never freed.
+    enterMonitor(g_jvmti, g_frame_ids_lock);
+    if (from_id <= g_frame_name_count)
+    {
+        count = g_frame_name_count - from_id + 1;
+        names = (struct frame_name *)malloc(count * sizeof(struct frame_name));
+        if (names)
+            memcpy(names, &g_frame_names[from_id - 1],
+                   count * sizeof(struct frame_name));
+    }
+    exitMonitor(g_jvmti, g_frame_ids_lock);
+    if (0 < count && !names)
+    {
+        error1("frame names malloc returned NULL");
+        return (jobjectArray)NULL;
+    }
+    string_class = (*jni_env)->FindClass(jni_env, JAVA_LANG_STRING_CLASS);
+    if (!string_class)
+        goto getFrameNames_end; // Exception pending
+    result = (*jni_env)->NewObjectArray(jni_env, 2 * count, string_class,
+                                        (jobject)NULL);
+    (*jni_env)->DeleteLocalRef(jni_env, string_class);
+    if (!result)
+        goto getFrameNames_end; // Exception pending
+    for (k = 0; k < 2 * count; ++k)
+    {
+        str = (*jni_env)->NewStringUTF(jni_env, k & 1
+                                       ? names[k / 2].method_name
+                                       : names[k / 2].class_name);
+        if (!str)
+        {
+            (*jni_env)->DeleteLocalRef(jni_env, result);
+            result = (jobjectArray)NULL;
+            goto getFrameNames_end; // Exception pending
+        }
+        (*jni_env)->SetObjectArrayElement(jni_env, result, k, str);
+        (*jni_env)->DeleteLocalRef(jni_env, str);
+    }
+getFrameNames_end:
+    free(names);
+    return result;
+}
+
+#ifdef _MSC_VER
+#pragma warning (pop)
+#endif // _MSC_VER
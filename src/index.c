@@ -0,0 +1,858 @@
+/* Copyright 2026 (c) Suneido Software Corp. All rights reserved.
+ * Licensed under GPLv2.
+ */
+
+#ifdef _MSC_VER
+#pragma warning (disable : 4001) /* nonstandard extension: '//-style' comment */
+#endif // _MSC_VER
+
+//==============================================================================
+// file: index.c
+// auth: agent
+// date: 20261018
+// desc: Indexes the methods of Suneido callable classes on a background agent
+//       thread as the classes are prepared, so that captures find the method
+//       names, modifiers, line number tables, and local variable tables they
+//       need already looked up
+//==============================================================================
+
+#include "jsdebug.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// =============================================================================
+//                                 CONSTANTS
+// =============================================================================
+
+enum
+{
+    INDEX_METHOD_CAPACITY = 4096, /* initial sizes, must be powers of 2 */
+    INDEX_CLASS_CAPACITY  = 512,
+    INDEX_NAME_CAPACITY   = 1024,
+    INDEX_QUEUE_CAPACITY  = 64,
+};
+
+enum
+{
+    ACC_PUBLIC = 0x0001,
+    ACC_STATIC = 0x0008,
+};
+
+// Special line_count and local_count values of an indexed method
+enum
+{
+    TABLE_NOT_KEPT = -2, /* not a Suneido frame method, so ask JVMTI */
+    TABLE_ABSENT   = -1, /* the class file doesn't have the table */
+};
+
+static const char * INDEX_THREAD_NAME = "jsdebug indexer";
+
+// =============================================================================
+//                                  GLOBALS
+// =============================================================================
+
+// Never changed once published in the method table
+struct indexed_method
+{
+    jmethodID              method;
+    jint                   modifiers;
+    enum method_name       name;
+    unsigned long long     name_hash;   // From hashMethodName()
+    jint                   line_count;  // See TABLE_NOT_KEPT and TABLE_ABSENT
+    jvmtiLineNumberEntry * lines;       // From GetLineNumberTable()
+    jint                   local_count; // See TABLE_NOT_KEPT and TABLE_ABSENT
+    struct indexed_local * locals;      // Reference locals only
+};
+
+// An indexed class is tagged so that when it is unloaded, the object free
+// event for its java.lang.Class tells us which methods to drop.
+struct indexed_class
+{
+    jlong                   tag;
+    jint                    method_count;
+    jmethodID *             methods;      // From GetClassMethods()
+    struct indexed_method * entries;      // Parallel to methods
+    struct indexed_class *  next_retired; // See g_index_retired
+};
+
+// Once a slot has a method it keeps one, so probe sequences are never cut.
+// When a method's class is unloaded its entry is set to NULL, and the slot can
+// then be reused for another method. The entry is always written before the
+// method, so a reader that finds the method sees its entry.
+struct method_slot
+{
+    jmethodID volatile               method; // NULL if never used
+    struct indexed_method * volatile entry;  // NULL if the method was removed
+};
+
+struct method_table
+{
+    size_t               capacity; // A power of 2
+    size_t               used;     // Slots with a method
+    struct method_slot * slots;
+};
+
+// Captures read the method table without locking, since they run on many
+// threads at once. Only the indexer thread and the object free callback
+// change it, holding g_index_lock. The table is replaced, not changed in
+// place, when it grows. Old tables are never freed, since a reader may still
+// be probing one, but they add up to less than the current table.
+//
+// A frame on a stack keeps the class of its method loaded, so a reader that
+// only looks up the methods of frames on a stack it is capturing can keep
+// using what it finds. Other readers pin the index while they use what they
+// find, and the entries of unloaded classes are only freed while it isn't
+// pinned. Until then they wait in the g_index_retired list.
+static jrawMonitorID                  g_index_lock;
+static struct method_table * volatile g_index_methods;
+static size_t                         g_index_method_count;
+static struct indexed_class **        g_index_classes; // Guarded by the lock
+static size_t                         g_index_class_capacity;
+static size_t                         g_index_class_count;
+static struct indexed_class *         g_index_retired;
+static volatile long                  g_index_pins;
+static jclass *                       g_index_queue;   // Of global references
+static jint                           g_index_queue_count;
+static jint                           g_index_queue_capacity;
+static jboolean                       g_index_started;
+
+// Local variable names are shared by all methods and never freed, so captures
+// can keep pointing at them even if the method's class is unloaded. Only the
+// indexer thread touches the name table, so it isn't locked.
+static const char **           g_index_names;
+static size_t                  g_index_name_capacity;
+static size_t                  g_index_name_count;
+static jlong                   g_index_next_tag;       // Indexer thread only
+
+// =============================================================================
+//                             HELPER FUNCTIONS
+// =============================================================================
+
+static size_t hashTag(jlong tag)
+{
+    unsigned long long x = (unsigned long long)tag * FNV1A_64_PRIME;
+    return (size_t)(x ^ (x >> 32));
+}
+
+static size_t hashName(const char * name)
+{
+    return (size_t)hashBytes(FNV1A_64_OFFSET_BASIS,
+                             (const unsigned char *)name, strlen(name));
+}
+
+static const char * internLocalName(const char * name)
+{
+    size_t        mask = g_index_name_capacity - 1;
+    size_t        k    = hashName(name) & mask;
+    size_t        capacity;
+    const char ** table;
+    char *        copy;
+    for (; g_index_names[k]; k = (k + 1) & mask)
+        if (!strcmp(g_index_names[k], name))
+            return g_index_names[k];
+    // Keep the load factor at or below 3/4
+    if (g_index_name_capacity * 3 <= (g_index_name_count + 1) * 4)
+    {
+        capacity = g_index_name_capacity * 2;
+        table = (const char **)calloc(capacity, sizeof(const char *));
+        if (!table)
+        {
+            error1("index name table calloc returned NULL");
+            return NULL;
+        }
+        for (k = 0; k < g_index_name_capacity; ++k)
+        {
+            size_t j;
+            if (!g_index_names[k])
+                continue;
+            j = hashName(g_index_names[k]) & (capacity - 1);
+            while (table[j])
+                j = (j + 1) & (capacity - 1);
+            table[j] = g_index_names[k];
+        }
+        free((void *)g_index_names);
+        g_index_names = table;
+        g_index_name_capacity = capacity;
+        mask = capacity - 1;
+        for (k = hashName(name) & mask; g_index_names[k]; k = (k + 1) & mask)
+            ;
+    }
+    copy = (char *)malloc(strlen(name) + 1);
+    if (!copy)
+    {
+        error1("index name malloc returned NULL");
+        return NULL;
+    }
+    strcpy(copy, name);
+    g_index_names[k] = copy;
+    ++g_index_name_count;
+    return copy;
+}
+
+static struct method_table * newMethodTable(size_t capacity)
+{
+    struct method_table * table;
+    table = (struct method_table *)calloc(
+        1, sizeof(struct method_table) + capacity * sizeof(struct method_slot));
+    if (table)
+    {
+        table->capacity = capacity;
+        table->slots = (struct method_slot *)(table + 1);
+    }
+    return table;
+}
+
+// Lock free. Returns NULL if the method isn't in the table.
+static const struct indexed_method * findMethod(jmethodID method)
+{
+    const struct method_table *   table = LOAD_ACQUIRE(&g_index_methods);
+    size_t                        mask  = table->capacity - 1;
+    size_t                        k     = hashMethodID(method) & mask;
+    jmethodID                     slot_method;
+    const struct indexed_method * entry;
+    for (;; k = (k + 1) & mask)
+    {
+        slot_method = LOAD_ACQUIRE(&table->slots[k].method);
+        if (!slot_method)
+            return NULL;
+        else if (slot_method == method)
+            break;
+    }
+    // If the slot has just been reused, the entry may be another method's
+    entry = LOAD_ACQUIRE(&table->slots[k].entry);
+    return entry && entry->method == method ? entry : NULL;
+}
+
+// Caller must hold g_index_lock. Puts the entry in the first slot of its probe
+// sequence that is empty or whose method was removed.
+static void insertMethod(struct method_table * table,
+                         struct indexed_method * entry)
+{
+    size_t               mask = table->capacity - 1;
+    size_t               k    = hashMethodID(entry->method) & mask;
+    struct method_slot * slot;
+    for (; table->slots[k].method; k = (k + 1) & mask)
+        if (!table->slots[k].entry)
+            break;
+    slot = &table->slots[k];
+    if (!slot->method)
+        ++table->used;
+    STORE_RELEASE(&slot->entry, entry);
+    STORE_RELEASE(&slot->method, entry->method);
+}
+
+// Caller must hold g_index_lock. Makes room for count more methods, keeping
+// the load factor, counting the slots of removed methods, at or below 3/4.
+// A bigger table only gets the methods that haven't been removed.
+static int reserveMethods(size_t count)
+{
+    struct method_table * old      = g_index_methods;
+    size_t                capacity = old->capacity;
+    struct method_table * table;
+    size_t                k;
+    if ((old->used + count) * 4 < old->capacity * 3)
+        return 1;
+    do
+        capacity *= 2;
+    while (capacity * 3 <= (g_index_method_count + count) * 4);
+    table = newMethodTable(capacity);
+    if (!table)
+    {
+        error1("index method table calloc returned NULL");
+        return 0;
+    }
+    for (k = 0; k < old->capacity; ++k)
+        if (old->slots[k].entry)
+            insertMethod(table, old->slots[k].entry);
+    STORE_RELEASE(&g_index_methods, table);
+    return 1;
+}
+
+// Caller must hold g_index_lock
+static struct indexed_class ** findClassSlot(jlong tag)
+{
+    size_t mask = g_index_class_capacity - 1;
+    size_t k    = hashTag(tag) & mask;
+    while (g_index_classes[k] && g_index_classes[k]->tag != tag)
+        k = (k + 1) & mask;
+    return &g_index_classes[k];
+}
+
+// Caller must hold g_index_lock. Makes room for one more class, keeping the
+// load factor at or below 3/4.
+static int reserveClass()
+{
+    size_t                  capacity = g_index_class_capacity * 2;
+    struct indexed_class ** old      = g_index_classes;
+    size_t                  k;
+    if ((g_index_class_count + 1) * 4 < g_index_class_capacity * 3)
+        return 1;
+    g_index_classes = (struct indexed_class **)calloc(
+        capacity, sizeof(struct indexed_class *));
+    if (!g_index_classes)
+    {
+        error1("index class table calloc returned NULL");
+        g_index_classes = old;
+        return 0;
+    }
+    g_index_class_capacity = capacity;
+    for (k = 0; k < capacity / 2; ++k)
+        if (old[k])
+            *findClassSlot(old[k]->tag) = old[k];
+    free(old);
+    return 1;
+}
+
+// Caller must hold g_index_lock. Removes a class from the class table by
+// shifting later entries of the same probe sequence back, so the table never
+// fills up with deleted slots.
+static void removeClass(struct indexed_class ** slot)
+{
+    size_t mask = g_index_class_capacity - 1;
+    size_t i    = (size_t)(slot - g_index_classes);
+    size_t j, k;
+    for (j = (i + 1) & mask; g_index_classes[j]; j = (j + 1) & mask)
+    {
+        k = hashTag(g_index_classes[j]->tag) & mask;
+        if (i < j ? i < k && k <= j : i < k || k <= j)
+            continue;
+        g_index_classes[i] = g_index_classes[j];
+        i = j;
+    }
+    g_index_classes[i] = NULL;
+    --g_index_class_count;
+}
+
+static void freeClass(jvmtiEnv * jvmti_env, struct indexed_class * klass)
+{
+    jint k;
+    if (klass->entries)
+    {
+        for (k = 0; k < klass->method_count; ++k)
+        {
+            if (klass->entries[k].lines)
+                (*jvmti_env)->Deallocate(
+                    jvmti_env, (unsigned char *)klass->entries[k].lines);
+            free(klass->entries[k].locals);
+        }
+        free(klass->entries);
+    }
+    if (klass->methods)
+        (*jvmti_env)->Deallocate(jvmti_env, (unsigned char *)klass->methods);
+    free(klass);
+}
+
+// Caller must hold g_index_lock. Frees the retired classes unless the index
+// is pinned. The full barrier of ATOMIC_ADD() means that a reader who pins the
+// index after this reads the pin count sees the removed methods as removed.
+static void freeRetired(jvmtiEnv * jvmti_env)
+{
+    struct indexed_class * klass;
+    if (!g_index_retired || ATOMIC_ADD(&g_index_pins, 0))
+        return;
+    while (g_index_retired)
+    {
+        klass = g_index_retired;
+        g_index_retired = klass->next_retired;
+        freeClass(jvmti_env, klass);
+    }
+}
+
+// Keeps only the reference-typed entries of a local variable table, which are
+// the only ones fetchLocals() wants.
+static int summarizeLocals(jvmtiEnv * jvmti_env, jmethodID method,
+                           struct indexed_method * entry)
+{
+    int                       result      = 0;
+    jvmtiError                error;
+    jvmtiLocalVariableEntry * table       = NULL;
+    jint                      table_count = 0;
+    jint                      k;
+    error = (*jvmti_env)->GetLocalVariableTable(jvmti_env, method,
+                                                &table_count, &table);
+    if (JVMTI_ERROR_ABSENT_INFORMATION == error)
+    {
+        entry->local_count = TABLE_ABSENT;
+        return 1;
+    }
+    else if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(jvmti_env, error, "getting local variable table");
+        return 0;
+    }
+    entry->local_count = 0;
+    if (table_count < 1)
+        goto summarizeLocals_end;
+    entry->locals = (struct indexed_local *)malloc(
+        table_count * sizeof(struct indexed_local));
+    if (!entry->locals)
+    {
+        error1("index locals malloc returned NULL");
+        goto summarizeLocals_end;
+    }
+    for (k = 0; k < table_count; ++k)
+    {
+        struct indexed_local * local = &entry->locals[entry->local_count];
+        if ('L' != table[k].signature[0] && '[' != table[k].signature[0])
+            continue;
+        local->start_location = table[k].start_location;
+        local->length = table[k].length;
+        local->slot = table[k].slot;
+        local->name = internLocalName(table[k].name);
+        if (!local->name)
+            goto summarizeLocals_end; // Error already reported
+        ++entry->local_count;
+    }
+    // Finished with success
+    result = 1;
+summarizeLocals_end:
+    if (table)
+        deallocateLocalVariableTable(jvmti_env, table, table_count);
+    return result;
+}
+
+// Looks up everything a capture will want to know about a method. The tables
+// are only kept for methods that can be the top frame of a Suneido callable
+// invocation, which are the only ones captures ask for them.
+static int describeMethod(jvmtiEnv * jvmti_env, jmethodID method,
+                          const char * class_signature,
+                          struct indexed_method * entry)
+{
+    jvmtiError error;
+    char *     name;
+    entry->method = method;
+    entry->line_count = TABLE_NOT_KEPT;
+    entry->local_count = TABLE_NOT_KEPT;
+    error = (*jvmti_env)->GetMethodModifiers(jvmti_env, method,
+                                             &entry->modifiers);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(jvmti_env, error, "failed to get method modifiers");
+        return 0;
+    }
+    error = (*jvmti_env)->GetMethodName(jvmti_env, method, &name, NULL, NULL);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(jvmti_env, error, "failed to get method name");
+        return 0;
+    }
+    entry->name = classifyMethodName(name);
+    entry->name_hash = hashMethodName(class_signature, name);
+    (*jvmti_env)->Deallocate(jvmti_env, (unsigned char *)name);
+    if (ACC_PUBLIC != (entry->modifiers & (ACC_PUBLIC | ACC_STATIC)) ||
+        METHOD_NAME_UNKNOWN == entry->name)
+        return 1;
+    error = (*jvmti_env)->GetLineNumberTable(jvmti_env, method,
+                                             &entry->line_count,
+                                             &entry->lines);
+    if (JVMTI_ERROR_ABSENT_INFORMATION == error)
+        entry->line_count = TABLE_ABSENT;
+    else if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(jvmti_env, error, "failed to get line number table");
+        entry->line_count = TABLE_NOT_KEPT;
+        return 0;
+    }
+    return summarizeLocals(jvmti_env, method, entry);
+}
+
+// Indexes the methods of one Suneido callable class. Only called on the
+// indexer thread.
+static int indexClass(jvmtiEnv * jvmti_env, jclass klass)
+{
+    int                     result       = 0;
+    jvmtiError              error;
+    jlong                   tag          = 0;
+    struct indexed_class *  record;
+    char *                  signature    = NULL;
+    jint                    k;
+    // A class can be queued twice: by a class prepare event and by the sweep
+    // of the classes already loaded when the index started
+    error = (*jvmti_env)->GetTag(jvmti_env, klass, &tag);
+    if (JVMTI_ERROR_WRONG_PHASE == error)
+        return 1; // The VM is dying, so there is no point
+    else if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(jvmti_env, error, "failed to get class tag");
+        return 0;
+    }
+    else if (tag)
+        return 1;
+    record = (struct indexed_class *)calloc(1, sizeof(struct indexed_class));
+    if (!record)
+    {
+        error1("index class calloc returned NULL");
+        return 0;
+    }
+    error = (*jvmti_env)->GetClassSignature(jvmti_env, klass, &signature,
+                                            NULL);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(jvmti_env, error, "failed to get class signature");
+        goto indexClass_end;
+    }
+    error = (*jvmti_env)->GetClassMethods(jvmti_env, klass,
+                                          &record->method_count,
+                                          &record->methods);
+    if (JVMTI_ERROR_CLASS_NOT_PREPARED == error)
+    {
+        result = 1; // Indexed when the class prepare event arrives
+        goto indexClass_end;
+    }
+    else if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(jvmti_env, error, "failed to get class methods");
+        goto indexClass_end;
+    }
+    record->entries = (struct indexed_method *)calloc(
+        record->method_count + 1, sizeof(struct indexed_method));
+    if (!record->entries)
+    {
+        error1("index entries calloc returned NULL");
+        goto indexClass_end;
+    }
+    for (k = 0; k < record->method_count; ++k)
+        if (!describeMethod(jvmti_env, record->methods[k], signature,
+                            &record->entries[k]))
+            goto indexClass_end; // Error already reported
+    // The global reference the queue holds keeps the class from being
+    // unloaded before it is in the tables
+    tag = ++g_index_next_tag;
+    error = (*jvmti_env)->SetTag(jvmti_env, klass, tag);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(jvmti_env, error, "failed to set class tag");
+        goto indexClass_end;
+    }
+    record->tag = tag;
+    enterMonitor(jvmti_env, g_index_lock);
+    if (reserveMethods((size_t)record->method_count) && reserveClass())
+    {
+        for (k = 0; k < record->method_count; ++k)
+            insertMethod(g_index_methods, &record->entries[k]);
+        g_index_method_count += record->method_count;
+        *findClassSlot(tag) = record;
+        ++g_index_class_count;
+        record = NULL;
+        result = 1;
+    }
+    // Classes unloaded while this one was being described may be waiting
+    freeRetired(jvmti_env);
+    exitMonitor(jvmti_env, g_index_lock);
+indexClass_end:
+    if (signature)
+        (*jvmti_env)->Deallocate(jvmti_env, (unsigned char *)signature);
+    if (record)
+        freeClass(jvmti_env, record);
+    return result;
+}
+
+// Queues a class to be indexed if it is a Suneido callable class
+static void queueClass(jvmtiEnv * jvmti_env, JNIEnv * jni_env, jclass klass)
+{
+    jclass   global_ref;
+    jclass * queue;
+    jint     capacity;
+    if (!(*jni_env)->IsAssignableFrom(jni_env, klass, g_stack_frame_class))
+        return;
+    global_ref = (jclass)(*jni_env)->NewGlobalRef(jni_env, klass);
+    if (!global_ref)
+    {
+        error1("failed to make class global reference for index");
+        return;
+    }
+    enterMonitor(jvmti_env, g_index_lock);
+    if (g_index_queue_count == g_index_queue_capacity)
+    {
+        capacity = g_index_queue_capacity ? 2 * g_index_queue_capacity
+                                          : INDEX_QUEUE_CAPACITY;
+        queue = (jclass *)realloc(g_index_queue, capacity * sizeof(jclass));
+        if (!queue)
+        {
+            exitMonitor(jvmti_env, g_index_lock);
+            error1("index queue realloc returned NULL");
+            (*jni_env)->DeleteGlobalRef(jni_env, global_ref);
+            return;
+        }
+        g_index_queue = queue;
+        g_index_queue_capacity = capacity;
+    }
+    g_index_queue[g_index_queue_count++] = global_ref;
+    (*jvmti_env)->RawMonitorNotify(jvmti_env, g_index_lock);
+    exitMonitor(jvmti_env, g_index_lock);
+}
+
+static int queueLoadedClasses(jvmtiEnv * jvmti_env, JNIEnv * jni_env)
+{
+    jvmtiError error;
+    jint       class_count = 0;
+    jclass *   classes     = NULL;
+    jint       k;
+    error = (*jvmti_env)->GetLoadedClasses(jvmti_env, &class_count, &classes);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        fatalErrorJVMTI(jvmti_env, error, "failed to get loaded classes");
+        return 0;
+    }
+    for (k = 0; k < class_count; ++k)
+    {
+        queueClass(jvmti_env, jni_env, classes[k]);
+        (*jni_env)->DeleteLocalRef(jni_env, classes[k]);
+    }
+    (*jvmti_env)->Deallocate(jvmti_env, (unsigned char *)classes);
+    return 1;
+}
+
+#ifdef _MSC_VER
+#pragma warning (push)
+#pragma warning (disable : 4100) // unreferenced formal parameter
+#endif // _MSC_VER
+
+// Takes the whole queue at a time so that class prepare events never wait on
+// the indexing itself
+static void JNICALL indexThread(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                                void * arg)
+{
+    jclass * batch;
+    jint     count;
+    jint     k;
+    for (;;)
+    {
+        enterMonitor(jvmti_env, g_index_lock);
+        while (!g_index_queue_count)
+            (*jvmti_env)->RawMonitorWait(jvmti_env, g_index_lock, 0);
+        batch = g_index_queue;
+        count = g_index_queue_count;
+        g_index_queue = NULL;
+        g_index_queue_count = 0;
+        g_index_queue_capacity = 0;
+        exitMonitor(jvmti_env, g_index_lock);
+        for (k = 0; k < count; ++k)
+        {
+            indexClass(jvmti_env, batch[k]);
+            (*jni_env)->DeleteGlobalRef(jni_env, batch[k]);
+        }
+        free(batch);
+    }
+}
+
+#ifdef _MSC_VER
+#pragma warning (pop)
+#endif // _MSC_VER
+
+// =============================================================================
+//                               AGENT INIT
+// =============================================================================
+
+void addIndexCapabilities(jvmtiCapabilities * caps)
+{
+    caps->can_tag_objects = 1;
+    caps->can_generate_object_free_events = 1;
+}
+
+// Must be called from Agent_OnLoad()
+int initIndex(jvmtiEnv * jvmti_env)
+{
+    jvmtiError error;
+    error = (*jvmti_env)->CreateRawMonitor(jvmti_env, "jsdebug index",
+                                           &g_index_lock);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        fatalErrorJVMTI(jvmti_env, error, "failed to create index lock");
+        return 0;
+    }
+    g_index_methods = newMethodTable(INDEX_METHOD_CAPACITY);
+    g_index_classes = (struct indexed_class **)calloc(
+        INDEX_CLASS_CAPACITY, sizeof(struct indexed_class *));
+    g_index_names = (const char **)calloc(INDEX_NAME_CAPACITY,
+                                          sizeof(const char *));
+    if (!g_index_methods || !g_index_classes || !g_index_names)
+    {
+        fatalError1("index calloc returned NULL");
+        return 0;
+    }
+    g_index_class_capacity = INDEX_CLASS_CAPACITY;
+    g_index_name_capacity = INDEX_NAME_CAPACITY;
+    // Return success
+    return 1;
+}
+
+// Starts indexing. Must be called from the VM init callback, once
+// g_stack_frame_class is known.
+int startIndex(jvmtiEnv * jvmti_env, JNIEnv * jni_env)
+{
+    jvmtiError error;
+    if (!startAgentThread(jvmti_env, jni_env, INDEX_THREAD_NAME, indexThread,
+                          NULL))
+        return 0; // Error already reported
+    // Index the classes that are already loaded, and any loaded from now on.
+    // Turn on the events first so no class slips between the two.
+    error = (*jvmti_env)->SetEventNotificationMode(
+        jvmti_env, JVMTI_ENABLE, JVMTI_EVENT_OBJECT_FREE, (jthread)NULL);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        fatalErrorJVMTI(jvmti_env, error,
+                        "failed to enable object free events");
+        return 0;
+    }
+    g_index_started = JNI_TRUE;
+    error = (*jvmti_env)->SetEventNotificationMode(
+        jvmti_env, JVMTI_ENABLE, JVMTI_EVENT_CLASS_PREPARE, (jthread)NULL);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        fatalErrorJVMTI(jvmti_env, error,
+                        "failed to enable class prepare events");
+        return 0;
+    }
+    return queueLoadedClasses(jvmti_env, jni_env);
+}
+
+// =============================================================================
+//                                  LOOKUP
+// =============================================================================
+
+// Gets the modifiers and name of a method of an indexed class. Returns 0 if
+// the method isn't indexed (yet), in which case the caller has to ask JVMTI.
+// Like the other lookups, this doesn't lock, but see pinIndex().
+int lookupIndexedMethod(jmethodID method, jint * pmodifiers,
+                        enum method_name * pname)
+{
+    const struct indexed_method * entry;
+    if (!g_index_started)
+        return 0;
+    entry = findMethod(method);
+    if (!entry)
+        return 0;
+    *pmodifiers = entry->modifiers;
+    *pname = entry->name;
+    return 1;
+}
+
+// Gets the hash of the declaring class signature and the name of an indexed
+// method, which is what hashFrame() would otherwise ask JVMTI for
+int lookupIndexedNameHash(jmethodID method, unsigned long long * phash)
+{
+    const struct indexed_method * entry;
+    if (!g_index_started)
+        return 0;
+    entry = findMethod(method);
+    if (!entry)
+        return 0;
+    *phash = entry->name_hash;
+    return 1;
+}
+
+// Gets the line number of a location in an indexed method
+int lookupIndexedLine(jmethodID method, jlocation location,
+                      jint * pline_number)
+{
+    const struct indexed_method * entry;
+    if (!g_index_started)
+        return 0;
+    entry = findMethod(method);
+    if (!entry || TABLE_NOT_KEPT == entry->line_count)
+        return 0;
+    *pline_number = lineNumberAt(entry->lines,
+                                 TABLE_ABSENT == entry->line_count
+                                     ? 0 : entry->line_count,
+                                 location);
+    return 1;
+}
+
+// Gets the reference local variables of an indexed method. The table belongs
+// to the index and stays valid while the method's class is loaded, e.g. while
+// a frame of the method is on the stack being captured. *pcount is
+// TABLE_ABSENT if the method has no local variable table.
+int lookupIndexedLocals(jmethodID method,
+                        const struct indexed_local ** ptable, jint * pcount)
+{
+    const struct indexed_method * entry;
+    *ptable = NULL;
+    if (!g_index_started)
+        return 0;
+    entry = findMethod(method);
+    if (!entry || TABLE_NOT_KEPT == entry->local_count)
+        return 0;
+    *ptable = entry->locals;
+    *pcount = entry->local_count;
+    return 1;
+}
+
+// A reader that may look up methods whose classes can be unloaded meanwhile,
+// such as the methods of frames sampled earlier, must pin the index for as
+// long as it uses what it looks up. Readers that look up the methods of frames
+// on a stack they are capturing don't need to, since the frames keep the
+// classes loaded.
+void pinIndex()
+{
+    ATOMIC_ADD(&g_index_pins, 1);
+}
+
+void unpinIndex()
+{
+    ATOMIC_ADD(&g_index_pins, -1);
+}
+
+// =============================================================================
+//                                 CALLBACKS
+// =============================================================================
+
+#ifdef _MSC_VER
+#pragma warning (push)
+#pragma warning (disable : 4100) // unreferenced formal parameter
+#endif // _MSC_VER
+
+// There is only one class prepare callback, so it hands the event to each
+// feature that wants it
+void JNICALL callback_ClassPrepare(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                                   jthread thread, jclass klass)
+{
+    if (g_index_started)
+        queueClass(jvmti_env, jni_env, klass);
+    if (g_options.cpu_rate)
+        handleCpuClassPrepare(jvmti_env, jni_env, klass);
+}
+
+// Only indexed classes are tagged, so this means one of them was unloaded.
+// Object free callbacks may only use raw monitors and memory management.
+void JNICALL callback_ObjectFree(jvmtiEnv * jvmti_env, jlong tag)
+{
+    struct indexed_class ** slot;
+    struct indexed_class *  klass;
+    struct method_table *   table;
+    size_t                  mask;
+    size_t                  k;
+    jint                    j;
+    enterMonitor(jvmti_env, g_index_lock);
+    slot = findClassSlot(tag);
+    klass = *slot;
+    if (klass)
+    {
+        // Take the methods out of the table, but leave their entries to be
+        // freed once no reader can be using them
+        table = g_index_methods;
+        mask = table->capacity - 1;
+        for (j = 0; j < klass->method_count; ++j)
+        {
+            for (k = hashMethodID(klass->methods[j]) & mask;
+                 table->slots[k].method; k = (k + 1) & mask)
+                if (table->slots[k].entry == &klass->entries[j])
+                {
+                    STORE_RELEASE(&table->slots[k].entry,
+                                  (struct indexed_method *)NULL);
+                    break;
+                }
+        }
+        g_index_method_count -= klass->method_count;
+        removeClass(slot);
+        klass->next_retired = g_index_retired;
+        g_index_retired = klass;
+    }
+    freeRetired(jvmti_env);
+    exitMonitor(jvmti_env, g_index_lock);
+}
+
+#ifdef _MSC_VER
+#pragma warning (pop)
+#endif // _MSC_VER
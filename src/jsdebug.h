@@ -0,0 +1,424 @@
+/* Copyright 2026 (c) Suneido Software Corp. All rights reserved.
+ * Licensed under GPLv2.
+ */
+
+#ifndef JSDEBUG_H
+#define JSDEBUG_H
+
+#ifdef _MSC_VER
+#pragma warning (disable : 4001) /* nonstandard extension: '//-style' comment */
+#endif // _MSC_VER
+
+//==============================================================================
+// file: jsdebug.h
+// auth: agent
+// date: 20261018
+// desc: Declarations shared between the translation units of the agent
+//==============================================================================
+
+#include <jvmti.h>
+
+// JDK 19 added the can_support_virtual_threads capability (and the virtual
+// thread semantics that go with it) to jvmti.h. The header doesn't expose a
+// version macro of its own, so key off the matching JNI version macro.
+#if defined(JNI_VERSION_19)
+#define JSDEBUG_VIRTUAL_THREADS
+#endif
+
+// Likewise JDK 11 added sampled object allocation events. Its jni.h doesn't
+// have a JNI_VERSION_11, so this also picks up JDK 10, which isn't supported.
+#if defined(JNI_VERSION_10)
+#define JSDEBUG_SAMPLED_ALLOC
+#endif
+
+// Atomic operations for data shared between threads without a lock. Values
+// published to lock-free readers are stored with release semantics and loaded
+// with acquire semantics, which MSVC gives all volatile accesses on x86 and
+// x64, so the variables must be declared volatile. ATOMIC_ADD() returns the
+// new value of a volatile long and is a full barrier.
+#ifdef _MSC_VER
+#include <intrin.h>
+#define LOAD_ACQUIRE(p)     (*(p))
+#define STORE_RELEASE(p, v) (*(p) = (v))
+#define ATOMIC_ADD(p, v)    (_InterlockedExchangeAdd((p), (v)) + (v))
+#else
+#define LOAD_ACQUIRE(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define ATOMIC_ADD(p, v)    __sync_add_and_fetch((p), (v))
+#endif
+
+// =============================================================================
+//                                 CONSTANTS
+// =============================================================================
+
+enum method_name
+{
+    METHOD_NAME_UNKNOWN = 0x000,
+    METHOD_NAME_EVAL    = 0x100,
+    METHOD_NAME_EVAL0   = METHOD_NAME_EVAL | 10,
+    METHOD_NAME_EVAL1   = METHOD_NAME_EVAL | 11,
+    METHOD_NAME_EVAL2   = METHOD_NAME_EVAL | 12,
+    METHOD_NAME_EVAL3   = METHOD_NAME_EVAL | 13,
+    METHOD_NAME_EVAL4   = METHOD_NAME_EVAL | 14,
+    METHOD_NAME_CALL    = 0x200,
+    METHOD_NAME_CALL0   = METHOD_NAME_CALL | 10,
+    METHOD_NAME_CALL1   = METHOD_NAME_CALL | 11,
+    METHOD_NAME_CALL2   = METHOD_NAME_CALL | 12,
+    METHOD_NAME_CALL3   = METHOD_NAME_CALL | 13,
+    METHOD_NAME_CALL4   = METHOD_NAME_CALL | 14,
+};
+
+// Parameters for the 64-bit FNV-1a hash used for stack signatures
+#define FNV1A_64_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV1A_64_PRIME        0x00000100000001b3ULL
+
+enum
+{
+    REPEAT_ELIDED        = -1,  /* frame covered by a repeat count */
+    CAPTURE_STACK_FRAMES = 128, /* frames captured without using the heap */
+};
+
+// Options passed to the agent on the command line, e.g.
+// -agentpath:/path/to/jsdebug.so=perfmap,contention,alloc=262144,cpu=100
+struct agent_options
+{
+    int  perf_map;       // Write /tmp/perf-<pid>.map for Linux perf
+    int  contention;     // Profile monitor contention by Suneido stack
+    jint alloc_interval; // If non-zero, profile allocation by Suneido stack,
+                         // sampling about once every this many bytes
+    jint cpu_rate;       // If non-zero, profile CPU use by Suneido stack,
+                         // sampling this many times per second of CPU time
+    int  stepping;       // Allow stepping through Suneido code
+    jint watchdog;       // If non-zero, log the Suneido stack of any thread
+                         // in the same Suneido call for this many seconds
+    int  watch_locals;   // Include local variable names in watchdog logs
+    int  index;          // Index Suneido callable classes as they load
+    int  jit_counts;     // Count what happens to compiled code captured
+};
+
+// A Java stack frame which findSuneidoFrames() has determined to be the top
+// Java frame of a Suneido callable invocation.
+struct suneido_frame
+{
+    jmethodID method;
+    jlocation location;
+    jint      frame_index;  // Index into the stack trace walked
+    jint      line_number;
+    jint      repeat_count; // 0, REPEAT_ELIDED, or see compressRecursion()
+    jboolean  is_call;
+};
+
+// The locals of one Suneido frame in a stack capture
+struct captured_locals
+{
+    jboolean                  fetched;     // False if locals weren't wanted
+    jint                      count;       // Non-null reference locals found
+    const char **             names;       // Point into table or the index
+    jobject *                 values;      // Local references, never NULL
+    jvmtiLocalVariableEntry * table;       // From GetLocalVariableTable()
+    jint                      table_count;
+};
+
+// What captureStack() should capture
+struct capture_params
+{
+    jint     start_depth;        // Depth of the first Java frame to walk
+    jboolean minimize_deopt;     // Avoid reading "this" where possible
+    jboolean compress;           // Compress runs of recursive frames
+    jboolean locals;             // Fetch the locals of the Suneido frames
+    jboolean hash;               // Compute the stack signature hash
+    jint     locals_frame_limit; // If positive, fetch locals of only this
+                                 // many of the innermost Suneido frames
+};
+
+// A snapshot of the Suneido stack of a thread. captureStack() does all the
+// JVMTI work to fill it in once, after which any number of sinks can turn it
+// into output. It must be released with releaseCapture().
+struct stack_capture
+{
+    jint                     java_frame_count; // Java frames walked
+    jint                     count;            // Suneido frames found
+    struct suneido_frame *   frames;           // Innermost first
+    struct captured_locals * locals;           // Parallel to frames, or NULL
+    unsigned long long       hash;             // 0 unless params->hash
+    jvmtiFrameInfo *         frame_buffer;
+    jvmtiFrameInfo           frame_buffer_stack[CAPTURE_STACK_FRAMES];
+    struct suneido_frame     frames_stack[CAPTURE_STACK_FRAMES];
+};
+
+// A growable NUL-terminated text (or binary) buffer. Start with all zeros and
+// free data when done.
+struct text_buf
+{
+    char * data;
+    size_t length;
+    size_t capacity;
+};
+
+// Aggregate profiles kept by profile.c. These must be kept in sync with the
+// equivalent constants in suneido/debug/Profiler.java.
+enum profile_kind
+{
+    PROFILE_CONTENTION = 0, /* values are nanoseconds spent waiting */
+    PROFILE_ALLOCATION = 1, /* values are bytes of sampled objects */
+    PROFILE_CPU        = 2, /* values are nanoseconds of CPU time */
+    PROFILE_KIND_COUNT,
+};
+
+// =============================================================================
+//                                  GLOBALS
+// =============================================================================
+
+extern JavaVM *   g_jvm;
+extern jvmtiEnv * g_jvmti;              // The agent's one JVMTI environment
+extern jclass     g_stack_frame_class;  // For filtering stack frames, NULL
+                                        // until the VM is initialized
+extern struct agent_options g_options;
+
+// =============================================================================
+//                          ERROR LOGGING FUNCTIONS
+// =============================================================================
+
+void error1(const char * message);
+void error2(const char * prefix, const char * suffix);
+void errorJVMTI(jvmtiEnv * jvmti_env, jvmtiError error, const char * message);
+void fatalError1(const char * message);
+void fatalError2(const char * prefix, const char * suffix);
+void fatalErrorJVMTI(jvmtiEnv * jvmti_env, jvmtiError error,
+                     const char * message);
+void exceptionDescribe(JNIEnv * jni_env);
+
+// =============================================================================
+//                         STACK FRAMES (locals.c)
+// =============================================================================
+
+jint lineNumberAt(const jvmtiLineNumberEntry * line_number_table,
+                  jint line_number_entry_count, jlocation location);
+int fetchLineNumbers(jvmtiEnv * jvmti_env, jmethodID method,
+                     jlocation location, jint * pline_number);
+enum method_name classifyMethodName(const char * name);
+int classifySuneidoMethod(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                          jmethodID method, enum method_name * pname);
+unsigned long long hashBytes(unsigned long long hash,
+                             const unsigned char * bytes, size_t length);
+unsigned long long hashMethodName(const char * class_signature,
+                                  const char * method_name);
+size_t hashMethodID(jmethodID method);
+int getClassGlobalRef(JNIEnv * jni_env, jclass * pclass, const char * name);
+void enterMonitor(jvmtiEnv * jvmti_env, jrawMonitorID monitor);
+void exitMonitor(jvmtiEnv * jvmti_env, jrawMonitorID monitor);
+void formatClassName(const char * signature, jboolean is_suneido,
+                     char * buffer, size_t size);
+int findSuneidoFrames(jvmtiEnv * jvmti_env, JNIEnv * jni_env, jthread thread,
+                      jint start_depth, const jvmtiFrameInfo * frame_buffer,
+                      jint frame_count, jboolean minimize_deopt,
+                      struct suneido_frame * frames, jint * pcount,
+                      unsigned long long * phash);
+jobject newStackInfo(JNIEnv * jni_env, const struct stack_capture * capture);
+
+// =============================================================================
+//                          CAPTURE CORE (capture.c)
+// =============================================================================
+
+int appendText(struct text_buf * buf, const char * str, size_t length);
+void deallocateLocalVariableTable(jvmtiEnv * jvmti_env,
+                                  jvmtiLocalVariableEntry * table, jint count);
+int captureStack(jvmtiEnv * jvmti_env, JNIEnv * jni_env, jthread thread,
+                 const struct capture_params * params,
+                 struct stack_capture * capture);
+void releaseCapture(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                    struct stack_capture * capture);
+int captureFrameName(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                     const struct suneido_frame * frame, char * buffer,
+                     size_t size);
+void logCapture(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                const struct stack_capture * capture, const char * title);
+jbyteArray captureToBytes(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                          const struct stack_capture * capture);
+
+// =============================================================================
+//                          AGENT OPTIONS (options.c)
+// =============================================================================
+
+int parseOptions(const char * options);
+
+// =============================================================================
+//                      COMPILED METHODS (compiled.c)
+// =============================================================================
+
+void addCompiledMethodCapabilities(jvmtiCapabilities * caps);
+int initCompiledMethods(jvmtiEnv * jvmti_env);
+void noteCapturedFrame(jvmtiEnv * jvmti_env, jmethodID method);
+void JNICALL callback_CompiledMethodLoad(jvmtiEnv * jvmti_env,
+                                         jmethodID method, jint code_size,
+                                         const void * code_addr,
+                                         jint map_length,
+                                         const jvmtiAddrLocationMap * map,
+                                         const void * compile_info);
+void JNICALL callback_CompiledMethodUnload(jvmtiEnv * jvmti_env,
+                                           jmethodID method,
+                                           const void * code_addr);
+
+// =============================================================================
+//                          PERF MAP (perfmap.c)
+// =============================================================================
+
+int initPerfMap(jvmtiEnv * jvmti_env);
+void perfMapCompiledMethod(jvmtiEnv * jvmti_env, jmethodID method,
+                           const void * code_addr, jint code_size);
+void JNICALL callback_DynamicCodeGenerated(jvmtiEnv * jvmti_env,
+                                           const char * name,
+                                           const void * address, jint length);
+
+// =============================================================================
+//                      THREAD LOCAL STATE (threads.c)
+// =============================================================================
+
+// State of a thread being stepped through Suneido code by stepping.c.
+// Heights are frame counts from the bottom of the stack, so they don't change
+// as frames are pushed and popped above.
+struct step_state
+{
+    jint      kind;             // See enum step_kind, 0 if not stepping
+    jmethodID method;           // Suneido frame the step started in
+    jint      line_number;
+    jint      height;
+    jint      limit;            // Height of the outermost frame to stop in
+    jint      pop_height;       // If non-zero, waiting for this frame to pop
+    jmethodID cache_method;     // Last method looked at by isSuneidoMethod()
+    jboolean  cache_is_suneido;
+};
+
+// Per-thread state kept by the agent in JVMTI thread-local storage
+struct thread_state
+{
+    jlong              contended_since; // GetTime() at MonitorContendedEnter
+    unsigned long long contended_hash;  // Stack hash at MonitorContendedEnter
+    jboolean           contended;       // Between the two contention events
+    struct step_state  step;
+};
+
+int initThreadStates(jvmtiEnv * jvmti_env);
+struct thread_state * getThreadState(jvmtiEnv * jvmti_env, jthread thread);
+int startAgentThread(jvmtiEnv * jvmti_env, JNIEnv * jni_env, const char * name,
+                     jvmtiStartFunction proc, void * arg);
+void JNICALL callback_ThreadEnd(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                                jthread thread);
+
+// =============================================================================
+//                          PROFILES (profile.c)
+// =============================================================================
+
+int initProfile(jvmtiEnv * jvmti_env, enum profile_kind kind);
+int profileStack(jvmtiEnv * jvmti_env, JNIEnv * jni_env, jthread thread,
+                 enum profile_kind kind, unsigned long long * phash);
+int profileFrames(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                  enum profile_kind kind, const struct suneido_frame * frames,
+                  jint count, unsigned long long * phash);
+void profileAdd(jvmtiEnv * jvmti_env, enum profile_kind kind,
+                unsigned long long hash, jlong count, jlong value);
+int writeProfile(enum profile_kind kind, jboolean values, const char * path);
+
+// =============================================================================
+//                     MONITOR CONTENTION (contention.c)
+// =============================================================================
+
+void addContentionCapabilities(jvmtiCapabilities * caps);
+int initContention(jvmtiEnv * jvmti_env);
+void JNICALL callback_MonitorContendedEnter(jvmtiEnv * jvmti_env,
+                                            JNIEnv * jni_env, jthread thread,
+                                            jobject object);
+void JNICALL callback_MonitorContendedEntered(jvmtiEnv * jvmti_env,
+                                              JNIEnv * jni_env, jthread thread,
+                                              jobject object);
+
+// =============================================================================
+//                   SAMPLED ALLOCATION (allocation.c)
+// =============================================================================
+
+int addAllocationCapabilities(jvmtiEnv * jvmti_env, jvmtiCapabilities * caps);
+int initAllocation(jvmtiEnv * jvmti_env, jint interval);
+#ifdef JSDEBUG_SAMPLED_ALLOC
+void JNICALL callback_SampledObjectAlloc(jvmtiEnv * jvmti_env,
+                                         JNIEnv * jni_env, jthread thread,
+                                         jobject object, jclass object_klass,
+                                         jlong size);
+#endif
+
+// =============================================================================
+//                         CPU SAMPLING (cpu.c)
+// =============================================================================
+
+int initCpuSampler(jvmtiEnv * jvmti_env, jint rate);
+int startCpuSampler(jvmtiEnv * jvmti_env, JNIEnv * jni_env);
+void handleCpuClassPrepare(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                           jclass klass);
+void JNICALL callback_VMDeath(jvmtiEnv * jvmti_env, JNIEnv * jni_env);
+
+// =============================================================================
+//                       SUNEIDO BREAKPOINTS (breakpoints.c)
+// =============================================================================
+
+int initBreakpoints(jvmtiEnv * jvmti_env, JNIEnv * jni_env);
+void handleUserBreakpoint(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                          jthread thread, jmethodID method,
+                          jlocation location);
+
+// =============================================================================
+//                         STEPPING (stepping.c)
+// =============================================================================
+
+void addSteppingCapabilities(jvmtiCapabilities * caps);
+int initStepping(jvmtiEnv * jvmti_env);
+void JNICALL callback_SingleStep(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                                 jthread thread, jmethodID method,
+                                 jlocation location);
+void JNICALL callback_FramePop(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                               jthread thread, jmethodID method,
+                               jboolean was_popped_by_exception);
+
+// =============================================================================
+//                         WATCHDOG (watchdog.c)
+// =============================================================================
+
+void addWatchdogCapabilities(jvmtiCapabilities * caps);
+int initWatchdog(jvmtiEnv * jvmti_env, jint seconds, jboolean locals);
+int startWatchdog(jvmtiEnv * jvmti_env, JNIEnv * jni_env);
+
+// =============================================================================
+//                         METHOD INDEX (index.c)
+// =============================================================================
+
+// A reference local variable of an indexed method. The name is never freed.
+struct indexed_local
+{
+    jlocation    start_location;
+    jint         length;
+    jint         slot;
+    const char * name;
+};
+
+void addIndexCapabilities(jvmtiCapabilities * caps);
+int initIndex(jvmtiEnv * jvmti_env);
+int startIndex(jvmtiEnv * jvmti_env, JNIEnv * jni_env);
+int lookupIndexedMethod(jmethodID method, jint * pmodifiers,
+                        enum method_name * pname);
+int lookupIndexedNameHash(jmethodID method, unsigned long long * phash);
+int lookupIndexedLine(jmethodID method, jlocation location,
+                      jint * pline_number);
+int lookupIndexedLocals(jmethodID method,
+                        const struct indexed_local ** ptable, jint * pcount);
+void pinIndex();
+void unpinIndex();
+void JNICALL callback_ClassPrepare(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                                   jthread thread, jclass klass);
+void JNICALL callback_ObjectFree(jvmtiEnv * jvmti_env, jlong tag);
+
+// =============================================================================
+//                           FRAME IDS (frameids.c)
+// =============================================================================
+
+int initFrameIds(jvmtiEnv * jvmti_env);
+jint frameId(jvmtiEnv * jvmti_env, JNIEnv * jni_env, jmethodID method);
+
+#endif // JSDEBUG_H
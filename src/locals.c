@@ -19,7 +19,7 @@
 //          in case the "jsdebug" agent library cannot be loaded into the JVM.
 // -----------------------------------------------------------------------------
 
-#include <jvmti.h>
+#include "jsdebug.h"
 
 #include <assert.h>
 #include <string.h>
@@ -34,7 +34,9 @@ enum
     DEFAULT_LINE_NUMBER = -1,
     NATIVE_METHOD_JLOCATION = -1,
     SKIP_FRAMES = 1 /* i.e. we know frame #1 is StackInfo.fetchInfo() */,
-    MAX_STACK_FRAMES = 128,
+    NAME_TABLE_CAPACITY = 4096 /* must be a power of 2 */,
+    SHALLOW_STRING_LIMIT = 80 /* UTF-16 units kept of a summarized string */,
+    SHALLOW_TYPE_NAME_MAX = 256,
 };
 
 enum
@@ -43,28 +45,49 @@ enum
     ACC_STATIC      = 0x0008,
 };
 
-enum method_name
-{
-    METHOD_NAME_UNKNOWN = 0x000,
-    METHOD_NAME_EVAL    = 0x100,
-    METHOD_NAME_EVAL0   = METHOD_NAME_EVAL | 10,
-    METHOD_NAME_EVAL1   = METHOD_NAME_EVAL | 11,
-    METHOD_NAME_EVAL2   = METHOD_NAME_EVAL | 12,
-    METHOD_NAME_EVAL3   = METHOD_NAME_EVAL | 13,
-    METHOD_NAME_EVAL4   = METHOD_NAME_EVAL | 14,
-    METHOD_NAME_CALL    = 0x200,
-    METHOD_NAME_CALL0   = METHOD_NAME_CALL | 10,
-    METHOD_NAME_CALL1   = METHOD_NAME_CALL | 11,
-    METHOD_NAME_CALL2   = METHOD_NAME_CALL | 12,
-    METHOD_NAME_CALL3   = METHOD_NAME_CALL | 13,
-    METHOD_NAME_CALL4   = METHOD_NAME_CALL | 14,
+// Bit flags read from the optional StackInfo.captureFlags field. These must be
+// kept in sync with the equivalent constants in suneido/debug/StackInfo.java.
+enum capture_flag
+{
+    CAPTURE_HASH_ONLY          = 0x0001, /* only compute StackInfo.stackHash */
+    CAPTURE_COMPRESS_RECURSION = 0x0002, /* see StackInfo.repeatCounts */
+    CAPTURE_MINIMIZE_DEOPT     = 0x0004, /* avoid touching unneeded frames */
+    CAPTURE_LOG                = 0x0008, /* also write the stack to stderr */
+    CAPTURE_BYTES              = 0x0010, /* also see StackInfo.stackBytes */
+    CAPTURE_REUSE_ARRAYS       = 0x0020, /* see StackInfo.frameCount */
+    CAPTURE_SHALLOW            = 0x0040, /* store summaries of locals values */
+    CAPTURE_WEAK_VALUES        = 0x0080, /* with CAPTURE_SHALLOW, store weak
+                                            references to unsummarized values */
+};
+
+// What storeCapture() stores into StackInfo.localsValues
+enum value_mode
+{
+    VALUES_REFERENCES,   /* the values themselves */
+    VALUES_SHALLOW,      /* summaries, see summarizeValue() */
+    VALUES_SHALLOW_WEAK, /* summaries, else weak references to the values */
 };
 
+// What a method's declaring class says about the "this" of frames executing
+// the method, relative to g_stack_frame_class.
+enum class_relation
+{
+    CLASS_UNRELATED,      /* "this" can't be a Suneido callable */
+    CLASS_MAYBE_SUNEIDO,  /* need to look at "this" to find out */
+    CLASS_SUNEIDO,        /* "this" is certainly a Suneido callable */
+};
+
+
 static const char * JAVA_LANG_THROWABLE_CLASS       = "java/lang/Throwable";
 static const char * JAVA_LANG_STRING_CLASS          = "java/lang/String";
 static const char * JAVA_LANG_OBJECT_CLASS          = "java/lang/Object";
 static const char * ARRAY_OF_JAVA_LANG_STRING_CLASS = "[Ljava/lang/String;";
 static const char * ARRAY_OF_JAVA_LANG_OBJECT_CLASS = "[Ljava/lang/Object;";
+static const char * WEAK_REFERENCE_CLASS            =
+    "java/lang/ref/WeakReference";
+static const char * WEAK_REFERENCE_INIT_SIGNATURE   = "(Ljava/lang/Object;)V";
+static const char * TO_STRING_METHOD_NAME           = "toString";
+static const char * TO_STRING_METHOD_SIGNATURE      = "()Ljava/lang/String;";
 static const char * THROWABLE_GET_MSG_METHOD_NAME   = "getMessage";
 static const char * THROWABLE_GET_MSG_METHOD_SIGNATURE =
     "()Ljava/lang/String;";
@@ -81,9 +104,44 @@ static const char * LINE_NUMBERS_FIELD_NAME         = "lineNumbers";
 static const char * LINE_NUMBERS_FIELD_SIGNATURE    = "[I";
 static const char * IS_INITIALIZED_FIELD_NAME       = "isInitialized";
 static const char * IS_INITIALIZED_FIELD_SIGNATURE  = "Z";
+static const char * CAPTURE_FLAGS_FIELD_NAME        = "captureFlags";
+static const char * CAPTURE_FLAGS_FIELD_SIGNATURE   = "I";
+static const char * STACK_HASH_FIELD_NAME           = "stackHash";
+static const char * STACK_HASH_FIELD_SIGNATURE      = "J";
+static const char * REPEAT_COUNTS_FIELD_NAME        = "repeatCounts";
+static const char * REPEAT_COUNTS_FIELD_SIGNATURE   = "[I";
+static const char * LOCALS_FRAME_LIMIT_FIELD_NAME   = "localsFrameLimit";
+static const char * LOCALS_FRAME_LIMIT_FIELD_SIGNATURE = "I";
+static const char * STACK_BYTES_FIELD_NAME          = "stackBytes";
+static const char * STACK_BYTES_FIELD_SIGNATURE     = "[B";
+static const char * FRAME_COUNT_FIELD_NAME          = "frameCount";
+static const char * FRAME_COUNT_FIELD_SIGNATURE     = "I";
+static const char * FRAME_IDS_FIELD_NAME            = "frameIds";
+static const char * FRAME_IDS_FIELD_SIGNATURE       = "[I";
 static const char * BREAKPT_METHOD_NAME             = "fetchInfo";
 static const char * BREAKPT_METHOD_SIGNATURE        = "()Lsuneido/debug/StackInfo;";
 
+// Classes whose values a shallow capture stores in string form
+static const char * BOXED_CLASS_SIGNATURES[] =
+{
+    "Ljava/lang/Boolean;",
+    "Ljava/lang/Byte;",
+    "Ljava/lang/Character;",
+    "Ljava/lang/Short;",
+    "Ljava/lang/Integer;",
+    "Ljava/lang/Long;",
+    "Ljava/lang/Float;",
+    "Ljava/lang/Double;",
+    "Ljava/math/BigInteger;",
+    "Ljava/math/BigDecimal;",
+};
+
+static const char   PRIMITIVE_SIGNATURES[] = "ZBCSIJFD";
+static const char * PRIMITIVE_NAMES[] =
+{
+    "boolean", "byte", "char", "short", "int", "long", "float", "double"
+};
+
 // =============================================================================
 //                                  GLOBALS
 // =============================================================================
@@ -94,14 +152,40 @@ static jclass     g_java_lang_object_class;
 static jclass     g_array_of_java_lang_string_class;
 static jclass     g_array_of_java_lang_object_class;
 static jmethodID  g_throwable_get_message_method;
+static jclass     g_weak_reference_class;
+static jmethodID  g_object_to_string_method;
+static jmethodID  g_weak_reference_init_method;
+
+JavaVM *          g_jvm;
+jvmtiEnv *        g_jvmti;
 
 static jclass     g_repo_class;                 // Repository for stack info
-static jclass     g_stack_frame_class;          // For filtering stack frames
+jclass            g_stack_frame_class;          // For filtering stack frames
 static jfieldID   g_locals_name_field;
 static jfieldID   g_locals_value_field;
 static jfieldID   g_is_call_field;
 static jfieldID   g_line_numbers_field;
 static jfieldID   g_is_initialized_field;
+static jfieldID   g_capture_flags_field;        // Optional, may be NULL
+static jfieldID   g_stack_hash_field;           // Optional, may be NULL
+static jfieldID   g_repeat_counts_field;        // Optional, may be NULL
+static jfieldID   g_locals_frame_limit_field;   // Optional, may be NULL
+static jfieldID   g_stack_bytes_field;          // Optional, may be NULL
+static jfieldID   g_frame_count_field;          // Optional, may be NULL
+static jfieldID   g_frame_ids_field;            // Optional, may be NULL
+static jmethodID  g_fetch_info_method;          // Where our breakpoint is
+
+// Java strings for local variable names, shared by all captures. The table is
+// open-addressed and entries are never removed.
+struct interned_name
+{
+    char *  chars;  // Modified UTF-8 name; NULL if slot empty
+    jstring string; // Global reference
+};
+
+static jrawMonitorID        g_names_lock;
+static struct interned_name g_names[NAME_TABLE_CAPACITY];
+static size_t               g_name_count;
 
 // =============================================================================
 //                          ERROR LOGGING FUNCTIONS
@@ -132,14 +216,14 @@ static void fatalErrorPrefix()
     fputs("FATAL: jsdebug: ", stderr);
 }
 
-static void error1(const char * message)
+void error1(const char * message)
 {
     fputs(message, stderr);
     fputc('\n', stderr);
     fflush(stderr);
 }
 
-static void error2(const char * prefix, const char * suffix)
+void error2(const char * prefix, const char * suffix)
 {
     fputs(prefix, stderr);
     fputs(suffix, stderr);
@@ -147,8 +231,8 @@ static void error2(const char * prefix, const char * suffix)
     fflush(stderr);
 }
 
-static void errorJVMTI(jvmtiEnv * jvmti_env, jvmtiError error,
-                       const char * message)
+void errorJVMTI(jvmtiEnv * jvmti_env, jvmtiError error,
+                const char * message)
 {
     char *           name = NULL;
     struct tostr_buf buffer;
@@ -169,26 +253,26 @@ static void errorJVMTI(jvmtiEnv * jvmti_env, jvmtiError error,
     fflush(stderr);
 }
 
-static void fatalError1(const char * message)
+void fatalError1(const char * message)
 {
     fatalErrorPrefix();
     error1(message);
 }
 
-static void fatalError2(const char * prefix, const char * suffix)
+void fatalError2(const char * prefix, const char * suffix)
 {
     fatalErrorPrefix();
     error2(prefix, suffix);
 }
 
-static void fatalErrorJVMTI(jvmtiEnv * jvmti_env, jvmtiError error,
-                            const char * message)
+void fatalErrorJVMTI(jvmtiEnv * jvmti_env, jvmtiError error,
+                     const char * message)
 {
     fatalErrorPrefix();
     errorJVMTI(jvmti_env, error, message);
 }
 
-static void exceptionDescribe(JNIEnv * jni_env)
+void exceptionDescribe(JNIEnv * jni_env)
 {
     jthrowable   throwable        = (jthrowable)NULL;
     jstring      message          = (jstring)NULL;
@@ -226,8 +310,7 @@ static void exceptionDescribe(JNIEnv * jni_env)
 //                             HELPER FUNCTIONS
 // =============================================================================
 
-static int getClassGlobalRef(JNIEnv * jni_env, jclass * pclass,
-                             const char * name)
+int getClassGlobalRef(JNIEnv * jni_env, jclass * pclass, const char * name)
 {
     jclass local_ref = (*jni_env)->FindClass(jni_env, name);
     jclass global_ref = (jclass)NULL;
@@ -274,6 +357,24 @@ static int getFieldID(JNIEnv * jni_env, jclass clazz, jfieldID * pfieldID,
     return 1;
 }
 
+// Like getFieldID(), but a missing field isn't an error. This lets the agent
+// work with versions of the Java code that don't declare newer fields: the
+// field ID is just left NULL and the feature that uses the field is disabled.
+static int getOptionalFieldID(JNIEnv * jni_env, jclass clazz,
+                              jfieldID * pfieldID, const char * name,
+                              const char * sig)
+{
+    jfieldID fieldID = (*jni_env)->GetFieldID(jni_env, clazz, name, sig);
+    if ((*jni_env)->ExceptionCheck(jni_env))
+    {
+        (*jni_env)->ExceptionClear(jni_env); // NoSuchFieldError
+        fieldID = (jfieldID)NULL;
+    }
+    *pfieldID = fieldID;
+    // Return success
+    return 1;
+}
+
 static int getMethodID(JNIEnv * jni_env, jclass clazz, jmethodID * pmethodID,
                        const char * name, const char * sig)
 {
@@ -311,6 +412,14 @@ static int initGlobalRefs(JNIEnv * jni_env)
             ARRAY_OF_JAVA_LANG_STRING_CLASS) &&
         getClassGlobalRef(jni_env, &g_array_of_java_lang_object_class,
             ARRAY_OF_JAVA_LANG_OBJECT_CLASS) &&
+        getMethodID(jni_env, g_java_lang_object_class,
+            &g_object_to_string_method, TO_STRING_METHOD_NAME,
+            TO_STRING_METHOD_SIGNATURE) &&
+        getClassGlobalRef(jni_env, &g_weak_reference_class,
+            WEAK_REFERENCE_CLASS) &&
+        getMethodID(jni_env, g_weak_reference_class,
+            &g_weak_reference_init_method, "<init>",
+            WEAK_REFERENCE_INIT_SIGNATURE) &&
         getClassGlobalRef(jni_env, &g_repo_class, REPO_CLASS) &&
         getFieldID(jni_env, g_repo_class, &g_locals_name_field,
             LOCALS_NAME_FIELD_NAME, LOCALS_NAME_FIELD_SIGNATURE) &&
@@ -322,6 +431,21 @@ static int initGlobalRefs(JNIEnv * jni_env)
             LINE_NUMBERS_FIELD_NAME, LINE_NUMBERS_FIELD_SIGNATURE) &&
         getFieldID(jni_env, g_repo_class, &g_is_initialized_field,
             IS_INITIALIZED_FIELD_NAME, IS_INITIALIZED_FIELD_SIGNATURE) &&
+        getOptionalFieldID(jni_env, g_repo_class, &g_capture_flags_field,
+            CAPTURE_FLAGS_FIELD_NAME, CAPTURE_FLAGS_FIELD_SIGNATURE) &&
+        getOptionalFieldID(jni_env, g_repo_class, &g_stack_hash_field,
+            STACK_HASH_FIELD_NAME, STACK_HASH_FIELD_SIGNATURE) &&
+        getOptionalFieldID(jni_env, g_repo_class, &g_repeat_counts_field,
+            REPEAT_COUNTS_FIELD_NAME, REPEAT_COUNTS_FIELD_SIGNATURE) &&
+        getOptionalFieldID(jni_env, g_repo_class, &g_locals_frame_limit_field,
+            LOCALS_FRAME_LIMIT_FIELD_NAME,
+            LOCALS_FRAME_LIMIT_FIELD_SIGNATURE) &&
+        getOptionalFieldID(jni_env, g_repo_class, &g_stack_bytes_field,
+            STACK_BYTES_FIELD_NAME, STACK_BYTES_FIELD_SIGNATURE) &&
+        getOptionalFieldID(jni_env, g_repo_class, &g_frame_count_field,
+            FRAME_COUNT_FIELD_NAME, FRAME_COUNT_FIELD_SIGNATURE) &&
+        getOptionalFieldID(jni_env, g_repo_class, &g_frame_ids_field,
+            FRAME_IDS_FIELD_NAME, FRAME_IDS_FIELD_SIGNATURE) &&
         getClassGlobalRef(jni_env, &g_stack_frame_class, STACK_FRAME_CLASS);
 }
 
@@ -364,6 +488,7 @@ static int initBreakpoint(jvmtiEnv * jvmti_env, JNIEnv * jni_env)
         fatalErrorJVMTI(jvmti_env, error, "failed to set breakpoint");
         return 0;
     }
+    g_fetch_info_method = method_id;
     // Return success
     return 1;
 }
@@ -417,27 +542,18 @@ static int objFieldPut(JNIEnv * jni_env, jobject obj, jfieldID field_id,
     return 1;
 }
 
-static int isSame(JNIEnv * jni_env, jobject obj1MaybeNull, jobject obj2NotNull)
+// Returns true iff an option needs compiled method events. Besides feeding the
+// JIT counts and the perf map, they make HotSpot keep the debug information
+// AsyncGetCallTrace() needs to map compiled code to methods accurately.
+static int wantsCompiledMethods()
 {
-    return obj1MaybeNull && 
-        (*jni_env)->IsSameObject(jni_env, obj1MaybeNull, obj2NotNull);
+    return g_options.jit_counts || g_options.perf_map || g_options.cpu_rate;
 }
 
-static void deallocateLocalVariableTable(
-    jvmtiEnv * jvmti_env, jvmtiLocalVariableEntry * table, jint count)
-
+static int isSame(JNIEnv * jni_env, jobject obj1MaybeNull, jobject obj2NotNull)
 {
-    jint k;
-    assert(table || !"Local variable table should not be null");
-    for (k = 0; k < count; ++k)
-    {
-        (*jvmti_env)->Deallocate(jvmti_env, (unsigned char *)table[k].name);
-        (*jvmti_env)->Deallocate(jvmti_env,
-                                (unsigned char *)table[k].signature);
-        (*jvmti_env)->Deallocate(jvmti_env,
-                                 (unsigned char *)table[k].generic_signature);
-    }
-    (*jvmti_env)->Deallocate(jvmti_env, (unsigned char *)table);
+    return obj1MaybeNull && 
+        (*jni_env)->IsSameObject(jni_env, obj1MaybeNull, obj2NotNull);
 }
 
 // =============================================================================
@@ -457,9 +573,31 @@ static void JNICALL callback_JVMInit(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
     // back into Java.
     if (!initGlobalRefs(jni_env))
         goto callback_JVMInit_fatal;
+    error = (*jvmti_env)->CreateRawMonitor(jvmti_env, "jsdebug names",
+                                           &g_names_lock);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        fatalErrorJVMTI(jvmti_env, error, "failed to create names lock");
+        goto callback_JVMInit_fatal;
+    }
     // Set the breakpoint.
     if (!initBreakpoint(jvmti_env, jni_env))
         goto callback_JVMInit_fatal;
+    // Allow breakpoints in Suneido code to be set from Java
+    if (!initBreakpoints(jvmti_env, jni_env))
+        goto callback_JVMInit_fatal;
+    // Captures can identify their frames by id
+    if (!initFrameIds(jvmti_env))
+        goto callback_JVMInit_fatal;
+    // Start indexing Suneido callable classes in the background
+    if (g_options.index && !startIndex(jvmti_env, jni_env))
+        goto callback_JVMInit_fatal;
+    // Start CPU sampling, which needs to know the Suneido callable class
+    if (g_options.cpu_rate && !startCpuSampler(jvmti_env, jni_env))
+        goto callback_JVMInit_fatal;
+    // Start watching for threads stuck in one Suneido call
+    if (g_options.watchdog && !startWatchdog(jvmti_env, jni_env))
+        goto callback_JVMInit_fatal;
     // Enable breakpoint events
     error = (*jvmti_env)->SetEventNotificationMode(jvmti_env, JVMTI_ENABLE,
                                                    JVMTI_EVENT_BREAKPOINT,
@@ -484,35 +622,20 @@ callback_JVMInit_fatal:
 //                         BREAKPOINT EVENT HANDLER
 // =============================================================================
 
-static int fetchLineNumbers(jvmtiEnv * jvmti_env, jmethodID method,
-                            jlocation location, jint * line_numbers_arr,
-                            jint frame_index)
+// Looks up the line number of a location in a line number table, which may be
+// empty, in which case the line number is DEFAULT_LINE_NUMBER.
+jint lineNumberAt(const jvmtiLineNumberEntry * line_number_table,
+                  jint line_number_entry_count, jlocation location)
 {
-    int                    result = 0;
-    jvmtiError             error;
-    jvmtiLineNumberEntry * line_number_table = NULL;
-    jint                   line_number_entry_count = 0;
-    jint                   line_number = DEFAULT_LINE_NUMBER;
-    jint                   lo, mi, hi, len; // for binary search
-    // Get the line number table entry
-    error = (*jvmti_env)->GetLineNumberTable(jvmti_env, method,
-                                             &line_number_entry_count,
-                                             &line_number_table);
-    if (JVMTI_ERROR_ABSENT_INFORMATION == error)
-        goto fetchLineNumbers_store; // Store default value
-    else if (JVMTI_ERROR_NONE != error)
-    {
-        errorJVMTI(jvmti_env, error, "failed to get line number table");
-        goto fetchLineNumbers_end;
-    }
-    else if (line_number_entry_count < 1)
-        goto fetchLineNumbers_store;
+    jint lo, mi, hi, len; // for binary search
+    if (line_number_entry_count < 1)
+        return DEFAULT_LINE_NUMBER;
     assert(line_number_table || !"Line number table should not be null");
     // Find the greatest location in the table that is less than or equal to
     // the given location.
     lo = 0;
     hi = line_number_entry_count; // hi is "one past the end"
-fetchLineNumbers_binary_search:
+lineNumberAt_binary_search:
     len = hi - lo;
     if (len < 16)
     {
@@ -520,13 +643,9 @@ fetchLineNumbers_binary_search:
         for (++lo; lo < hi; ++lo)
         {
             if (location < line_number_table[lo].start_location)
-            {
-                line_number = line_number_table[lo - 1].line_number;
-                goto fetchLineNumbers_store;
-            }
+                return line_number_table[lo - 1].line_number;
         }
-        line_number = line_number_table[hi - 1].line_number;
-        goto fetchLineNumbers_store;
+        return line_number_table[hi - 1].line_number;
     }
     else // 16 < len
     {
@@ -534,21 +653,41 @@ fetchLineNumbers_binary_search:
         if (line_number_table[mi].start_location < location)
         {
             lo = mi; // include mi
-            goto fetchLineNumbers_binary_search;
+            goto lineNumberAt_binary_search;
         }
         else if (location < line_number_table[mi].start_location)
         {
             hi = mi; // exclude mi : hi is "one past the end"
-            goto fetchLineNumbers_binary_search;
+            goto lineNumberAt_binary_search;
         }
         else // equal
-        {
-            line_number = line_number_table[mi].line_number;
-            goto fetchLineNumbers_store;
-        }
+            return line_number_table[mi].line_number;
+    }
+}
+
+int fetchLineNumbers(jvmtiEnv * jvmti_env, jmethodID method,
+                     jlocation location, jint * pline_number)
+{
+    int                    result = 0;
+    jvmtiError             error;
+    jvmtiLineNumberEntry * line_number_table = NULL;
+    jint                   line_number_entry_count = 0;
+    // Methods of indexed classes don't need to ask JVMTI
+    if (lookupIndexedLine(method, location, pline_number))
+        return 1;
+    // Get the line number table entry
+    error = (*jvmti_env)->GetLineNumberTable(jvmti_env, method,
+                                             &line_number_entry_count,
+                                             &line_number_table);
+    if (JVMTI_ERROR_ABSENT_INFORMATION == error)
+        line_number_entry_count = 0; // Store default value
+    else if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(jvmti_env, error, "failed to get line number table");
+        goto fetchLineNumbers_end;
     }
-fetchLineNumbers_store:
-    line_numbers_arr[frame_index] = line_number;
+    *pline_number = lineNumberAt(line_number_table, line_number_entry_count,
+                                 location);
     // Finished with success
     result = 1;
 fetchLineNumbers_end:
@@ -558,111 +697,33 @@ fetchLineNumbers_end:
     return result;
 }
 
-static int fetchLocals(jvmtiEnv * jvmti_env, JNIEnv * jni_env, jthread thread,
-                      jmethodID method, jlocation location,
-                      jobjectArray names_arr, jobjectArray values_arr,
-                      jint frame_index)
-{
-    int                       result = 0;
-    jvmtiError                error;
-    jvmtiLocalVariableEntry * local_entry_table = NULL;
-    jint                      local_entry_count = 0;
-    jobjectArray              frame_names_arr = (jobjectArray)NULL;
-    jobjectArray              frame_values_arr = (jobjectArray)NULL;
-    jint                      table_index;
-    jint                      array_index;
-    jstring                   var_name;
-    jobject                   var_value;
-    // Get the local variable table for this method
-    error = (*jvmti_env)->GetLocalVariableTable(jvmti_env, method,
-        &local_entry_count,
-        &local_entry_table);
-    if (JVMTI_ERROR_ABSENT_INFORMATION == error)
-        return 0;
-    else if (JVMTI_ERROR_NONE != error)
-    {
-        errorJVMTI(jvmti_env, error, "getting local variable table");
-        goto fetchLocals_end;
-    }
-    // NOTE: If the entry count is zero, GetLocalVariableTable() sometimes
-    //       doesn't allocate memory for the table itself. This function is
-    //       robust in that scenario and will simply allocate zero-length
-    //       arrays.
-    assert(0 <= local_entry_count || !"local table may not have negative size");
-    // Create arrays that can hold all the possible local variables for this
-    // method and attach these arrays into the master arrays.
-    if (! objArrNew(jni_env, g_java_lang_string_class, local_entry_count,
-                    &frame_names_arr) ||
-        ! objArrPut(jni_env, names_arr, frame_index, frame_names_arr) ||
-        ! objArrNew(jni_env, g_java_lang_object_class, local_entry_count,
-                    &frame_values_arr) ||
-        ! objArrPut(jni_env, values_arr, frame_index, frame_values_arr))
+enum method_name classifyMethodName(const char * str)
+{
+    if ('e' == str[0] && 'v' == str[1] && 'a' == str[2] && 'l' == str[3])
     {
-        error1("failed to initialize frame arrays");
-        goto fetchLocals_end;
-    }
-    // Iterate over the entries in the local variables table. For every
-    // valid entry that is a non-null reference to an Object, add its name and
-    // value to the arrays.
-    table_index = 0;
-    array_index = 0;
-    for (; table_index < local_entry_count; ++table_index)
-    {
-        jvmtiLocalVariableEntry * entry = &local_entry_table[table_index];
-        if (location < entry->start_location) continue;
-        if (entry->start_location + entry->length < location) continue;
-        if ('L' != entry->signature[0] && '[' != entry->signature[0]) continue;
-        var_name  = (jstring)NULL;
-        var_value = (jobject)NULL;
-        error = (*jvmti_env)->GetLocalObject(jvmti_env, thread,
-                                             SKIP_FRAMES + frame_index,
-                                             entry->slot, &var_value);
-        if (JVMTI_ERROR_TYPE_MISMATCH == error) continue; // Not an Object
-        if (JVMTI_ERROR_NONE != error)
-        {
-            errorJVMTI(jvmti_env, error, "failed to get local variable value");
-            goto fetchLocals_loop_error;
-        }
-        if (!var_value) continue; // Don't store null values
-        var_name = (*jni_env)->NewStringUTF(jni_env, entry->name);
-        if (!var_name)
+        switch (str[4])
         {
-            error1("failed to get local variable name");
-            goto fetchLocals_loop_error;
+            case '\0': return METHOD_NAME_EVAL;
+            case '0':  return METHOD_NAME_EVAL0;
+            case '1':  return METHOD_NAME_EVAL1;
+            case '2':  return METHOD_NAME_EVAL2;
+            case '3':  return METHOD_NAME_EVAL3;
+            case '4':  return METHOD_NAME_EVAL4;
         }
-        if (! objArrPut(jni_env, frame_names_arr, array_index, var_name) ||
-            ! objArrPut(jni_env, frame_values_arr, array_index, var_value))
+    }
+    else if ('c' == str[0] && 'a' == str[1] && 'l' == str[2] && 'l' == str[3])
+    {
+        switch (str[4])
         {
-            error1("failed to store local variable name or value");
-            goto fetchLocals_loop_error;
+            case '\0': return METHOD_NAME_CALL;
+            case '0':  return METHOD_NAME_CALL0;
+            case '1':  return METHOD_NAME_CALL1;
+            case '2':  return METHOD_NAME_CALL2;
+            case '3':  return METHOD_NAME_CALL3;
+            case '4':  return METHOD_NAME_CALL4;
         }
-        (*jni_env)->DeleteLocalRef(jni_env, var_name);
-        (*jni_env)->DeleteLocalRef(jni_env, var_value);
-        ++array_index;
-        continue;
-fetchLocals_loop_error:
-        if (var_value)
-            (*jni_env)->DeleteLocalRef(jni_env, var_value);
-        if (var_name)
-            (*jni_env)->DeleteLocalRef(jni_env, var_name);
-        goto fetchLocals_end;
-    } // for
-    // Set the success flag
-    result = 1;
-fetchLocals_end:
-    // Clean up local variable table
-    if (local_entry_table)
-        deallocateLocalVariableTable(jvmti_env, local_entry_table,
-                                     local_entry_count);
-    else
-        assert(0 == local_entry_count);
-    // Clean up any lingering local references
-    if (frame_names_arr)
-        (*jni_env)->DeleteLocalRef(jni_env, frame_names_arr);
-    if (frame_values_arr)
-        (*jni_env)->DeleteLocalRef(jni_env, frame_values_arr);
-    // Return the success or failure code
-    return result;
+    }
+    return METHOD_NAME_UNKNOWN;
 }
 
 static int getMethodName(jvmtiEnv * jvmti_env, jmethodID method,
@@ -677,149 +738,278 @@ static int getMethodName(jvmtiEnv * jvmti_env, jmethodID method,
         return 0;
     }
     assert(str || !"Method name can't be null");
-    if ('e' == str[0] && 'v' == str[1] && 'a' == str[2] && 'l' == str[3])
+    *mn = classifyMethodName(str);
+    (*jvmti_env)->Deallocate(jvmti_env, (unsigned char *)str);
+    return 1;
+}
+
+// Writes a printable name for the class with the given JVM type signature
+// into buffer, truncating if necessary. Java classes are named the usual
+// dotted way, e.g. "Ljava/lang/String;" becomes "java.lang.String". If
+// is_suneido is true, the class is one generated for a Suneido callable and
+// only its simple name, which is derived from the Suneido name, is used.
+void formatClassName(const char * signature, jboolean is_suneido,
+                     char * buffer, size_t size)
+{
+    const char * i = signature;
+    const char * end;
+    char *       o = buffer;
+    assert(0 < size);
+    if ('L' == *i)
+        ++i;
+    end = i + strlen(i);
+    if (signature < end && ';' == end[-1])
+        --end;
+    if (is_suneido)
     {
-        switch (str[4])
-        {
-            case '\0': *mn = METHOD_NAME_EVAL;  goto getMethodName_success;
-            case '0':  *mn = METHOD_NAME_EVAL0; goto getMethodName_success;
-            case '1':  *mn = METHOD_NAME_EVAL1; goto getMethodName_success;
-            case '2':  *mn = METHOD_NAME_EVAL2; goto getMethodName_success;
-            case '3':  *mn = METHOD_NAME_EVAL3; goto getMethodName_success;
-            case '4':  *mn = METHOD_NAME_EVAL4; goto getMethodName_success;
-        }
+        const char * slash = end;
+        while (i < slash && '/' != slash[-1])
+            --slash;
+        i = slash;
     }
-    else if ('c' == str[0] && 'a' == str[1] && 'l' == str[2] && 'l' == str[3])
+    for (; i < end && o < buffer + size - 1; ++i, ++o)
+        *o = '/' == *i ? '.' : *i;
+    *o = '\0';
+}
+
+unsigned long long hashBytes(unsigned long long hash,
+                             const unsigned char * bytes, size_t length)
+{
+    size_t k;
+    for (k = 0; k < length; ++k)
     {
-        switch (str[4])
-        {
-            case '\0': *mn = METHOD_NAME_CALL;  goto getMethodName_success;
-            case '0':  *mn = METHOD_NAME_CALL0; goto getMethodName_success;
-            case '1':  *mn = METHOD_NAME_CALL1; goto getMethodName_success;
-            case '2':  *mn = METHOD_NAME_CALL2; goto getMethodName_success;
-            case '3':  *mn = METHOD_NAME_CALL3; goto getMethodName_success;
-            case '4':  *mn = METHOD_NAME_CALL4; goto getMethodName_success;
-        }
+        hash ^= bytes[k];
+        hash *= FNV1A_64_PRIME;
     }
-    *mn = METHOD_NAME_UNKNOWN;
-getMethodName_success:
-    (*jvmti_env)->Deallocate(jvmti_env, (unsigned char *)str);
-    return 1;
+    return hash;
 }
 
-#ifdef _MSC_VER
-#pragma warning (push)
-#pragma warning (disable : 4100) // unreferenced formal parameter
-#endif // _MSC_VER
+size_t hashMethodID(jmethodID method)
+{
+    // jmethodIDs are pointers, so the low bits carry little information
+    size_t x = (size_t)method;
+    return (x >> 3) ^ (x >> 11);
+}
 
-static void JNICALL callback_Breakpoint(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
-                                        jthread breakpoint_thread,
-                                        jmethodID breakpoint_method,
-                                        jlocation breakpoint_location)
+// Raw monitor operations only fail if the monitor or the calling thread is
+// invalid, which would be a bug in the agent
+void enterMonitor(jvmtiEnv * jvmti_env, jrawMonitorID monitor)
 {
-    jvmtiError       error;
-    jvmtiFrameInfo   frame_buffer_stack[MAX_STACK_FRAMES];
-    jvmtiFrameInfo * frame_buffer       = NULL;
-    jint             frame_count        = 0;
-    jobject          repo_ref           = (jobject)NULL;
-    jobject          this_ref_cur       = (jobject)NULL;
-    jobject          this_ref_above     = (jobject)NULL;
-    jobjectArray     locals_names_arr   = (jobjectArray)NULL;
-    jobjectArray     locals_values_arr  = (jobjectArray)NULL;
-    jbooleanArray    is_call_arr        = (jbooleanArray)NULL;
-    jboolean *       is_call_arr_       = NULL;
-    jintArray        line_numbers_arr   = (jintArray)NULL;
-    jint *           line_numbers_arr_  = NULL;
-    jint             method_modifiers   = 0;
-    enum method_name method_name_cur    = METHOD_NAME_UNKNOWN;
-    enum method_name method_name_above  = METHOD_NAME_UNKNOWN;
-    // Fetch the current thread's frame count
-    error = (*jvmti_env)->GetFrameCount(jvmti_env, breakpoint_thread,
-                                        &frame_count);
+    jvmtiError error = (*jvmti_env)->RawMonitorEnter(jvmti_env, monitor);
+    assert(JVMTI_ERROR_NONE == error);
+    (void)error;
+}
+
+void exitMonitor(jvmtiEnv * jvmti_env, jrawMonitorID monitor)
+{
+    jvmtiError error = (*jvmti_env)->RawMonitorExit(jvmti_env, monitor);
+    assert(JVMTI_ERROR_NONE == error);
+    (void)error;
+}
+
+unsigned long long hashMethodName(const char * class_signature,
+                                  const char * method_name)
+{
+    // Include the terminating NULs so that "ab" + "c" and "a" + "bc" differ.
+    unsigned long long hash = hashBytes(FNV1A_64_OFFSET_BASIS,
+                                        (const unsigned char *)class_signature,
+                                        strlen(class_signature) + 1);
+    return hashBytes(hash, (const unsigned char *)method_name,
+                     strlen(method_name) + 1);
+}
+
+// Asks JVMTI for the names hashMethodName() hashes, for a method that isn't
+// in the method index
+static int fetchMethodNameHash(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                               jmethodID method, unsigned long long * phash)
+{
+    int        result          = 0;
+    jvmtiError error;
+    jclass     declaring_class = (jclass)NULL;
+    char *     class_signature = NULL;
+    char *     method_name     = NULL;
+    error = (*jvmti_env)->GetMethodDeclaringClass(jvmti_env, method,
+                                                  &declaring_class);
     if (JVMTI_ERROR_NONE != error)
     {
-        errorJVMTI(jvmti_env, error, "from GetFrameCount()");
-        goto callback_Breakpoint_cleanup;
+        errorJVMTI(jvmti_env, error, "failed to get method declaring class");
+        goto fetchMethodNameHash_end;
     }
-    if (SKIP_FRAMES < frame_count)
-        frame_count -= SKIP_FRAMES;
-    else
-        frame_count = 0;
-    if (frame_count <= MAX_STACK_FRAMES)
-        frame_buffer = frame_buffer_stack;
-    else
-    {
-        frame_buffer = (jvmtiFrameInfo *)malloc(
-                           frame_count * sizeof(jvmtiFrameInfo));
-        if (!frame_buffer)
-        {
-            error1("frame_buffer malloc returned NULL");
-            goto callback_Breakpoint_cleanup;
-        }
-    }
-    // Fetch the basic stack trace
-    error = (*jvmti_env)->GetStackTrace(jvmti_env, breakpoint_thread,
-                                        SKIP_FRAMES, frame_count, frame_buffer,
-                                        &frame_count);
-    // Retrieve the "this" reference for the frame where the breakpoint was
-    // found. This is the "this" reference to the repository object of type
-    // REPO_CLASS in whose fields we will store the local variable values.
-    error = (*jvmti_env)->GetLocalInstance(jvmti_env, breakpoint_thread, 0,
-                                           &repo_ref);
+    error = (*jvmti_env)->GetClassSignature(jvmti_env, declaring_class,
+                                            &class_signature, NULL);
     if (JVMTI_ERROR_NONE != error)
     {
-        errorJVMTI(jvmti_env, error,
-                   "attempting to get GetLocalInstance() for repo_ref");
-        goto callback_Breakpoint_cleanup;
+        errorJVMTI(jvmti_env, error, "failed to get class signature");
+        goto fetchMethodNameHash_end;
     }
-    assert(repo_ref || !"Failed to get 'this' for repo_ref");
-    // Create the locals JNI data structures and assign them to the repository
-    // object.
-    if (!objArrNew(jni_env, g_array_of_java_lang_string_class, frame_count, &locals_names_arr) ||
-        !objArrNew(jni_env, g_array_of_java_lang_object_class, frame_count, &locals_values_arr))
+    error = (*jvmti_env)->GetMethodName(jvmti_env, method, &method_name, NULL,
+                                        NULL);
+    if (JVMTI_ERROR_NONE != error)
     {
-        error1("failed to create locals data structures");
-        goto callback_Breakpoint_cleanup;
+        errorJVMTI(jvmti_env, error, "failed to get method name");
+        goto fetchMethodNameHash_end;
     }
-    is_call_arr = (*jni_env)->NewBooleanArray(jni_env, frame_count);
-    if (!is_call_arr)
+    *phash = hashMethodName(class_signature, method_name);
+    // Finished with success
+    result = 1;
+fetchMethodNameHash_end:
+    if (method_name)
+        (*jvmti_env)->Deallocate(jvmti_env, (unsigned char *)method_name);
+    if (class_signature)
+        (*jvmti_env)->Deallocate(jvmti_env, (unsigned char *)class_signature);
+    if (declaring_class)
+        (*jni_env)->DeleteLocalRef(jni_env, declaring_class);
+    return result;
+}
+
+// Mixes the identity of one Suneido stack frame into a running stack hash.
+// Only the declaring class signature, the method name, and the line number
+// are used so the hash is stable across JVM runs, unlike a jmethodID. The
+// method index keeps the hash of the names, so a capture of indexed frames
+// only mixes in the line number.
+static int hashFrame(jvmtiEnv * jvmti_env, JNIEnv * jni_env, jmethodID method,
+                     jint line_number, unsigned long long * phash)
+{
+    unsigned long long name_hash;
+    unsigned char      bytes[12];
+    int                k;
+    if (!lookupIndexedNameHash(method, &name_hash) &&
+        !fetchMethodNameHash(jvmti_env, jni_env, method, &name_hash))
+        return 0; // Error already reported
+    // Spell out the byte order so the hash is the same on any platform
+    for (k = 0; k < 8; ++k)
+        bytes[k] = (unsigned char)(name_hash >> (8 * k));
+    for (k = 0; k < 4; ++k)
+        bytes[8 + k] = (unsigned char)(line_number >> (8 * k));
+    *phash = hashBytes(*phash, bytes, sizeof(bytes));
+    return 1;
+}
+
+static int getClassRelation(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                            jmethodID method, enum class_relation * relation)
+{
+    jvmtiError error;
+    jclass     declaring_class = (jclass)NULL;
+    error = (*jvmti_env)->GetMethodDeclaringClass(jvmti_env, method,
+                                                  &declaring_class);
+    if (JVMTI_ERROR_NONE != error)
     {
-        error1("failed to create iscall? array");
-        goto callback_Breakpoint_cleanup;
+        errorJVMTI(jvmti_env, error, "failed to get method declaring class");
+        return 0;
     }
-    is_call_arr_ = (*jni_env)->GetBooleanArrayElements(jni_env, is_call_arr,
-                                                       NULL);
-    if (!is_call_arr_)
+    if ((*jni_env)->IsAssignableFrom(jni_env, declaring_class,
+                                     g_stack_frame_class))
+        *relation = CLASS_SUNEIDO;
+    else if ((*jni_env)->IsAssignableFrom(jni_env, g_stack_frame_class,
+                                          declaring_class))
+        *relation = CLASS_MAYBE_SUNEIDO; // Method inherited by a callable?
+    else
+        *relation = CLASS_UNRELATED;
+    (*jni_env)->DeleteLocalRef(jni_env, declaring_class);
+    return 1;
+}
+
+// Classifies a method using only the tests of findSuneidoFrames() that don't
+// need "this", for callers that can't afford to read it. *pname is set to
+// METHOD_NAME_UNKNOWN unless the method is a public instance method with a
+// Suneido callable's name declared by a Suneido callable class.
+int classifySuneidoMethod(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                          jmethodID method, enum method_name * pname)
+{
+    jvmtiError          error;
+    jint                modifiers;
+    enum class_relation class_relation;
+    *pname = METHOD_NAME_UNKNOWN;
+    error = (*jvmti_env)->GetMethodModifiers(jvmti_env, method, &modifiers);
+    if (JVMTI_ERROR_NONE != error)
     {
-        error1("failed to get iscall? array elements");
-        goto callback_Breakpoint_cleanup;
+        errorJVMTI(jvmti_env, error, "failed to get method modifiers");
+        return 0;
     }
-    line_numbers_arr = (*jni_env)->NewIntArray(jni_env, frame_count);
-    if (!line_numbers_arr)
+    if (ACC_PUBLIC != (modifiers & (ACC_PUBLIC | ACC_STATIC)))
+        return 1;
+    if (!getMethodName(jvmti_env, method, pname) ||
+        !getClassRelation(jvmti_env, jni_env, method, &class_relation))
+        return 0; // Error already reported
+    if (CLASS_SUNEIDO != class_relation)
+        *pname = METHOD_NAME_UNKNOWN;
+    return 1;
+}
+
+// Gets the "this" reference of the frame at the given depth. On an opaque
+// virtual thread frame, *pthis is set to NULL but that isn't an error.
+static int fetchThis(jvmtiEnv * jvmti_env, jthread thread, jint depth,
+                     jmethodID method, jobject * pthis)
+{
+    jvmtiError error;
+    noteCapturedFrame(jvmti_env, method);
+    error = (*jvmti_env)->GetLocalInstance(jvmti_env, thread, depth, pthis);
+    // Some frames of a virtual thread (e.g. those of the continuation
+    // machinery around a mount/unmount transition) are opaque. None of
+    // them belong to Suneido code, so just skip them.
+    if (JVMTI_ERROR_OPAQUE_FRAME == error)
     {
-        error1("failed to create line numbers array");
-        goto callback_Breakpoint_cleanup;
+        *pthis = (jobject)NULL;
+        return 1;
     }
-    line_numbers_arr_ = (*jni_env)->GetIntArrayElements(jni_env,
-                                                        line_numbers_arr, NULL);
-    if (!line_numbers_arr_)
+    else if (JVMTI_ERROR_NONE != error)
     {
-        error1("failed to get line numbers array elements");
-        goto callback_Breakpoint_cleanup;
+        errorJVMTI(jvmti_env, error,
+                   "attempting to get GetLocalInstance() for this_ref_cur");
+        return 0;
     }
-    // Store the locals JNI data structures into "this".
-    if (!objFieldPut(jni_env, repo_ref, g_locals_name_field, locals_names_arr) ||
-        !objFieldPut(jni_env, repo_ref, g_locals_value_field, locals_values_arr) ||
-        !objFieldPut(jni_env, repo_ref, g_is_call_field, is_call_arr) ||
-        !objFieldPut(jni_env, repo_ref, g_line_numbers_field, line_numbers_arr))
+    assert(*pthis || !"Failed to get 'this' for current stack frame");
+    return 1;
+}
+
+// Stores zero-length locals arrays for a frame whose locals aren't wanted.
+// The empty arrays are created the first time they are needed and shared.
+static int storeEmptyLocals(JNIEnv * jni_env, jobjectArray names_arr,
+                            jobjectArray values_arr, jint frame_index,
+                            jobjectArray * pempty_names_arr,
+                            jobjectArray * pempty_values_arr)
+{
+    if (!*pempty_names_arr &&
+        (!objArrNew(jni_env, g_java_lang_string_class, 0, pempty_names_arr) ||
+         !objArrNew(jni_env, g_java_lang_object_class, 0, pempty_values_arr)))
     {
-        error1("failed to store locals data structures into repo object");
-        goto callback_Breakpoint_cleanup;
+        error1("failed to create empty locals arrays");
+        return 0;
     }
-    // Walk the stack looking for frames where the method's class is an instance
-    // of g_stack_frame_class.
-    jint k = 0;
-    for (; k < frame_count; ++k)
+    return objArrPut(jni_env, names_arr, frame_index, *pempty_names_arr) &&
+           objArrPut(jni_env, values_arr, frame_index, *pempty_values_arr);
+}
+
+// Walks the stack trace of a thread looking for the Java frames that are the
+// top frames of Suneido callable invocations, i.e. frames where the method's
+// class is an instance of g_stack_frame_class. The trace in frame_buffer must
+// start at depth start_depth of the thread's stack. The Suneido frames found
+// are stored, innermost first, into frames, which must have room for
+// frame_count entries. Unless phash is NULL, a signature hash of them is
+// stored into *phash, which costs JVMTI calls for each frame.
+int findSuneidoFrames(jvmtiEnv * jvmti_env, JNIEnv * jni_env, jthread thread,
+                      jint start_depth, const jvmtiFrameInfo * frame_buffer,
+                      jint frame_count, jboolean minimize_deopt,
+                      struct suneido_frame * frames, jint * pcount,
+                      unsigned long long * phash)
+{
+    int                 result             = 0;
+    jvmtiError          error;
+    jobject             this_ref_cur       = (jobject)NULL;
+    jobject             this_ref_above     = (jobject)NULL;
+    jint                this_pending_cur   = -1;
+    jint                this_pending_above = -1;
+    jint                method_modifiers   = 0;
+    jint                line_number        = DEFAULT_LINE_NUMBER;
+    jint                count              = 0;
+    jint                k;
+    jboolean            indexed;
+    enum method_name    indexed_name       = METHOD_NAME_UNKNOWN;
+    enum class_relation class_relation     = CLASS_MAYBE_SUNEIDO;
+    unsigned long long  hash               = FNV1A_64_OFFSET_BASIS;
+    enum method_name    method_name_cur    = METHOD_NAME_UNKNOWN;
+    enum method_name    method_name_above  = METHOD_NAME_UNKNOWN;
+    for (k = 0; k < frame_count; ++k)
     {
         // Keep track of the method name and "this" value in the frame we just
         // looked at (the frame "above" the current frame in the stack trace).
@@ -832,16 +1022,29 @@ static void JNICALL callback_Breakpoint(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
             (*jni_env)->DeleteLocalRef(jni_env, this_ref_above);
         this_ref_above = this_ref_cur;
         this_ref_cur = (jobject)NULL;
+        this_pending_above = this_pending_cur;
+        this_pending_cur = -1;
         // Skip native methods
         if (NATIVE_METHOD_JLOCATION == frame_buffer[k].location)
             continue;
-        // Get the method modifiers
-        error = (*jvmti_env)->GetMethodModifiers(
-            jvmti_env, frame_buffer[k].method, &method_modifiers);
-        if (JVMTI_ERROR_NONE != error)
+        // Get the method modifiers. If the method index has the method, its
+        // class is a Suneido callable class and its name is known too.
+        indexed = lookupIndexedMethod(frame_buffer[k].method,
+                                      &method_modifiers, &indexed_name)
+                ? JNI_TRUE : JNI_FALSE;
+        if (indexed)
+            class_relation = CLASS_SUNEIDO;
+        else
         {
-            errorJVMTI(jvmti_env, error, "failed to get method modifiers");
-            goto callback_Breakpoint_cleanup;
+            if (!minimize_deopt)
+                class_relation = CLASS_MAYBE_SUNEIDO;
+            error = (*jvmti_env)->GetMethodModifiers(
+                jvmti_env, frame_buffer[k].method, &method_modifiers);
+            if (JVMTI_ERROR_NONE != error)
+            {
+                errorJVMTI(jvmti_env, error, "failed to get method modifiers");
+                goto findSuneidoFrames_end;
+            }
         }
         // Skip non-public methods
         if (ACC_PUBLIC != (ACC_PUBLIC & method_modifiers))
@@ -849,31 +1052,59 @@ static void JNICALL callback_Breakpoint(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
         // Skip static methods
         if (ACC_STATIC == (ACC_STATIC & method_modifiers))
             continue;
+        // Reading "this" from a frame can force HotSpot to deoptimize it, so
+        // when asked to minimize deoptimization, first see if the declaring
+        // class of the method already settles what kind of object "this" is.
+        if (minimize_deopt && !indexed)
+        {
+            if (!getClassRelation(jvmti_env, jni_env, frame_buffer[k].method,
+                                  &class_relation))
+                goto findSuneidoFrames_end;
+            if (CLASS_UNRELATED == class_relation)
+                continue;
+        }
         // If the "this" of the stack frame under consideration isn't an
         // instance of g_stack_frame_class, we don't want stack frame data from
         // it.
-        error = (*jvmti_env)->GetLocalInstance(jvmti_env, breakpoint_thread,
-                                               k + SKIP_FRAMES,
-                                               &this_ref_cur);
-        if (JVMTI_ERROR_NONE != error)
+        if (CLASS_MAYBE_SUNEIDO == class_relation)
         {
-            errorJVMTI(jvmti_env, error,
-                       "attempting to get GetLocalInstance() for this_ref_cur");
-            goto callback_Breakpoint_cleanup;
+            if (!fetchThis(jvmti_env, thread, start_depth + k,
+                           frame_buffer[k].method, &this_ref_cur))
+                goto findSuneidoFrames_end;
+            if (!this_ref_cur ||
+                !(*jni_env)->IsInstanceOf(jni_env, this_ref_cur,
+                                          g_stack_frame_class))
+                continue;
         }
-        assert(this_ref_cur || !"Failed to get 'this' for current stack frame");
-        if (!(*jni_env)->IsInstanceOf(jni_env, this_ref_cur,
-                                      g_stack_frame_class))
-            continue;
         // Get the method name
-        if (!getMethodName(jvmti_env, frame_buffer[k].method, &method_name_cur))
-            goto callback_Breakpoint_cleanup;
+        if (indexed)
+            method_name_cur = indexed_name;
+        else if (!getMethodName(jvmti_env, frame_buffer[k].method,
+                                &method_name_cur))
+            goto findSuneidoFrames_end;
+        // If we haven't read "this" yet, only read it if there is a "this" in
+        // the frame above for the tests below to compare it to. The "this" of
+        // the frame above may itself not have been read yet.
+        if (!this_ref_cur &&
+            (METHOD_NAME_UNKNOWN == method_name_cur ||
+             method_name_above != method_name_cur) &&
+            (this_ref_above || 0 <= this_pending_above))
+        {
+            if (!this_ref_above &&
+                !fetchThis(jvmti_env, thread, start_depth + this_pending_above,
+                           frame_buffer[this_pending_above].method,
+                           &this_ref_above))
+                goto findSuneidoFrames_end;
+            if (!fetchThis(jvmti_env, thread, start_depth + k,
+                           frame_buffer[k].method, &this_ref_cur))
+                goto findSuneidoFrames_end;
+        }
         if (METHOD_NAME_UNKNOWN == method_name_cur)
         {
             // Don't keep "this" if it's the first time we encounter it in a
             // contiguous sequence that we encountered it and we're going to
             // skip it anyway.
-            if (!isSame(jni_env, this_ref_above, this_ref_cur))
+            if (this_ref_cur && !isSame(jni_env, this_ref_above, this_ref_cur))
             {
                 (*jni_env)->DeleteLocalRef(jni_env, this_ref_cur);
                 this_ref_cur = (jobject)NULL;
@@ -885,21 +1116,573 @@ static void JNICALL callback_Breakpoint(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
         // "this" instance of the immediately preceding Java stack frame, both
         // frames may logically be part of the same Suneido callable invocation
         // and we only want the top frame, which we have already seen...
-        if (isSame(jni_env, this_ref_above, this_ref_cur) &&
+        if (this_ref_cur && isSame(jni_env, this_ref_above, this_ref_cur) &&
             method_name_above != method_name_cur)
             continue;
-        // Tag methods that are calls.
-        if (METHOD_NAME_CALL & method_name_cur)
-            is_call_arr_[k] = JNI_TRUE;
-        // Fetch the locals for this frame
-        if (!fetchLocals(jvmti_env, jni_env, breakpoint_thread,
-                         frame_buffer[k].method, frame_buffer[k].location,
-                         locals_names_arr, locals_values_arr, k))
-            goto callback_Breakpoint_cleanup; // Error already reported
+        // If "this" still hasn't been read, the frame below may need it.
+        if (!this_ref_cur)
+            this_pending_cur = k;
+        // Get the line number and mix this frame into the stack signature
         if (!fetchLineNumbers(jvmti_env, frame_buffer[k].method,
-                              frame_buffer[k].location, line_numbers_arr_, k))
-            goto callback_Breakpoint_cleanup; // Error already reported
+                              frame_buffer[k].location, &line_number) ||
+            (phash && !hashFrame(jvmti_env, jni_env, frame_buffer[k].method,
+                                 line_number, &hash)))
+            goto findSuneidoFrames_end; // Error already reported
+        // Remember the frame
+        frames[count].method       = frame_buffer[k].method;
+        frames[count].location     = frame_buffer[k].location;
+        frames[count].frame_index  = k;
+        frames[count].line_number  = line_number;
+        frames[count].repeat_count = 0;
+        frames[count].is_call      =
+            (METHOD_NAME_CALL & method_name_cur) ? JNI_TRUE : JNI_FALSE;
+        ++count;
     } // for k in [0 .. frame_count)
+    *pcount = count;
+    if (phash)
+        *phash = hash;
+    // Finished with success
+    result = 1;
+findSuneidoFrames_end:
+    if (this_ref_above)
+        (*jni_env)->DeleteLocalRef(jni_env, this_ref_above);
+    if (this_ref_cur)
+        (*jni_env)->DeleteLocalRef(jni_env, this_ref_cur);
+    return result;
+}
+
+#ifdef _MSC_VER
+#pragma warning (push)
+#pragma warning (disable : 4100) // unreferenced formal parameter
+#endif // _MSC_VER
+
+// Returns a local reference to a Java string holding a local variable name.
+// The strings are created once and shared by all captures, up to a limit on
+// the number of distinct names. Returns NULL on failure.
+static jstring internName(JNIEnv * jni_env, const char * name)
+{
+    size_t  length = strlen(name);
+    size_t  mask   = NAME_TABLE_CAPACITY - 1;
+    size_t  k;
+    size_t  slot;
+    jstring global_ref = (jstring)NULL;
+    jstring result;
+    char *  chars;
+    k = (size_t)hashBytes(FNV1A_64_OFFSET_BASIS, (const unsigned char *)name,
+                          length) & mask;
+    enterMonitor(g_jvmti, g_names_lock);
+    for (slot = k; g_names[slot].chars && strcmp(g_names[slot].chars, name);
+         slot = (slot + 1) & mask)
+        ;
+    global_ref = g_names[slot].string;
+    exitMonitor(g_jvmti, g_names_lock);
+    // Entries are never removed, so the global reference stays valid
+    if (global_ref)
+        return (jstring)(*jni_env)->NewLocalRef(jni_env, global_ref);
+    result = (*jni_env)->NewStringUTF(jni_env, name);
+    if (!result || NAME_TABLE_CAPACITY * 3 <= g_name_count * 4)
+        return result; // Keep the load factor at or below 3/4
+    chars = (char *)malloc(length + 1);
+    global_ref = (jstring)(*jni_env)->NewGlobalRef(jni_env, result);
+    if (chars && global_ref)
+    {
+        memcpy(chars, name, length + 1);
+        enterMonitor(g_jvmti, g_names_lock);
+        for (slot = k; g_names[slot].chars && strcmp(g_names[slot].chars, name);
+             slot = (slot + 1) & mask)
+            ;
+        if (!g_names[slot].chars)
+        {
+            g_names[slot].chars = chars;
+            g_names[slot].string = global_ref;
+            ++g_name_count;
+            chars = NULL;
+            global_ref = (jstring)NULL;
+        }
+        exitMonitor(g_jvmti, g_names_lock);
+    }
+    // If another thread interned the name first, or we ran out of memory
+    free(chars);
+    if (global_ref)
+        (*jni_env)->DeleteGlobalRef(jni_env, global_ref);
+    return result;
+}
+
+// Gets an array stored into a StackInfo field by an earlier capture if it is
+// long enough to be reused for length entries. Otherwise returns NULL.
+static jarray reusableArray(JNIEnv * jni_env, jobject repo_ref,
+                            jfieldID field_id, jint length)
+{
+    jarray arr = (jarray)(*jni_env)->GetObjectField(jni_env, repo_ref,
+                                                    field_id);
+    if (arr && (*jni_env)->GetArrayLength(jni_env, arr) < length)
+    {
+        (*jni_env)->DeleteLocalRef(jni_env, arr);
+        arr = (jarray)NULL;
+    }
+    return arr;
+}
+
+// Writes the Java language name of the type with the given JVM type signature
+// into buffer, e.g. "[[I" becomes "int[][]". See formatClassName().
+static void formatTypeName(const char * signature, char * buffer, size_t size)
+{
+    const char * element = signature;
+    const char * primitive;
+    size_t       dims;
+    size_t       length;
+    while ('[' == *element)
+        ++element;
+    dims = (size_t)(element - signature);
+    primitive = *element ? strchr(PRIMITIVE_SIGNATURES, *element) : NULL;
+    if (primitive)
+    {
+        strncpy(buffer, PRIMITIVE_NAMES[primitive - PRIMITIVE_SIGNATURES],
+                size - 1);
+        buffer[size - 1] = '\0';
+    }
+    else
+        formatClassName(element, JNI_FALSE, buffer, size);
+    length = strlen(buffer);
+    for (; 0 < dims && length + 2 < size; --dims, length += 2)
+        strcpy(buffer + length, "[]");
+}
+
+// Makes a new local reference to str, or to a copy of its first
+// SHALLOW_STRING_LIMIT characters followed by "..." if it is longer.
+static int truncateString(JNIEnv * jni_env, jstring str, jobject * psummary)
+{
+    jchar chars[SHALLOW_STRING_LIMIT + 3];
+    jsize length = (*jni_env)->GetStringLength(jni_env, str);
+    if (length <= SHALLOW_STRING_LIMIT)
+        *psummary = (*jni_env)->NewLocalRef(jni_env, str);
+    else
+    {
+        (*jni_env)->GetStringRegion(jni_env, str, 0, SHALLOW_STRING_LIMIT,
+                                    chars);
+        length = SHALLOW_STRING_LIMIT;
+        // Don't split a surrogate pair
+        if (0xd800 <= chars[length - 1] && chars[length - 1] <= 0xdbff)
+            --length;
+        chars[length++] = '.';
+        chars[length++] = '.';
+        chars[length++] = '.';
+        *psummary = (*jni_env)->NewString(jni_env, chars, length);
+    }
+    if (!*psummary)
+    {
+        error1("failed to make string summary");
+        if ((*jni_env)->ExceptionCheck(jni_env))
+            exceptionDescribe(jni_env);
+        return 0;
+    }
+    return 1;
+}
+
+// Makes the stand-in for a local variable value that a shallow capture stores
+// so that the StackInfo doesn't keep alive everything the value refers to.
+// Strings and boxed numbers become their string forms, truncated. Anything
+// else becomes a weak reference if weak is true, and otherwise a string giving
+// its type and, for arrays, its length. Nothing else's size is asked for, since
+// that would run Java code, e.g. Collection.size(), inside the breakpoint
+// callback. *psummary is set to a new local reference, or to NULL if value is
+// NULL.
+static int summarizeValue(JNIEnv * jni_env, jobject value, jboolean weak,
+                          jobject * psummary)
+{
+    int        result    = 0;
+    jvmtiError error;
+    jclass     klass     = (jclass)NULL;
+    char *     signature = NULL;
+    jstring    str       = (jstring)NULL;
+    jint       size;
+    char       buffer[SHALLOW_TYPE_NAME_MAX + 32];
+    size_t     k;
+    *psummary = (jobject)NULL;
+    if (!value)
+        return 1;
+    if ((*jni_env)->IsInstanceOf(jni_env, value, g_java_lang_string_class))
+        return truncateString(jni_env, (jstring)value, psummary);
+    klass = (*jni_env)->GetObjectClass(jni_env, value);
+    error = (*g_jvmti)->GetClassSignature(g_jvmti, klass, &signature, NULL);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(g_jvmti, error, "failed to get class signature");
+        goto summarizeValue_end;
+    }
+    for (k = 0; k < sizeof(BOXED_CLASS_SIGNATURES) /
+                    sizeof(BOXED_CLASS_SIGNATURES[0]); ++k)
+    {
+        if (!strcmp(signature, BOXED_CLASS_SIGNATURES[k]))
+        {
+            str = (jstring)(*jni_env)->CallObjectMethod(
+                jni_env, value, g_object_to_string_method);
+            if ((*jni_env)->ExceptionCheck(jni_env))
+            {
+                error1("exception while converting value to string");
+                exceptionDescribe(jni_env);
+                goto summarizeValue_end;
+            }
+            result = !str || truncateString(jni_env, str, psummary);
+            goto summarizeValue_end;
+        }
+    }
+    if (weak)
+    {
+        *psummary = (*jni_env)->NewObject(jni_env, g_weak_reference_class,
+                                          g_weak_reference_init_method,
+                                          value);
+        if (!*psummary)
+        {
+            error1("failed to make weak reference");
+            if ((*jni_env)->ExceptionCheck(jni_env))
+                exceptionDescribe(jni_env);
+            goto summarizeValue_end;
+        }
+        result = 1;
+        goto summarizeValue_end;
+    }
+    formatTypeName(signature, buffer, SHALLOW_TYPE_NAME_MAX);
+    if ('[' == *signature)
+    {
+        size = (*jni_env)->GetArrayLength(jni_env, (jarray)value);
+        sprintf(buffer + strlen(buffer), " (size %d)", (int)size);
+    }
+    *psummary = (*jni_env)->NewStringUTF(jni_env, buffer);
+    if (!*psummary)
+    {
+        error1("failed to make type summary");
+        if ((*jni_env)->ExceptionCheck(jni_env))
+            exceptionDescribe(jni_env);
+        goto summarizeValue_end;
+    }
+    result = 1;
+summarizeValue_end:
+    if (str)
+        (*jni_env)->DeleteLocalRef(jni_env, str);
+    if (signature)
+        (*g_jvmti)->Deallocate(g_jvmti, (unsigned char *)signature);
+    if (klass)
+        (*jni_env)->DeleteLocalRef(jni_env, klass);
+    return result;
+}
+
+// Stores the locals of one captured frame into the StackInfo arrays. If reuse
+// is true, the frame's existing arrays are reused if they are big enough, in
+// which case any entries past the captured locals are set to null. The values
+// stored depend on mode.
+static int storeLocals(JNIEnv * jni_env, const struct captured_locals * locals,
+                       jobjectArray names_arr, jobjectArray values_arr,
+                       jint frame_index, jboolean reuse, enum value_mode mode)
+{
+    int          result = 0;
+    jobjectArray frame_names_arr = (jobjectArray)NULL;
+    jobjectArray frame_values_arr = (jobjectArray)NULL;
+    jstring      var_name;
+    jobject      value;
+    jint         length = locals->count;
+    jint         k;
+    // Reuse the arrays of the previous capture into this StackInfo if they
+    // are big enough (they may be the shared empty arrays, which are not).
+    if (reuse)
+    {
+        frame_names_arr = (jobjectArray)(*jni_env)->GetObjectArrayElement(
+            jni_env, names_arr, frame_index);
+        frame_values_arr = (jobjectArray)(*jni_env)->GetObjectArrayElement(
+            jni_env, values_arr, frame_index);
+        if (frame_names_arr && frame_values_arr &&
+            locals->count <=
+                (*jni_env)->GetArrayLength(jni_env, frame_names_arr) &&
+            locals->count <=
+                (*jni_env)->GetArrayLength(jni_env, frame_values_arr))
+        {
+            length = (*jni_env)->GetArrayLength(jni_env, frame_names_arr);
+            if ((*jni_env)->GetArrayLength(jni_env, frame_values_arr) < length)
+                length = (*jni_env)->GetArrayLength(jni_env, frame_values_arr);
+        }
+        else
+        {
+            if (frame_names_arr)
+                (*jni_env)->DeleteLocalRef(jni_env, frame_names_arr);
+            if (frame_values_arr)
+                (*jni_env)->DeleteLocalRef(jni_env, frame_values_arr);
+            frame_names_arr = (jobjectArray)NULL;
+            frame_values_arr = (jobjectArray)NULL;
+        }
+    }
+    // Create arrays that can hold the local variables for this frame and
+    // attach these arrays into the master arrays.
+    if (!frame_names_arr &&
+        (! objArrNew(jni_env, g_java_lang_string_class, locals->count,
+                     &frame_names_arr) ||
+         ! objArrPut(jni_env, names_arr, frame_index, frame_names_arr) ||
+         ! objArrNew(jni_env, g_java_lang_object_class, locals->count,
+                     &frame_values_arr) ||
+         ! objArrPut(jni_env, values_arr, frame_index, frame_values_arr)))
+    {
+        error1("failed to initialize frame arrays");
+        goto storeLocals_end;
+    }
+    for (k = 0; k < locals->count; ++k)
+    {
+        var_name = internName(jni_env, locals->names[k]);
+        if (!var_name)
+        {
+            error1("failed to get local variable name");
+            goto storeLocals_end;
+        }
+        value = locals->values[k];
+        if (VALUES_REFERENCES != mode &&
+            !summarizeValue(jni_env, locals->values[k],
+                            VALUES_SHALLOW_WEAK == mode, &value))
+        {
+            (*jni_env)->DeleteLocalRef(jni_env, var_name);
+            goto storeLocals_end; // Error already reported
+        }
+        if (! objArrPut(jni_env, frame_names_arr, k, var_name) ||
+            ! objArrPut(jni_env, frame_values_arr, k, value))
+        {
+            error1("failed to store local variable name or value");
+            (*jni_env)->DeleteLocalRef(jni_env, var_name);
+            if (value && value != locals->values[k])
+                (*jni_env)->DeleteLocalRef(jni_env, value);
+            goto storeLocals_end;
+        }
+        (*jni_env)->DeleteLocalRef(jni_env, var_name);
+        if (value && value != locals->values[k])
+            (*jni_env)->DeleteLocalRef(jni_env, value);
+    }
+    // Don't let reused arrays pin the values of an earlier capture
+    for (; k < length; ++k)
+        if (! objArrPut(jni_env, frame_names_arr, k, (jobject)NULL) ||
+            ! objArrPut(jni_env, frame_values_arr, k, (jobject)NULL))
+            goto storeLocals_end; // Error already reported
+    // Set the success flag
+    result = 1;
+storeLocals_end:
+    // Clean up any lingering local references
+    if (frame_names_arr)
+        (*jni_env)->DeleteLocalRef(jni_env, frame_names_arr);
+    if (frame_values_arr)
+        (*jni_env)->DeleteLocalRef(jni_env, frame_values_arr);
+    // Return the success or failure code
+    return result;
+}
+
+// Stores a capture into the fields of the StackInfo object (the Java objects
+// sink). The arrays are indexed by Java frame. If reuse is true, the arrays
+// left in the StackInfo by its previous capture are reused where they are big
+// enough. Java frames that aren't Suneido frames have null locals, and zero
+// line numbers, repeat counts, and frame ids. The repeat counts array is null
+// unless compress is true.
+static int storeCapture(JNIEnv * jni_env, const struct stack_capture * capture,
+                        jobject repo_ref, jboolean compress, jboolean reuse,
+                        enum value_mode mode)
+{
+    int              result             = 0;
+    jint             frame_count        = capture->java_frame_count;
+    jint             capacity           = frame_count;
+    jint             clear_count        = 0;
+    jint             names_length;
+    jint             is_call_length;
+    jint             line_numbers_length;
+    jobjectArray     locals_names_arr   = (jobjectArray)NULL;
+    jobjectArray     locals_values_arr  = (jobjectArray)NULL;
+    jbooleanArray    is_call_arr        = (jbooleanArray)NULL;
+    jboolean *       is_call_arr_       = NULL;
+    jintArray        line_numbers_arr   = (jintArray)NULL;
+    jint *           line_numbers_arr_  = NULL;
+    jintArray        repeat_counts_arr  = (jintArray)NULL;
+    jint *           repeat_counts_arr_ = NULL;
+    jintArray        frame_ids_arr      = (jintArray)NULL;
+    jint *           frame_ids_arr_     = NULL;
+    jobjectArray     empty_names_arr    = (jobjectArray)NULL;
+    jobjectArray     empty_values_arr   = (jobjectArray)NULL;
+    jint             j, k;
+    assert(capture->locals || 0 == capture->count);
+    // When reusing arrays, everything the previous capture may have written
+    // has to be cleared. Arrays that need to grow get some room to spare.
+    if (reuse)
+    {
+        clear_count = (*jni_env)->GetIntField(jni_env, repo_ref,
+                                              g_frame_count_field);
+        if (clear_count < frame_count)
+            clear_count = frame_count;
+        capacity = frame_count + frame_count / 2;
+        locals_names_arr = (jobjectArray)reusableArray(
+            jni_env, repo_ref, g_locals_name_field, frame_count);
+        locals_values_arr = (jobjectArray)reusableArray(
+            jni_env, repo_ref, g_locals_value_field, frame_count);
+        is_call_arr = (jbooleanArray)reusableArray(
+            jni_env, repo_ref, g_is_call_field, frame_count);
+        line_numbers_arr = (jintArray)reusableArray(
+            jni_env, repo_ref, g_line_numbers_field, frame_count);
+        if (compress)
+            repeat_counts_arr = (jintArray)reusableArray(
+                jni_env, repo_ref, g_repeat_counts_field, frame_count);
+        if (g_frame_ids_field)
+            frame_ids_arr = (jintArray)reusableArray(
+                jni_env, repo_ref, g_frame_ids_field, frame_count);
+    }
+    // Create the locals JNI data structures and assign them to the repository
+    // object.
+    if ((!locals_names_arr &&
+         !objArrNew(jni_env, g_array_of_java_lang_string_class, capacity,
+                    &locals_names_arr)) ||
+        (!locals_values_arr &&
+         !objArrNew(jni_env, g_array_of_java_lang_object_class, capacity,
+                    &locals_values_arr)))
+    {
+        error1("failed to create locals data structures");
+        goto storeCapture_cleanup;
+    }
+    if (!is_call_arr)
+        is_call_arr = (*jni_env)->NewBooleanArray(jni_env, capacity);
+    if (!is_call_arr)
+    {
+        error1("failed to create iscall? array");
+        goto storeCapture_cleanup;
+    }
+    is_call_arr_ = (*jni_env)->GetBooleanArrayElements(jni_env, is_call_arr,
+                                                       NULL);
+    if (!is_call_arr_)
+    {
+        error1("failed to get iscall? array elements");
+        goto storeCapture_cleanup;
+    }
+    if (!line_numbers_arr)
+        line_numbers_arr = (*jni_env)->NewIntArray(jni_env, capacity);
+    if (!line_numbers_arr)
+    {
+        error1("failed to create line numbers array");
+        goto storeCapture_cleanup;
+    }
+    line_numbers_arr_ = (*jni_env)->GetIntArrayElements(jni_env,
+                                                        line_numbers_arr, NULL);
+    if (!line_numbers_arr_)
+    {
+        error1("failed to get line numbers array elements");
+        goto storeCapture_cleanup;
+    }
+    // Store the locals JNI data structures into "this".
+    if (!objFieldPut(jni_env, repo_ref, g_locals_name_field, locals_names_arr) ||
+        !objFieldPut(jni_env, repo_ref, g_locals_value_field, locals_values_arr) ||
+        !objFieldPut(jni_env, repo_ref, g_is_call_field, is_call_arr) ||
+        !objFieldPut(jni_env, repo_ref, g_line_numbers_field, line_numbers_arr))
+    {
+        error1("failed to store locals data structures into repo object");
+        goto storeCapture_cleanup;
+    }
+    if (compress)
+    {
+        if (!repeat_counts_arr)
+            repeat_counts_arr = (*jni_env)->NewIntArray(jni_env, capacity);
+        if (!repeat_counts_arr ||
+            !objFieldPut(jni_env, repo_ref, g_repeat_counts_field,
+                         repeat_counts_arr))
+        {
+            error1("failed to create repeat counts array");
+            goto storeCapture_cleanup;
+        }
+        repeat_counts_arr_ = (*jni_env)->GetIntArrayElements(
+            jni_env, repeat_counts_arr, NULL);
+        if (!repeat_counts_arr_)
+        {
+            error1("failed to get repeat counts array elements");
+            goto storeCapture_cleanup;
+        }
+    }
+    else if (g_repeat_counts_field &&
+             !objFieldPut(jni_env, repo_ref, g_repeat_counts_field, NULL))
+    {
+        // Counts left by an earlier compressed capture don't apply any more
+        error1("failed to clear repeat counts array");
+        goto storeCapture_cleanup;
+    }
+    if (g_frame_ids_field)
+    {
+        if (!frame_ids_arr)
+            frame_ids_arr = (*jni_env)->NewIntArray(jni_env, capacity);
+        if (!frame_ids_arr ||
+            !objFieldPut(jni_env, repo_ref, g_frame_ids_field, frame_ids_arr))
+        {
+            error1("failed to create frame ids array");
+            goto storeCapture_cleanup;
+        }
+        frame_ids_arr_ = (*jni_env)->GetIntArrayElements(jni_env,
+                                                         frame_ids_arr, NULL);
+        if (!frame_ids_arr_)
+        {
+            error1("failed to get frame ids array elements");
+            goto storeCapture_cleanup;
+        }
+    }
+    // Clear what the previous capture left behind. Arrays that are too big
+    // for it have been replaced, and new arrays are already clear.
+    if (reuse)
+    {
+        names_length = (*jni_env)->GetArrayLength(jni_env, locals_names_arr);
+        is_call_length = (*jni_env)->GetArrayLength(jni_env, is_call_arr);
+        line_numbers_length = (*jni_env)->GetArrayLength(jni_env,
+                                                         line_numbers_arr);
+        j = 0;
+        for (k = 0; k < clear_count; ++k)
+        {
+            // Suneido frames are about to be overwritten
+            while (j < capture->count && capture->frames[j].frame_index < k)
+                ++j;
+            if (j < capture->count && capture->frames[j].frame_index == k &&
+                REPEAT_ELIDED != capture->frames[j].repeat_count)
+                continue;
+            if (k < names_length &&
+                (!objArrPut(jni_env, locals_names_arr, k, (jobject)NULL) ||
+                 !objArrPut(jni_env, locals_values_arr, k, (jobject)NULL)))
+                goto storeCapture_cleanup; // Error already reported
+            if (k < is_call_length)
+                is_call_arr_[k] = JNI_FALSE;
+            if (k < line_numbers_length)
+                line_numbers_arr_[k] = 0;
+        }
+        if (repeat_counts_arr_)
+            memset(repeat_counts_arr_, 0,
+                   (*jni_env)->GetArrayLength(jni_env, repeat_counts_arr) *
+                   sizeof(jint));
+        if (frame_ids_arr_)
+            memset(frame_ids_arr_, 0,
+                   (*jni_env)->GetArrayLength(jni_env, frame_ids_arr) *
+                   sizeof(jint));
+    }
+    // Store the Suneido frames into the Java data structures
+    for (k = 0; k < capture->count; ++k)
+    {
+        const struct suneido_frame * f = &capture->frames[k];
+        if (REPEAT_ELIDED == f->repeat_count)
+            continue;
+        line_numbers_arr_[f->frame_index] = f->line_number;
+        is_call_arr_[f->frame_index] = f->is_call;
+        if (0 < f->repeat_count)
+        {
+            assert(repeat_counts_arr_);
+            repeat_counts_arr_[f->frame_index] = f->repeat_count;
+        }
+        // Ids let Java name the frame without walking the stack itself. If
+        // the frame can't be named, its id is 0 and the rest is still stored.
+        if (frame_ids_arr_)
+            frame_ids_arr_[f->frame_index] = frameId(g_jvmti, jni_env,
+                                                     f->method);
+        // Frames whose locals weren't wanted get empty locals arrays
+        if (!capture->locals[k].fetched)
+        {
+            if (!storeEmptyLocals(jni_env, locals_names_arr, locals_values_arr,
+                                  f->frame_index, &empty_names_arr,
+                                  &empty_values_arr))
+                goto storeCapture_cleanup; // Error already reported
+            continue;
+        }
+        if (!storeLocals(jni_env, &capture->locals[k], locals_names_arr,
+                         locals_values_arr, f->frame_index, reuse, mode))
+            goto storeCapture_cleanup; // Error already reported
+    } // for k in [0 .. capture->count)
     // Write back the iscall? array
     assert(is_call_arr_);
     (*jni_env)->ReleaseBooleanArrayElements(jni_env, is_call_arr, is_call_arr_,
@@ -910,18 +1693,35 @@ static void JNICALL callback_Breakpoint(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
     (*jni_env)->ReleaseIntArrayElements(jni_env, line_numbers_arr,
                                         line_numbers_arr_, 0);
     line_numbers_arr_ = NULL;
-    // Mark the stack info repository as fully initialized
-    (*jni_env)->SetBooleanField(jni_env, repo_ref, g_is_initialized_field,
-                                JNI_TRUE);
-    if ((*jni_env)->ExceptionCheck(jni_env))
+    // Write back the repeat counts array
+    if (repeat_counts_arr_)
     {
-        error1("exception while attempting to mark repo as initialized");
-        exceptionDescribe(jni_env);
+        (*jni_env)->ReleaseIntArrayElements(jni_env, repeat_counts_arr,
+                                            repeat_counts_arr_, 0);
+        repeat_counts_arr_ = NULL;
     }
-callback_Breakpoint_cleanup:
-    // If frame buffer allocated on the heap, clean it up
-    if (frame_buffer != frame_buffer_stack)
-        free(frame_buffer);
+    // Write back the frame ids array
+    if (frame_ids_arr_)
+    {
+        (*jni_env)->ReleaseIntArrayElements(jni_env, frame_ids_arr,
+                                            frame_ids_arr_, 0);
+        frame_ids_arr_ = NULL;
+    }
+    // Tell Java how much of the arrays is in use
+    if (g_frame_count_field)
+    {
+        (*jni_env)->SetIntField(jni_env, repo_ref, g_frame_count_field,
+                                frame_count);
+        if ((*jni_env)->ExceptionCheck(jni_env))
+        {
+            error1("exception while attempting to store frame count");
+            exceptionDescribe(jni_env);
+            goto storeCapture_cleanup;
+        }
+    }
+    // Set the success flag
+    result = 1;
+storeCapture_cleanup:
     // If the iscall? array is still consuming heap space, release it
     if (is_call_arr_)
         (*jni_env)->ReleaseBooleanArrayElements(jni_env, is_call_arr,
@@ -930,6 +1730,158 @@ callback_Breakpoint_cleanup:
     if (line_numbers_arr_)
         (*jni_env)->ReleaseIntArrayElements(jni_env, line_numbers_arr,
                                             line_numbers_arr_, JNI_ABORT);
+    // If the repeat counts array is still consuming heap space, release it
+    if (repeat_counts_arr_)
+        (*jni_env)->ReleaseIntArrayElements(jni_env, repeat_counts_arr,
+                                            repeat_counts_arr_, JNI_ABORT);
+    // If the frame ids array is still consuming heap space, release it
+    if (frame_ids_arr_)
+        (*jni_env)->ReleaseIntArrayElements(jni_env, frame_ids_arr,
+                                            frame_ids_arr_, JNI_ABORT);
+    return result;
+}
+
+// Creates a StackInfo holding a capture made somewhere other than in
+// StackInfo.fetchInfo() (see breakpoints.c). The object is allocated without
+// running a constructor, so the breakpoint in fetchInfo() can't be hit. Returns
+// NULL on failure.
+jobject newStackInfo(JNIEnv * jni_env, const struct stack_capture * capture)
+{
+    jobject info = (*jni_env)->AllocObject(jni_env, g_repo_class);
+    if (!info)
+    {
+        error1("failed to allocate StackInfo");
+        exceptionDescribe(jni_env);
+        return (jobject)NULL;
+    }
+    if (g_stack_hash_field)
+        (*jni_env)->SetLongField(jni_env, info, g_stack_hash_field,
+                                 (jlong)capture->hash);
+    if (!storeCapture(jni_env, capture, info, JNI_FALSE, JNI_FALSE,
+                      VALUES_REFERENCES))
+        goto newStackInfo_error; // Error already reported
+    (*jni_env)->SetBooleanField(jni_env, info, g_is_initialized_field,
+                                JNI_TRUE);
+    if ((*jni_env)->ExceptionCheck(jni_env))
+    {
+        error1("exception while attempting to mark StackInfo as initialized");
+        exceptionDescribe(jni_env);
+        goto newStackInfo_error;
+    }
+    return info;
+newStackInfo_error:
+    (*jni_env)->DeleteLocalRef(jni_env, info);
+    return (jobject)NULL;
+}
+
+static void JNICALL callback_Breakpoint(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                                        jthread breakpoint_thread,
+                                        jmethodID breakpoint_method,
+                                        jlocation breakpoint_location)
+{
+    jvmtiError            error;
+    struct capture_params params;
+    struct stack_capture  capture;
+    jobject               repo_ref      = (jobject)NULL;
+    jbyteArray            stack_bytes   = (jbyteArray)NULL;
+    jint                  capture_flags = 0;
+    jboolean              hash_only     = JNI_FALSE;
+    jboolean              reuse         = JNI_FALSE;
+    enum value_mode       mode          = VALUES_REFERENCES;
+    // Any other breakpoint was set in Suneido code from Java
+    if (breakpoint_method != g_fetch_info_method)
+    {
+        handleUserBreakpoint(jvmti_env, jni_env, breakpoint_thread,
+                             breakpoint_method, breakpoint_location);
+        return;
+    }
+    // Retrieve the "this" reference for the frame where the breakpoint was
+    // found. This is the "this" reference to the repository object of type
+    // REPO_CLASS in whose fields we will store the local variable values.
+    error = (*jvmti_env)->GetLocalInstance(jvmti_env, breakpoint_thread, 0,
+                                           &repo_ref);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(jvmti_env, error,
+                   "attempting to get GetLocalInstance() for repo_ref");
+        return;
+    }
+    assert(repo_ref || !"Failed to get 'this' for repo_ref");
+    // Find out what the Java side wants captured. If it only wants the stack
+    // signature hash, the locals aren't needed.
+    memset(&params, 0, sizeof(params));
+    params.start_depth = SKIP_FRAMES;
+    if (g_capture_flags_field)
+    {
+        capture_flags = (*jni_env)->GetIntField(jni_env, repo_ref,
+                                                g_capture_flags_field);
+        if (CAPTURE_HASH_ONLY & capture_flags)
+            hash_only = JNI_TRUE;
+        // Compressed output is meaningless unless it can be told to Java
+        if ((CAPTURE_COMPRESS_RECURSION & capture_flags) &&
+            g_repeat_counts_field)
+            params.compress = JNI_TRUE;
+        if (CAPTURE_MINIMIZE_DEOPT & capture_flags)
+            params.minimize_deopt = JNI_TRUE;
+        // Reused arrays may be longer than the stack, so Java has to be told
+        // how much of them to look at
+        if ((CAPTURE_REUSE_ARRAYS & capture_flags) && g_frame_count_field)
+            reuse = JNI_TRUE;
+        // Summaries keep a StackInfo parked in an error queue from pinning
+        // big object graphs that the request it came from is done with
+        if (CAPTURE_SHALLOW & capture_flags)
+            mode = CAPTURE_WEAK_VALUES & capture_flags
+                 ? VALUES_SHALLOW_WEAK : VALUES_SHALLOW;
+    }
+    if (g_locals_frame_limit_field)
+        params.locals_frame_limit = (*jni_env)->GetIntField(
+            jni_env, repo_ref, g_locals_frame_limit_field);
+    params.locals = !hash_only;
+    // Hashing names each frame through JVMTI, so only do it if some output
+    // has the hash in it
+    params.hash = g_stack_hash_field || (CAPTURE_BYTES & capture_flags) ||
+                  (CAPTURE_LOG & capture_flags)
+                ? JNI_TRUE : JNI_FALSE;
+    // Do all the expensive JVMTI work once, however many sinks want it. The
+    // breakpoint is hit in StackInfo.fetchInfo(), so skip that frame.
+    if (!captureStack(jvmti_env, jni_env, breakpoint_thread, &params,
+                      &capture))
+        goto callback_Breakpoint_cleanup; // Error already reported
+    // Store the stack signature hash, if the Java side wants it
+    if (g_stack_hash_field)
+    {
+        (*jni_env)->SetLongField(jni_env, repo_ref, g_stack_hash_field,
+                                 (jlong)capture.hash);
+        if ((*jni_env)->ExceptionCheck(jni_env))
+        {
+            error1("exception while attempting to store stack hash");
+            exceptionDescribe(jni_env);
+            goto callback_Breakpoint_cleanup;
+        }
+    }
+    if (!hash_only &&
+        !storeCapture(jni_env, &capture, repo_ref, params.compress, reuse,
+                      mode))
+        goto callback_Breakpoint_cleanup; // Error already reported
+    if ((CAPTURE_BYTES & capture_flags) && g_stack_bytes_field)
+    {
+        stack_bytes = captureToBytes(jvmti_env, jni_env, &capture);
+        if (!stack_bytes ||
+            !objFieldPut(jni_env, repo_ref, g_stack_bytes_field, stack_bytes))
+            goto callback_Breakpoint_cleanup; // Error already reported
+    }
+    if (CAPTURE_LOG & capture_flags)
+        logCapture(jvmti_env, jni_env, &capture, "StackInfo capture");
+    // Mark the stack info repository as fully initialized
+    (*jni_env)->SetBooleanField(jni_env, repo_ref, g_is_initialized_field,
+                                JNI_TRUE);
+    if ((*jni_env)->ExceptionCheck(jni_env))
+    {
+        error1("exception while attempting to mark repo as initialized");
+        exceptionDescribe(jni_env);
+    }
+callback_Breakpoint_cleanup:
+    releaseCapture(jvmti_env, jni_env, &capture);
 }
 
 #ifdef _MSC_VER
@@ -951,19 +1903,54 @@ JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM * jvm, char * options,
     jvmtiEnv *          jvmti;
     jvmtiError          error;
     jvmtiCapabilities   caps;
+#ifdef JSDEBUG_VIRTUAL_THREADS
+    jvmtiCapabilities   potential_caps;
+#endif
     jvmtiEventCallbacks callbacks;
-    // Obtain a pointer to the JVMTI environment
-    error = (*jvm)->GetEnv(jvm, (void **)&jvmti, JVMTI_VERSION_1_0);
+    // Parse the options
+    g_jvm = jvm;
+    if (!parseOptions(options))
+        return JNI_ERR; // Error already reported
+    // Obtain a pointer to the JVMTI environment. Ask for the newest version
+    // the headers know about first: a JVM that supports virtual threads only
+    // reports them faithfully to environments of a recent enough version. Fall
+    // back to the baseline version for older JVMs.
+    error = (*jvm)->GetEnv(jvm, (void **)&jvmti, JVMTI_VERSION);
+    if (JVMTI_ERROR_NONE != error)
+        error = (*jvm)->GetEnv(jvm, (void **)&jvmti, JVMTI_VERSION_1_0);
     if (JVMTI_ERROR_NONE != error)
     {
         fatalError1("Agent_OnLoad failed to get JVMTI environment");
         return error;
     }
+    g_jvmti = jvmti;
     // Indicate the capabilities we want
     memset(&caps, 0, sizeof(caps));
     caps.can_access_local_variables     = 1;
     caps.can_get_line_numbers           = 1;
     caps.can_generate_breakpoint_events = 1;
+    if (wantsCompiledMethods())
+        addCompiledMethodCapabilities(&caps);
+    if (g_options.contention)
+        addContentionCapabilities(&caps);
+    if (g_options.stepping)
+        addSteppingCapabilities(&caps);
+    if (g_options.watchdog)
+        addWatchdogCapabilities(&caps);
+    if (g_options.index)
+        addIndexCapabilities(&caps);
+    if (g_options.alloc_interval && !addAllocationCapabilities(jvmti, &caps))
+        return JNI_ERR; // Error already reported
+#ifdef JSDEBUG_VIRTUAL_THREADS
+    // Without this capability a JVM running Suneido code on virtual threads
+    // may refuse to give us the locals of virtual thread frames. It is only
+    // available on JVMs with virtual thread support, so it is optional.
+    memset(&potential_caps, 0, sizeof(potential_caps));
+    if (JVMTI_ERROR_NONE ==
+        (*jvmti)->GetPotentialCapabilities(jvmti, &potential_caps))
+        caps.can_support_virtual_threads =
+            potential_caps.can_support_virtual_threads;
+#endif
     error = (*jvmti)->AddCapabilities(jvmti, &caps);
     if (JVMTI_ERROR_NONE != error)
     {
@@ -972,8 +1959,25 @@ JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM * jvm, char * options,
     }
     // Install the required callbacks
     memset(&callbacks, 0, sizeof(callbacks));
-    callbacks.VMInit     = callback_JVMInit;
-    callbacks.Breakpoint = callback_Breakpoint;
+    callbacks.VMInit               = callback_JVMInit;
+    callbacks.VMDeath              = callback_VMDeath;
+    callbacks.Breakpoint           = callback_Breakpoint;
+    callbacks.CompiledMethodLoad   = callback_CompiledMethodLoad;
+    callbacks.CompiledMethodUnload = callback_CompiledMethodUnload;
+    callbacks.DynamicCodeGenerated = callback_DynamicCodeGenerated;
+    callbacks.ThreadEnd            = callback_ThreadEnd;
+#ifdef JSDEBUG_VIRTUAL_THREADS
+    callbacks.VirtualThreadEnd     = callback_ThreadEnd;
+#endif
+    callbacks.MonitorContendedEnter   = callback_MonitorContendedEnter;
+    callbacks.MonitorContendedEntered = callback_MonitorContendedEntered;
+#ifdef JSDEBUG_SAMPLED_ALLOC
+    callbacks.SampledObjectAlloc   = callback_SampledObjectAlloc;
+#endif
+    callbacks.ClassPrepare         = callback_ClassPrepare;
+    callbacks.SingleStep           = callback_SingleStep;
+    callbacks.FramePop             = callback_FramePop;
+    callbacks.ObjectFree           = callback_ObjectFree;
     error = (*jvmti)->SetEventCallbacks(jvmti, &callbacks, sizeof(callbacks));
     if (JVMTI_ERROR_NONE != error)
     {
@@ -990,6 +1994,27 @@ JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM * jvm, char * options,
         fatalError1("Agent_OnLoad failed to enable VMInit callback");
         return error;
     }
+    // Start listening for compiled methods if an option needs them
+    if (wantsCompiledMethods() && !initCompiledMethods(jvmti))
+        return JNI_ERR; // Error already reported
+    // Start the optional features that were asked for
+    if (g_options.perf_map && !initPerfMap(jvmti))
+        return JNI_ERR; // Error already reported
+    if (g_options.contention && !initContention(jvmti))
+        return JNI_ERR; // Error already reported
+    if (g_options.stepping && !initStepping(jvmti))
+        return JNI_ERR; // Error already reported
+    if (g_options.alloc_interval &&
+        !initAllocation(jvmti, g_options.alloc_interval))
+        return JNI_ERR; // Error already reported
+    if (g_options.cpu_rate && !initCpuSampler(jvmti, g_options.cpu_rate))
+        return JNI_ERR; // Error already reported
+    if (g_options.index && !initIndex(jvmti))
+        return JNI_ERR; // Error already reported
+    if (g_options.watchdog &&
+        !initWatchdog(jvmti, g_options.watchdog,
+                      (jboolean)g_options.watch_locals))
+        return JNI_ERR; // Error already reported
     // Initialized OK
     return JNI_OK;
 }
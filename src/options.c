@@ -0,0 +1,144 @@
+/* Copyright 2026 (c) Suneido Software Corp. All rights reserved.
+ * Licensed under GPLv2.
+ */
+
+#ifdef _MSC_VER
+#pragma warning (disable : 4001) /* nonstandard extension: '//-style' comment */
+#endif // _MSC_VER
+
+//==============================================================================
+// file: options.c
+// auth: agent
+// date: 20261018
+// desc: Parses the options string passed to the agent on the command line
+//==============================================================================
+
+#include "jsdebug.h"
+
+#include <string.h>
+
+// =============================================================================
+//                                 CONSTANTS
+// =============================================================================
+
+enum
+{
+    DEFAULT_ALLOC_INTERVAL = 512 * 1024, /* the JVM's own default, in bytes */
+    DEFAULT_CPU_RATE       = 100,        /* samples per second of CPU time */
+    DEFAULT_WATCHDOG       = 30,         /* seconds in one Suneido call */
+};
+
+// =============================================================================
+//                                  GLOBALS
+// =============================================================================
+
+struct agent_options g_options;
+
+// =============================================================================
+//                             HELPER FUNCTIONS
+// =============================================================================
+
+// Returns true iff the option [begin, end) is exactly name
+static int isOption(const char * begin, const char * end, const char * name)
+{
+    size_t length = strlen(name);
+    return (size_t)(end - begin) == length && !strncmp(begin, name, length);
+}
+
+// Returns true iff the option [begin, end) is name=value, where value is a
+// positive decimal integer, in which case the value is stored into *pvalue.
+// If the option is just name, *pvalue is set to default_value.
+static int isIntOption(const char * begin, const char * end, const char * name,
+                       jint default_value, jint * pvalue)
+{
+    size_t length = strlen(name);
+    jint   value  = 0;
+    if ((size_t)(end - begin) < length || strncmp(begin, name, length))
+        return 0;
+    begin += length;
+    if (begin == end)
+    {
+        *pvalue = default_value;
+        return 1;
+    }
+    if ('=' != *begin++ || begin == end)
+        return 0;
+    for (; begin < end; ++begin)
+    {
+        if (*begin < '0' || '9' < *begin ||
+            (0x7fffffff - (*begin - '0')) / 10 < value)
+            return 0;
+        value = value * 10 + (*begin - '0');
+    }
+    if (value <= 0)
+        return 0;
+    *pvalue = value;
+    return 1;
+}
+
+static void badOption(const char * begin, const char * end)
+{
+    char   buffer[64];
+    size_t length = (size_t)(end - begin);
+    if (sizeof(buffer) <= length)
+        length = sizeof(buffer) - 1;
+    memcpy(buffer, begin, length);
+    buffer[length] = '\0';
+    fatalError2("invalid agent option: ", buffer);
+}
+
+// =============================================================================
+//                                 PARSING
+// =============================================================================
+
+// Parses a comma-separated list of options into g_options. The options string
+// may be NULL if no options were given.
+int parseOptions(const char * options)
+{
+    const char * begin = options;
+    const char * end;
+    memset(&g_options, 0, sizeof(g_options));
+    if (!options)
+        return 1;
+    for (; *begin; begin = *end ? end + 1 : end)
+    {
+        end = strchr(begin, ',');
+        if (!end)
+            end = begin + strlen(begin);
+        if (begin == end)
+            continue;
+        else if (isOption(begin, end, "perfmap"))
+            g_options.perf_map = 1;
+        else if (isOption(begin, end, "contention"))
+            g_options.contention = 1;
+        else if (isOption(begin, end, "index"))
+            g_options.index = 1;
+        else if (isOption(begin, end, "jitcounts"))
+            g_options.jit_counts = 1;
+        else if (isOption(begin, end, "stepping"))
+            g_options.stepping = 1;
+        else if (isOption(begin, end, "watchdoglocals"))
+            g_options.watch_locals = 1;
+        else if (isIntOption(begin, end, "alloc", DEFAULT_ALLOC_INTERVAL,
+                             &g_options.alloc_interval))
+            continue;
+        else if (isIntOption(begin, end, "cpu", DEFAULT_CPU_RATE,
+                             &g_options.cpu_rate))
+            continue;
+        else if (isIntOption(begin, end, "watchdog", DEFAULT_WATCHDOG,
+                             &g_options.watchdog))
+            continue;
+        else
+        {
+            badOption(begin, end);
+            return 0;
+        }
+    }
+    if (g_options.watch_locals && !g_options.watchdog)
+    {
+        fatalError1("the watchdoglocals option requires the watchdog option");
+        return 0;
+    }
+    // Return success
+    return 1;
+}
@@ -0,0 +1,189 @@
+/* Copyright 2026 (c) Suneido Software Corp. All rights reserved.
+ * Licensed under GPLv2.
+ */
+
+#ifdef _MSC_VER
+#pragma warning (disable : 4001) /* nonstandard extension: '//-style' comment */
+#endif // _MSC_VER
+
+//==============================================================================
+// file: perfmap.c
+// auth: agent
+// date: 20261018
+// desc: Writes a /tmp/perf-<pid>.map symbol file so that Linux perf can name
+//       JIT-compiled code, with Suneido code named after Suneido callables
+//==============================================================================
+
+#include "jsdebug.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif // __linux__
+
+// =============================================================================
+//                                 CONSTANTS
+// =============================================================================
+
+enum
+{
+    MAX_SYMBOL_NAME = 512,
+};
+
+static const char * SUNEIDO_SYMBOL_PREFIX = "Suneido:";
+
+// =============================================================================
+//                                  GLOBALS
+// =============================================================================
+
+static FILE *        g_perf_map_file;
+static jrawMonitorID g_perf_map_lock;
+
+// =============================================================================
+//                             HELPER FUNCTIONS
+// =============================================================================
+
+static void writeSymbol(jvmtiEnv * jvmti_env, const void * address,
+                        jint length, const char * name)
+{
+    enterMonitor(jvmti_env, g_perf_map_lock);
+    // Format is "START SIZE symbolname", with START and SIZE in hex
+    fprintf(g_perf_map_file, "%lx %x %s\n", (unsigned long)(size_t)address,
+            (unsigned int)length, name);
+    // Flush every time so perf sees the symbol even if the JVM dies badly
+    fflush(g_perf_map_file);
+    exitMonitor(jvmti_env, g_perf_map_lock);
+}
+
+static jboolean isSuneidoMethod(JNIEnv * jni_env, jclass declaring_class,
+                                const char * name)
+{
+    // Suneido callables only exist once the VM is initialized
+    if (!jni_env || !g_stack_frame_class ||
+        METHOD_NAME_UNKNOWN == classifyMethodName(name))
+        return JNI_FALSE;
+    return (*jni_env)->IsAssignableFrom(jni_env, declaring_class,
+                                        g_stack_frame_class);
+}
+
+// =============================================================================
+//                               AGENT INIT
+// =============================================================================
+
+int initPerfMap(jvmtiEnv * jvmti_env)
+{
+#ifdef __linux__
+    jvmtiError error;
+    char       path[64];
+    sprintf(path, "/tmp/perf-%d.map", (int)getpid());
+    g_perf_map_file = fopen(path, "w");
+    if (!g_perf_map_file)
+    {
+        fatalError2("can't open perf map file: ", path);
+        return 0;
+    }
+    error = (*jvmti_env)->CreateRawMonitor(jvmti_env, "jsdebug perf map",
+                                           &g_perf_map_lock);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        fatalErrorJVMTI(jvmti_env, error, "failed to create perf map lock");
+        return 0;
+    }
+    // Compiled method events are already enabled (see compiled.c), but the
+    // stubs, interpreter, etc. need dynamic code events as well.
+    error = (*jvmti_env)->SetEventNotificationMode(
+        jvmti_env, JVMTI_ENABLE, JVMTI_EVENT_DYNAMIC_CODE_GENERATED,
+        (jthread)NULL);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        fatalErrorJVMTI(jvmti_env, error,
+                        "failed to enable dynamic code generated events");
+        return 0;
+    }
+    // Return success
+    return 1;
+#else
+    fatalError1("the perfmap option is only supported on Linux");
+    return 0;
+#endif // __linux__
+}
+
+// =============================================================================
+//                                 CALLBACKS
+// =============================================================================
+
+// Called from the compiled method load callback in compiled.c
+void perfMapCompiledMethod(jvmtiEnv * jvmti_env, jmethodID method,
+                           const void * code_addr, jint code_size)
+{
+    jvmtiError error;
+    JNIEnv *   jni_env = NULL;
+    jclass     declaring_class = (jclass)NULL;
+    char *     class_signature = NULL;
+    char *     method_name = NULL;
+    char       symbol[MAX_SYMBOL_NAME];
+    size_t     length;
+    if (!g_perf_map_file)
+        return;
+    // Compiled method events are sent on JVM threads, so this should work
+    if (JNI_OK != (*g_jvm)->GetEnv(g_jvm, (void **)&jni_env, JNI_VERSION_1_2))
+        jni_env = NULL;
+    error = (*jvmti_env)->GetMethodDeclaringClass(jvmti_env, method,
+                                                  &declaring_class);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(jvmti_env, error, "failed to get method declaring class");
+        goto perfMapCompiledMethod_end;
+    }
+    error = (*jvmti_env)->GetClassSignature(jvmti_env, declaring_class,
+                                            &class_signature, NULL);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(jvmti_env, error, "failed to get class signature");
+        goto perfMapCompiledMethod_end;
+    }
+    error = (*jvmti_env)->GetMethodName(jvmti_env, method, &method_name, NULL,
+                                        NULL);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(jvmti_env, error, "failed to get method name");
+        goto perfMapCompiledMethod_end;
+    }
+    if (isSuneidoMethod(jni_env, declaring_class, method_name))
+    {
+        // Suneido code is named "Suneido:Callable", because the Java method
+        // name (eval, call2, ...) means nothing to a Suneido programmer.
+        strcpy(symbol, SUNEIDO_SYMBOL_PREFIX);
+        length = strlen(symbol);
+        formatClassName(class_signature, JNI_TRUE, symbol + length,
+                        sizeof(symbol) - length);
+    }
+    else
+    {
+        // Everything else is named "package.Class.method"
+        formatClassName(class_signature, JNI_FALSE, symbol,
+                        sizeof(symbol) - 1);
+        length = strlen(symbol);
+        symbol[length++] = '.';
+        strncpy(symbol + length, method_name, sizeof(symbol) - length - 1);
+        symbol[sizeof(symbol) - 1] = '\0';
+    }
+    writeSymbol(jvmti_env, code_addr, code_size, symbol);
+perfMapCompiledMethod_end:
+    if (method_name)
+        (*jvmti_env)->Deallocate(jvmti_env, (unsigned char *)method_name);
+    if (class_signature)
+        (*jvmti_env)->Deallocate(jvmti_env, (unsigned char *)class_signature);
+    if (declaring_class && jni_env)
+        (*jni_env)->DeleteLocalRef(jni_env, declaring_class);
+}
+
+void JNICALL callback_DynamicCodeGenerated(jvmtiEnv * jvmti_env,
+                                           const char * name,
+                                           const void * address, jint length)
+{
+    if (g_perf_map_file)
+        writeSymbol(jvmti_env, address, length, name);
+}
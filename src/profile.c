@@ -0,0 +1,398 @@
+/* Copyright 2026 (c) Suneido Software Corp. All rights reserved.
+ * Licensed under GPLv2.
+ */
+
+#ifdef _MSC_VER
+#pragma warning (disable : 4001) /* nonstandard extension: '//-style' comment */
+#endif // _MSC_VER
+
+//==============================================================================
+// file: profile.c
+// auth: agent
+// date: 20261018
+// desc: Aggregates profiling events by Suneido call stack in native memory
+//       and exports the aggregates to Java as folded stacks, the text format
+//       read by flame graph tools
+//==============================================================================
+
+#include "jsdebug.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+// =============================================================================
+//                                 CONSTANTS
+// =============================================================================
+
+enum
+{
+    PROFILE_TABLE_INITIAL_CAPACITY = 256,   /* must be a power of 2 */
+    PROFILE_MAX_ENTRIES            = 65536, /* further stacks are "other" */
+    MAX_FRAME_NAME                 = 256,
+};
+
+// Key of the entry standing in for all the stacks that didn't fit
+#define PROFILE_OTHER_HASH 0ULL
+
+static const char * NO_SUNEIDO_FRAMES_NAME = "[no Suneido code]";
+static const char * OTHER_STACKS_NAME      = "[other stacks]";
+
+// =============================================================================
+//                                  GLOBALS
+// =============================================================================
+
+struct profile_entry
+{
+    char *             stack; // Folded stack, root first; NULL if slot empty
+    unsigned long long hash;  // Stack hash from findSuneidoFrames()
+    jlong              count; // Number of events
+    jlong              value; // Sum of event values (see enum profile_kind)
+};
+
+struct profile_table
+{
+    struct profile_entry * entries; // NULL if the profile isn't enabled
+    jint                   capacity;
+    jint                   size;
+};
+
+static jrawMonitorID        g_profile_lock;
+static struct profile_table g_profiles[PROFILE_KIND_COUNT];
+
+// =============================================================================
+//                             HELPER FUNCTIONS
+// =============================================================================
+
+// Returns the slot containing hash or, if it isn't in the table, the empty
+// slot where it belongs. Caller must hold g_profile_lock.
+static struct profile_entry * findSlot(struct profile_entry * entries,
+                                       jint capacity, unsigned long long hash)
+{
+    size_t mask = (size_t)capacity - 1;
+    size_t k    = (size_t)hash & mask; // FNV-1a mixes the low bits well
+    while (entries[k].stack && entries[k].hash != hash)
+        k = (k + 1) & mask;
+    return &entries[k];
+}
+
+static int growTable(struct profile_table * table)
+{
+    jint                   new_capacity = table->capacity * 2;
+    struct profile_entry * new_entries;
+    jint                   k;
+    new_entries = (struct profile_entry *)calloc(
+                      new_capacity, sizeof(struct profile_entry));
+    if (!new_entries)
+    {
+        error1("profile table calloc returned NULL");
+        return 0;
+    }
+    for (k = 0; k < table->capacity; ++k)
+        if (table->entries[k].stack)
+            *findSlot(new_entries, new_capacity, table->entries[k].hash) =
+                table->entries[k];
+    free(table->entries);
+    table->entries = new_entries;
+    table->capacity = new_capacity;
+    return 1;
+}
+
+// Adds an entry for hash, whose folded stack is stack, unless it is already
+// there. If the table is full the stack is counted as one of the "other"
+// stacks instead, and *phash is changed accordingly. Takes ownership of stack.
+// Caller must hold g_profile_lock.
+static void insertStack(struct profile_table * table, char * stack,
+                        unsigned long long * phash)
+{
+    struct profile_entry * entry;
+    entry = findSlot(table->entries, table->capacity, *phash);
+    if (!entry->stack && PROFILE_MAX_ENTRIES <= table->size)
+    {
+        free(stack);
+        *phash = PROFILE_OTHER_HASH;
+        entry = findSlot(table->entries, table->capacity, *phash);
+        if (entry->stack)
+            return;
+        stack = (char *)malloc(strlen(OTHER_STACKS_NAME) + 1);
+        if (!stack)
+            return;
+        strcpy(stack, OTHER_STACKS_NAME);
+    }
+    if (entry->stack)
+    {
+        free(stack); // Another thread got here first
+        return;
+    }
+    // Keep the load factor at or below 3/4
+    if (table->capacity * 3 <= (table->size + 1) * 4)
+    {
+        if (!growTable(table))
+        {
+            free(stack);
+            return;
+        }
+        entry = findSlot(table->entries, table->capacity, *phash);
+    }
+    entry->stack = stack;
+    entry->hash = *phash;
+    ++table->size;
+}
+
+// Builds the folded form of a Suneido stack: frame names separated by
+// semicolons, outermost frame first. Returns NULL on failure.
+static char * foldStack(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                        const struct suneido_frame * frames, jint count)
+{
+    struct text_buf buf;
+    char            name[MAX_FRAME_NAME];
+    jint            k;
+    memset(&buf, 0, sizeof(buf));
+    if (0 == count &&
+        !appendText(&buf, NO_SUNEIDO_FRAMES_NAME,
+                    strlen(NO_SUNEIDO_FRAMES_NAME)))
+        goto foldStack_error;
+    for (k = count - 1; 0 <= k; --k)
+    {
+        if (k < count - 1 && !appendText(&buf, ";", 1))
+            goto foldStack_error;
+        if (!captureFrameName(jvmti_env, jni_env, &frames[k], name,
+                              sizeof(name)) ||
+            !appendText(&buf, name, strlen(name)))
+            goto foldStack_error;
+    }
+    return buf.data;
+foldStack_error:
+    free(buf.data);
+    return NULL;
+}
+
+// =============================================================================
+//                               AGENT INIT
+// =============================================================================
+
+// Turns on one kind of profile. Must be called from Agent_OnLoad().
+int initProfile(jvmtiEnv * jvmti_env, enum profile_kind kind)
+{
+    jvmtiError error;
+    assert(0 <= kind && kind < PROFILE_KIND_COUNT);
+    if (!g_profile_lock)
+    {
+        error = (*jvmti_env)->CreateRawMonitor(jvmti_env, "jsdebug profile",
+                                               &g_profile_lock);
+        if (JVMTI_ERROR_NONE != error)
+        {
+            fatalErrorJVMTI(jvmti_env, error, "failed to create profile lock");
+            return 0;
+        }
+    }
+    g_profiles[kind].entries = (struct profile_entry *)calloc(
+        PROFILE_TABLE_INITIAL_CAPACITY, sizeof(struct profile_entry));
+    if (!g_profiles[kind].entries)
+    {
+        fatalError1("profile table calloc returned NULL");
+        return 0;
+    }
+    g_profiles[kind].capacity = PROFILE_TABLE_INITIAL_CAPACITY;
+    // Return success
+    return 1;
+}
+
+// =============================================================================
+//                              EVENT RECORDING
+// =============================================================================
+
+// Finds the Suneido stack of the given thread, which must be the current
+// thread, and makes sure the profile has an entry for it. The key of the entry
+// is stored into *phash for a later call to profileAdd().
+int profileStack(jvmtiEnv * jvmti_env, JNIEnv * jni_env, jthread thread,
+                 enum profile_kind kind, unsigned long long * phash)
+{
+    int                    result = 0;
+    struct capture_params  params;
+    struct stack_capture   capture;
+    // Profiling has to be cheap enough to leave on, so don't deoptimize
+    // frames to find out what they are unless there's no other way.
+    memset(&params, 0, sizeof(params));
+    params.minimize_deopt = JNI_TRUE;
+    params.hash = JNI_TRUE; // The key of the profile entry
+    if (!captureStack(jvmti_env, jni_env, thread, &params, &capture))
+        goto profileStack_end; // Error already reported
+    *phash = capture.hash;
+    result = profileFrames(jvmti_env, jni_env, kind, capture.frames,
+                           capture.count, phash);
+profileStack_end:
+    releaseCapture(jvmti_env, jni_env, &capture);
+    return result;
+}
+
+// Makes sure the profile has an entry for a Suneido stack found some other
+// way than by profileStack(), given its frames, innermost first, and a hash of
+// them in *phash. As with profileStack(), *phash becomes the key of the entry.
+int profileFrames(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                  enum profile_kind kind, const struct suneido_frame * frames,
+                  jint count, unsigned long long * phash)
+{
+    struct profile_table * table = &g_profiles[kind];
+    jboolean               found;
+    char *                 stack;
+    // Most of the time the stack has been seen before
+    enterMonitor(jvmti_env, g_profile_lock);
+    found = findSlot(table->entries, table->capacity, *phash)->stack
+                ? JNI_TRUE : JNI_FALSE;
+    exitMonitor(jvmti_env, g_profile_lock);
+    if (found)
+        return 1;
+    // Name the frames outside the lock, since it takes JVMTI calls
+    stack = foldStack(jvmti_env, jni_env, frames, count);
+    if (!stack)
+        return 0; // Error already reported
+    enterMonitor(jvmti_env, g_profile_lock);
+    insertStack(table, stack, phash);
+    exitMonitor(jvmti_env, g_profile_lock);
+    return 1;
+}
+
+// Adds events to the entry for a stack found by profileStack(). If the
+// profile has been reset in the meantime, the events are dropped.
+void profileAdd(jvmtiEnv * jvmti_env, enum profile_kind kind,
+                unsigned long long hash, jlong count, jlong value)
+{
+    struct profile_table * table = &g_profiles[kind];
+    struct profile_entry * entry;
+    enterMonitor(jvmti_env, g_profile_lock);
+    entry = findSlot(table->entries, table->capacity, hash);
+    if (entry->stack)
+    {
+        entry->count += count;
+        entry->value += value;
+    }
+    exitMonitor(jvmti_env, g_profile_lock);
+}
+
+// =============================================================================
+//                                  OUTPUT
+// =============================================================================
+
+// Appends the profile to buf as folded stacks, one "stack value" line per
+// stack. If values is false, the number of events is given instead of the
+// sum of their values.
+static int foldProfile(const struct profile_table * table, jboolean values,
+                       struct text_buf * buf)
+{
+    int  result = 0;
+    char number[32];
+    jint k;
+    enterMonitor(g_jvmti, g_profile_lock);
+    for (k = 0; k < table->capacity; ++k)
+    {
+        const struct profile_entry * entry = &table->entries[k];
+        if (!entry->stack || 0 == entry->count)
+            continue;
+        sprintf(number, " %lld\n",
+                (long long)(values ? entry->value : entry->count));
+        if (!appendText(buf, entry->stack, strlen(entry->stack)) ||
+            !appendText(buf, number, strlen(number)))
+            goto foldProfile_end;
+    }
+    result = 1;
+foldProfile_end:
+    exitMonitor(g_jvmti, g_profile_lock);
+    return result;
+}
+
+// Writes the profile to the file at path as folded stacks. See foldProfile().
+int writeProfile(enum profile_kind kind, jboolean values, const char * path)
+{
+    int             result = 0;
+    struct text_buf buf;
+    FILE *          file;
+    memset(&buf, 0, sizeof(buf));
+    if (!foldProfile(&g_profiles[kind], values, &buf))
+        goto writeProfile_end; // Error already reported
+    file = fopen(path, "w");
+    if (!file)
+    {
+        error2("can't open profile file: ", path);
+        goto writeProfile_end;
+    }
+    if (buf.length)
+        fwrite(buf.data, 1, buf.length, file);
+    if (0 == fclose(file))
+        result = 1;
+    else
+        error2("failed to write profile file: ", path);
+writeProfile_end:
+    free(buf.data);
+    return result;
+}
+
+// =============================================================================
+//                              JAVA INTERFACE
+// =============================================================================
+
+#ifdef _MSC_VER
+#pragma warning (push)
+#pragma warning (disable : 4100) // unreferenced formal parameter
+#endif // _MSC_VER
+
+static jboolean checkKind(JNIEnv * jni_env, jint kind)
+{
+    jclass clazz;
+    if (0 <= kind && kind < PROFILE_KIND_COUNT)
+        return JNI_TRUE;
+    clazz = (*jni_env)->FindClass(jni_env,
+                                  "java/lang/IllegalArgumentException");
+    if (clazz)
+        (*jni_env)->ThrowNew(jni_env, clazz, "invalid profile kind");
+    return JNI_FALSE;
+}
+
+// Returns the profile as folded stacks (see foldProfile()), or null if the
+// profile isn't enabled.
+// private static native String getFoldedStacks(int kind, boolean values);
+JNIEXPORT jstring JNICALL Java_suneido_debug_Profiler_getFoldedStacks(
+    JNIEnv * jni_env, jclass clazz, jint kind, jboolean values)
+{
+    struct profile_table * table;
+    struct text_buf        buf;
+    jstring                result = (jstring)NULL;
+    if (!checkKind(jni_env, kind))
+        return (jstring)NULL;
+    table = &g_profiles[kind];
+    if (!table->entries)
+        return (jstring)NULL;
+    memset(&buf, 0, sizeof(buf));
+    // Copy the text out under the lock, but create the Java string outside it
+    if (!foldProfile(table, values, &buf))
+        goto getFoldedStacks_end; // Error already reported
+    result = (*jni_env)->NewStringUTF(jni_env, buf.data ? buf.data : "");
+getFoldedStacks_end:
+    free(buf.data);
+    return result; // If NULL, an exception may be pending
+}
+
+// private static native void resetProfile(int kind);
+JNIEXPORT void JNICALL Java_suneido_debug_Profiler_resetProfile(
+    JNIEnv * jni_env, jclass clazz, jint kind)
+{
+    struct profile_table * table;
+    jint                   k;
+    if (!checkKind(jni_env, kind))
+        return;
+    table = &g_profiles[kind];
+    if (!table->entries)
+        return;
+    enterMonitor(g_jvmti, g_profile_lock);
+    for (k = 0; k < table->capacity; ++k)
+        free(table->entries[k].stack);
+    memset(table->entries, 0,
+           table->capacity * sizeof(struct profile_entry));
+    table->size = 0;
+    exitMonitor(g_jvmti, g_profile_lock);
+}
+
+#ifdef _MSC_VER
+#pragma warning (pop)
+#endif // _MSC_VER
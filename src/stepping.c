@@ -0,0 +1,375 @@
+/* Copyright 2026 (c) Suneido Software Corp. All rights reserved.
+ * Licensed under GPLv2.
+ */
+
+#ifdef _MSC_VER
+#pragma warning (disable : 4001) /* nonstandard extension: '//-style' comment */
+#endif // _MSC_VER
+
+//==============================================================================
+// file: stepping.c
+// auth: agent
+// date: 20261018
+// desc: Steps a thread through Suneido code a line at a time, filtering the
+//       underlying single step and frame pop events in native code so Java
+//       only hears about the step once the Suneido line changes
+//==============================================================================
+
+#include "jsdebug.h"
+
+#include <string.h>
+
+// =============================================================================
+//                                 CONSTANTS
+// =============================================================================
+
+// Kinds of step. These must be kept in sync with the equivalent constants in
+// suneido/debug/Breakpoints.java.
+enum step_kind
+{
+    STEP_NONE = 0, /* cancels a step in progress */
+    STEP_INTO = 1,
+    STEP_OVER = 2,
+    STEP_OUT  = 3,
+};
+
+static const char * STEP_COMPLETED_METHOD_NAME      = "stepCompleted";
+static const char * STEP_COMPLETED_METHOD_SIGNATURE =
+    "(Lsuneido/debug/StackInfo;)V";
+
+// =============================================================================
+//                                  GLOBALS
+// =============================================================================
+
+static jrawMonitorID g_step_lock;
+static jclass        g_step_class; // Global ref to suneido.debug.Breakpoints
+static jmethodID     g_step_completed_method;
+
+// =============================================================================
+//                             HELPER FUNCTIONS
+// =============================================================================
+
+// Finds the Java method that completed steps are handed to, the first time a
+// step is started. Caller must hold g_step_lock. Since no step is started
+// until this succeeds, completeStep() always sees both globals set.
+static int findStepCompleted(JNIEnv * jni_env, jclass clazz)
+{
+    jmethodID method;
+    jclass    global_class;
+    method = (*jni_env)->GetStaticMethodID(jni_env, clazz,
+                                           STEP_COMPLETED_METHOD_NAME,
+                                           STEP_COMPLETED_METHOD_SIGNATURE);
+    if (!method)
+        return 0; // NoSuchMethodError pending
+    global_class = (jclass)(*jni_env)->NewGlobalRef(jni_env, clazz);
+    if (!global_class)
+    {
+        error1("failed to create stepping class global reference");
+        return 0;
+    }
+    g_step_completed_method = method;
+    // Set last, since it says everything has been found
+    g_step_class = global_class;
+    return 1;
+}
+
+// Reading "this" is too expensive to do for every bytecode, so methods are
+// classified statically. The answer for the last method asked about is cached
+// in the step state, since consecutive events are usually in the same method.
+static int isSuneidoMethod(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                           struct step_state * step, jmethodID method,
+                           jboolean * pis_suneido)
+{
+    enum method_name name;
+    if (method != step->cache_method)
+    {
+        if (!classifySuneidoMethod(jvmti_env, jni_env, method, &name))
+            return 0; // Error already reported
+        step->cache_method = method;
+        step->cache_is_suneido = METHOD_NAME_UNKNOWN != name;
+    }
+    *pis_suneido = step->cache_is_suneido;
+    return 1;
+}
+
+static int setStepEvents(jvmtiEnv * jvmti_env, jthread thread,
+                         jvmtiEventMode single_step, jvmtiEventMode frame_pop)
+{
+    jvmtiError error;
+    error = (*jvmti_env)->SetEventNotificationMode(
+        jvmti_env, single_step, JVMTI_EVENT_SINGLE_STEP, thread);
+    if (JVMTI_ERROR_NONE == error)
+        error = (*jvmti_env)->SetEventNotificationMode(
+            jvmti_env, frame_pop, JVMTI_EVENT_FRAME_POP, thread);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(jvmti_env, error, "failed to set step event mode");
+        return 0;
+    }
+    return 1;
+}
+
+static void endStep(jvmtiEnv * jvmti_env, jthread thread,
+                    struct step_state * step)
+{
+    setStepEvents(jvmti_env, thread, JVMTI_DISABLE, JVMTI_DISABLE);
+    memset(step, 0, sizeof(*step));
+}
+
+// Stops single stepping until the frame at the given height, which is deeper
+// than the step limit, returns. If the frame can't be watched, e.g. because
+// it's a native frame, single stepping carries on through it.
+static int skipFrame(jvmtiEnv * jvmti_env, jthread thread,
+                     struct step_state * step, jint height, jint frame_height)
+{
+    jvmtiError error;
+    error = (*jvmti_env)->NotifyFramePop(jvmti_env, thread,
+                                         height - frame_height);
+    if (JVMTI_ERROR_OPAQUE_FRAME == error)
+        return setStepEvents(jvmti_env, thread, JVMTI_ENABLE, JVMTI_DISABLE);
+    else if (JVMTI_ERROR_NONE != error && JVMTI_ERROR_DUPLICATE != error)
+    {
+        errorJVMTI(jvmti_env, error, "failed to request frame pop");
+        return 0;
+    }
+    step->pop_height = frame_height;
+    return setStepEvents(jvmti_env, thread, JVMTI_DISABLE, JVMTI_ENABLE);
+}
+
+// Captures the Suneido stack of the current thread and hands it to Java
+static void completeStep(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                         jthread thread)
+{
+    struct capture_params params;
+    struct stack_capture  capture;
+    jobject               info = (jobject)NULL;
+    memset(&params, 0, sizeof(params));
+    params.locals = JNI_TRUE;
+    params.hash = JNI_TRUE; // Stopping is rare, so the StackInfo gets it all
+    if (!captureStack(jvmti_env, jni_env, thread, &params, &capture))
+        goto completeStep_cleanup; // Error already reported
+    info = newStackInfo(jni_env, &capture);
+    if (!info)
+        goto completeStep_cleanup; // Error already reported
+    (*jni_env)->CallStaticVoidMethod(jni_env, g_step_class,
+                                     g_step_completed_method, info);
+    if ((*jni_env)->ExceptionCheck(jni_env))
+    {
+        error1("exception in step handler");
+        exceptionDescribe(jni_env);
+    }
+    (*jni_env)->DeleteLocalRef(jni_env, info);
+completeStep_cleanup:
+    releaseCapture(jvmti_env, jni_env, &capture);
+}
+
+// =============================================================================
+//                               AGENT INIT
+// =============================================================================
+
+void addSteppingCapabilities(jvmtiCapabilities * caps)
+{
+    caps->can_generate_single_step_events = 1;
+    caps->can_generate_frame_pop_events = 1;
+}
+
+int initStepping(jvmtiEnv * jvmti_env)
+{
+    jvmtiError error;
+    error = (*jvmti_env)->CreateRawMonitor(jvmti_env, "jsdebug stepping",
+                                           &g_step_lock);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        fatalErrorJVMTI(jvmti_env, error, "failed to create stepping lock");
+        return 0;
+    }
+    // Step state lives in the thread state, which must be freed when the
+    // thread ends
+    return initThreadStates(jvmti_env);
+}
+
+// =============================================================================
+//                                 CALLBACKS
+// =============================================================================
+
+#ifdef _MSC_VER
+#pragma warning (push)
+#pragma warning (disable : 4100) // unreferenced formal parameter
+#endif // _MSC_VER
+
+// Single step events are only enabled for a thread while it is stepping
+void JNICALL callback_SingleStep(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                                 jthread thread, jmethodID method,
+                                 jlocation location)
+{
+    struct thread_state * state;
+    struct step_state *   step;
+    jvmtiError            error;
+    jboolean              is_suneido;
+    jint                  height;
+    jint                  line_number;
+    state = getThreadState(jvmti_env, thread);
+    if (!state)
+        return; // Error already reported
+    step = &state->step;
+    if (STEP_NONE == step->kind)
+        return;
+    if (!isSuneidoMethod(jvmti_env, jni_env, step, method, &is_suneido))
+        goto callback_SingleStep_error;
+    if (!is_suneido && STEP_INTO == step->kind)
+        return;
+    error = (*jvmti_env)->GetFrameCount(jvmti_env, thread, &height);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(jvmti_env, error, "from GetFrameCount()");
+        goto callback_SingleStep_error;
+    }
+    // Once the step has left the frame it started in, the frame it has
+    // returned to is where it stops
+    if (height < step->limit)
+        step->limit = height;
+    // Don't step through calls that are deeper than the step can stop in
+    if (STEP_INTO != step->kind && step->limit < height)
+    {
+        if (!skipFrame(jvmti_env, thread, step, height, step->limit + 1))
+            goto callback_SingleStep_error;
+        return;
+    }
+    if (!is_suneido)
+        return;
+    if (!fetchLineNumbers(jvmti_env, method, location, &line_number))
+        goto callback_SingleStep_error; // Error already reported
+    if (method == step->method && height == step->height &&
+        line_number == step->line_number)
+        return; // Still on the line the step started on
+    endStep(jvmti_env, thread, step);
+    completeStep(jvmti_env, jni_env, thread);
+    return;
+callback_SingleStep_error:
+    endStep(jvmti_env, thread, step);
+}
+
+// Frame pop events are only enabled for a thread while it is skipping a frame
+// that the step can't stop in
+void JNICALL callback_FramePop(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                               jthread thread, jmethodID method,
+                               jboolean was_popped_by_exception)
+{
+    struct thread_state * state;
+    struct step_state *   step;
+    jvmtiError            error;
+    jint                  height;
+    state = getThreadState(jvmti_env, thread);
+    if (!state)
+        return; // Error already reported
+    step = &state->step;
+    if (STEP_NONE == step->kind || 0 == step->pop_height)
+        return;
+    // The frame being popped is still the top frame
+    error = (*jvmti_env)->GetFrameCount(jvmti_env, thread, &height);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(jvmti_env, error, "from GetFrameCount()");
+        endStep(jvmti_env, thread, step);
+        return;
+    }
+    if (step->pop_height < height)
+        return; // A deeper frame someone else wanted to hear about
+    step->pop_height = 0;
+    if (!setStepEvents(jvmti_env, thread, JVMTI_ENABLE, JVMTI_DISABLE))
+        endStep(jvmti_env, thread, step);
+}
+
+// =============================================================================
+//                              JAVA INTERFACE
+// =============================================================================
+
+// Starts stepping the current thread, which must be stopped in Suneido code
+// by breakpointHit() or stepCompleted(), or cancels a step if kind is
+// STEP_NONE. When the step is done, stepCompleted(stackInfo) is called in
+// the thread. Returns false if the thread isn't in Suneido code.
+// private static native boolean step(int kind);
+JNIEXPORT jboolean JNICALL Java_suneido_debug_Breakpoints_step(
+    JNIEnv * jni_env, jclass clazz, jint kind)
+{
+    jboolean              result = JNI_FALSE;
+    jvmtiError            error;
+    jthread               thread = (jthread)NULL;
+    struct thread_state * state;
+    struct step_state *   step;
+    struct capture_params params;
+    struct stack_capture  capture;
+    jclass                exception_class;
+    int                   found;
+    if (!g_options.stepping)
+    {
+        exception_class = (*jni_env)->FindClass(
+            jni_env, "java/lang/UnsupportedOperationException");
+        if (exception_class)
+            (*jni_env)->ThrowNew(jni_env, exception_class,
+                                 "the jsdebug stepping option is off");
+        return JNI_FALSE;
+    }
+    if (kind < STEP_NONE || STEP_OUT < kind)
+    {
+        exception_class = (*jni_env)->FindClass(
+            jni_env, "java/lang/IllegalArgumentException");
+        if (exception_class)
+            (*jni_env)->ThrowNew(jni_env, exception_class,
+                                 "invalid step kind");
+        return JNI_FALSE;
+    }
+    // The Java side of the interface is found the first time it's used
+    enterMonitor(g_jvmti, g_step_lock);
+    found = g_step_class || findStepCompleted(jni_env, clazz);
+    exitMonitor(g_jvmti, g_step_lock);
+    if (!found)
+        return JNI_FALSE; // Error already reported
+    error = (*g_jvmti)->GetCurrentThread(g_jvmti, &thread);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(g_jvmti, error, "failed to get current thread");
+        return JNI_FALSE;
+    }
+    state = getThreadState(g_jvmti, thread);
+    if (!state)
+        goto step_end; // Error already reported
+    step = &state->step;
+    endStep(g_jvmti, thread, step);
+    if (STEP_NONE == kind)
+    {
+        result = JNI_TRUE;
+        goto step_end;
+    }
+    // Find the Suneido frame the step starts from
+    memset(&params, 0, sizeof(params));
+    params.minimize_deopt = JNI_TRUE;
+    if (!captureStack(g_jvmti, jni_env, thread, &params, &capture))
+        goto step_release; // Error already reported
+    if (0 == capture.count)
+        goto step_release;
+    step->kind = kind;
+    step->method = capture.frames[0].method;
+    step->line_number = capture.frames[0].line_number;
+    step->height = capture.java_frame_count - capture.frames[0].frame_index;
+    step->limit = STEP_OUT == kind ? step->height - 1 : step->height;
+    // Step out waits for the frame to return without single stepping it.
+    // The other steps single step from where the Java frames above the
+    // Suneido frame (this call, the debugger) return to it.
+    if (STEP_INTO == kind)
+        result = setStepEvents(g_jvmti, thread, JVMTI_ENABLE, JVMTI_DISABLE);
+    else
+        result = skipFrame(g_jvmti, thread, step, capture.java_frame_count,
+                           step->limit + 1);
+    if (!result)
+        endStep(g_jvmti, thread, step);
+step_release:
+    releaseCapture(g_jvmti, jni_env, &capture);
+step_end:
+    (*jni_env)->DeleteLocalRef(jni_env, thread);
+    return result;
+}
+
+#ifdef _MSC_VER
+#pragma warning (pop)
+#endif // _MSC_VER
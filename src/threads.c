@@ -0,0 +1,179 @@
+/* Copyright 2026 (c) Suneido Software Corp. All rights reserved.
+ * Licensed under GPLv2.
+ */
+
+#ifdef _MSC_VER
+#pragma warning (disable : 4001) /* nonstandard extension: '//-style' comment */
+#endif // _MSC_VER
+
+//==============================================================================
+// file: threads.c
+// auth: agent
+// date: 20261018
+// desc: Keeps per-thread agent state in JVMTI thread-local storage and frees
+//       it when the thread ends
+//==============================================================================
+
+#include "jsdebug.h"
+
+#include <stdlib.h>
+
+// =============================================================================
+//                                  GLOBALS
+// =============================================================================
+
+static jboolean g_thread_states_enabled;
+
+// =============================================================================
+//                               AGENT INIT
+// =============================================================================
+
+int initThreadStates(jvmtiEnv * jvmti_env)
+{
+    jvmtiError error;
+#ifdef JSDEBUG_VIRTUAL_THREADS
+    jvmtiCapabilities caps;
+#endif
+    if (g_thread_states_enabled)
+        return 1;
+    // The state is freed when the thread ends
+    error = (*jvmti_env)->SetEventNotificationMode(
+        jvmti_env, JVMTI_ENABLE, JVMTI_EVENT_THREAD_END, (jthread)NULL);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        fatalErrorJVMTI(jvmti_env, error, "failed to enable thread end events");
+        return 0;
+    }
+#ifdef JSDEBUG_VIRTUAL_THREADS
+    // Virtual threads don't send thread end events, they have their own. The
+    // event is only available if we got virtual thread support.
+    error = (*jvmti_env)->GetCapabilities(jvmti_env, &caps);
+    if (JVMTI_ERROR_NONE == error && caps.can_support_virtual_threads)
+        error = (*jvmti_env)->SetEventNotificationMode(
+            jvmti_env, JVMTI_ENABLE, JVMTI_EVENT_VIRTUAL_THREAD_END,
+            (jthread)NULL);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        fatalErrorJVMTI(jvmti_env, error,
+                        "failed to enable virtual thread end events");
+        return 0;
+    }
+#endif
+    g_thread_states_enabled = JNI_TRUE;
+    // Return success
+    return 1;
+}
+
+// =============================================================================
+//                               THREAD STATE
+// =============================================================================
+
+// Returns the agent's state for the given thread, which must be the current
+// thread, creating it if necessary. Returns NULL if the state isn't available.
+struct thread_state * getThreadState(jvmtiEnv * jvmti_env, jthread thread)
+{
+    jvmtiError            error;
+    struct thread_state * state = NULL;
+    error = (*jvmti_env)->GetThreadLocalStorage(jvmti_env, thread,
+                                                (void **)&state);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(jvmti_env, error, "failed to get thread local storage");
+        return NULL;
+    }
+    if (state)
+        return state;
+    state = (struct thread_state *)calloc(1, sizeof(struct thread_state));
+    if (!state)
+    {
+        error1("thread state calloc returned NULL");
+        return NULL;
+    }
+    error = (*jvmti_env)->SetThreadLocalStorage(jvmti_env, thread, state);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(jvmti_env, error, "failed to set thread local storage");
+        free(state);
+        return NULL;
+    }
+    return state;
+}
+
+// =============================================================================
+//                               AGENT THREADS
+// =============================================================================
+
+// Starts a daemon thread with the given name that runs proc(arg) in native
+// code. Must be called in the live phase, e.g. from the VM init callback.
+int startAgentThread(jvmtiEnv * jvmti_env, JNIEnv * jni_env, const char * name,
+                     jvmtiStartFunction proc, void * arg)
+{
+    int        result       = 0;
+    jvmtiError error;
+    jclass     thread_class = (jclass)NULL;
+    jmethodID  constructor;
+    jstring    thread_name  = (jstring)NULL;
+    jthread    thread       = (jthread)NULL;
+    // JVMTI runs agent threads on a java.lang.Thread the agent creates
+    thread_class = (*jni_env)->FindClass(jni_env, "java/lang/Thread");
+    if (!thread_class)
+        goto startAgentThread_exception;
+    constructor = (*jni_env)->GetMethodID(jni_env, thread_class, "<init>",
+                                          "(Ljava/lang/String;)V");
+    if (!constructor)
+        goto startAgentThread_exception;
+    thread_name = (*jni_env)->NewStringUTF(jni_env, name);
+    if (!thread_name)
+        goto startAgentThread_exception;
+    thread = (jthread)(*jni_env)->NewObject(jni_env, thread_class,
+                                            constructor, thread_name);
+    if (!thread)
+        goto startAgentThread_exception;
+    error = (*jvmti_env)->RunAgentThread(jvmti_env, thread, proc, arg,
+                                         JVMTI_THREAD_MIN_PRIORITY);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(jvmti_env, error, "failed to run agent thread");
+        goto startAgentThread_end;
+    }
+    // Finished with success
+    result = 1;
+    goto startAgentThread_end;
+startAgentThread_exception:
+    error2("failed to create agent thread: ", name);
+    exceptionDescribe(jni_env);
+startAgentThread_end:
+    if (thread)
+        (*jni_env)->DeleteLocalRef(jni_env, thread);
+    if (thread_name)
+        (*jni_env)->DeleteLocalRef(jni_env, thread_name);
+    if (thread_class)
+        (*jni_env)->DeleteLocalRef(jni_env, thread_class);
+    return result;
+}
+
+// =============================================================================
+//                                 CALLBACKS
+// =============================================================================
+
+#ifdef _MSC_VER
+#pragma warning (push)
+#pragma warning (disable : 4100) // unreferenced formal parameter
+#endif // _MSC_VER
+
+// Handles both platform and virtual thread end events
+void JNICALL callback_ThreadEnd(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                                jthread thread)
+{
+    struct thread_state * state = NULL;
+    if (JVMTI_ERROR_NONE == (*jvmti_env)->GetThreadLocalStorage(
+                                jvmti_env, thread, (void **)&state) && state)
+    {
+        (*jvmti_env)->SetThreadLocalStorage(jvmti_env, thread, NULL);
+        free(state);
+    }
+}
+
+#ifdef _MSC_VER
+#pragma warning (pop)
+#endif // _MSC_VER
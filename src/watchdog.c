@@ -0,0 +1,467 @@
+/* Copyright 2026 (c) Suneido Software Corp. All rights reserved.
+ * Licensed under GPLv2.
+ */
+
+#ifdef _MSC_VER
+#pragma warning (disable : 4001) /* nonstandard extension: '//-style' comment */
+#endif // _MSC_VER
+
+//==============================================================================
+// file: watchdog.c
+// auth: agent
+// date: 20261018
+// desc: Watches for threads that stay in the same Suneido call for too long,
+//       such as hung requests on a server, and logs their Suneido stacks
+//==============================================================================
+
+#include "jsdebug.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// =============================================================================
+//                                 CONSTANTS
+// =============================================================================
+
+enum
+{
+    WATCHDOG_INTERVAL_MS     = 1000,
+    WATCHDOG_TRACE_FRAMES    = 128,  /* Java frames sampled per thread */
+    WATCHDOG_TRACE_ATTEMPTS  = 3,
+    WATCHDOG_MIN_CAPACITY    = 64,   /* must be a power of 2 */
+    WATCHDOG_METHOD_CAPACITY = 1024, /* initial size, must be a power of 2 */
+    WATCHDOG_MAX_NAME        = 128,
+};
+
+enum
+{
+    NATIVE_METHOD_JLOCATION = -1,
+};
+
+static const char * WATCHDOG_THREAD_NAME = "jsdebug watchdog";
+static const char * THREAD_CLASS         = "java/lang/Thread";
+
+// =============================================================================
+//                                  GLOBALS
+// =============================================================================
+
+// A thread whose outermost sampled Suneido frame was seen in the last round.
+// A Suneido call is identified by its method and the height of its frame from
+// the bottom of the stack, so the same call stays the same however the frames
+// above it come and go. A new call of the same method at the same height looks
+// like the same call, but only if every round finds the thread in a call.
+struct watched_thread
+{
+    jlong     thread_id; // Thread.getId(), or 0 if the slot is empty
+    jmethodID method;
+    jint      height;
+    jlong     since;     // GetTime() when the thread was first seen in the call
+    jboolean  reported;  // True once the call has been logged
+};
+
+// Whether a method passes the static tests for a Suneido frame. Only the
+// watchdog thread touches these, so they aren't locked.
+struct watched_method
+{
+    jmethodID method; // NULL if the slot is empty
+    jboolean  is_suneido;
+};
+
+static jrawMonitorID           g_watchdog_lock;
+static jlong                   g_watchdog_threshold; // Nanoseconds
+static jboolean                g_watchdog_locals;
+static jmethodID               g_thread_get_id_method;
+static struct watched_thread * g_watched_threads;
+static size_t                  g_watched_thread_capacity;
+static struct watched_method * g_watched_methods;
+static size_t                  g_watched_method_capacity;
+static size_t                  g_watched_method_count;
+
+// =============================================================================
+//                             HELPER FUNCTIONS
+// =============================================================================
+
+static size_t hashThreadID(jlong thread_id)
+{
+    unsigned long long x = (unsigned long long)thread_id;
+    x *= FNV1A_64_PRIME;
+    return (size_t)(x ^ (x >> 32));
+}
+
+static struct watched_method * findMethodSlot(struct watched_method * table,
+                                              size_t capacity,
+                                              jmethodID method)
+{
+    size_t mask = capacity - 1;
+    size_t k    = hashMethodID(method) & mask;
+    while (table[k].method && table[k].method != method)
+        k = (k + 1) & mask;
+    return &table[k];
+}
+
+// Doubles the method table, keeping the load factor at or below 3/4
+static int growMethods()
+{
+    size_t                  capacity = g_watched_method_capacity * 2;
+    struct watched_method * table;
+    struct watched_method * slot;
+    size_t                  k;
+    table = (struct watched_method *)calloc(capacity,
+                                            sizeof(struct watched_method));
+    if (!table)
+    {
+        error1("watchdog method table calloc returned NULL");
+        return 0;
+    }
+    for (k = 0; k < g_watched_method_capacity; ++k)
+    {
+        if (!g_watched_methods[k].method)
+            continue;
+        slot = findMethodSlot(table, capacity, g_watched_methods[k].method);
+        *slot = g_watched_methods[k];
+    }
+    free(g_watched_methods);
+    g_watched_methods = table;
+    g_watched_method_capacity = capacity;
+    return 1;
+}
+
+// Methods are classified statically since reading "this" of another thread's
+// frame needs the thread to be suspended. Methods that a callable inherits
+// from a class that isn't itself a Suneido callable are therefore missed.
+static int isSuneidoMethod(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                           jmethodID method, jboolean * pis_suneido)
+{
+    struct watched_method * slot;
+    enum method_name        name;
+    slot = findMethodSlot(g_watched_methods, g_watched_method_capacity,
+                          method);
+    if (!slot->method)
+    {
+        if (!classifySuneidoMethod(jvmti_env, jni_env, method, &name))
+            return 0; // Error already reported
+        if (g_watched_method_capacity * 3 <= (g_watched_method_count + 1) * 4)
+        {
+            if (!growMethods())
+                return 0; // Error already reported
+            slot = findMethodSlot(g_watched_methods,
+                                  g_watched_method_capacity, method);
+        }
+        slot->method = method;
+        slot->is_suneido = METHOD_NAME_UNKNOWN != name;
+        ++g_watched_method_count;
+    }
+    *pis_suneido = slot->is_suneido;
+    return 1;
+}
+
+// Gets the bottom WATCHDOG_TRACE_FRAMES frames of a thread, innermost first,
+// from a single snapshot of its stack, so that the height of frame k is
+// *pcount - k. Returns 0 if the thread couldn't be sampled, e.g. because it
+// has finished.
+static int sampleBottomFrames(jvmtiEnv * jvmti_env, jthread thread,
+                              jvmtiFrameInfo * frames, jint * pcount)
+{
+    jvmtiError error;
+    jint       start_depth = 0;
+    jint       k;
+    // A negative start depth counts from the bottom, but is only legal if
+    // the stack is at least that deep, which can change between calls. So
+    // first try from the top, which gets the whole stack if it's short.
+    for (k = 0; k < WATCHDOG_TRACE_ATTEMPTS; ++k)
+    {
+        error = (*jvmti_env)->GetStackTrace(jvmti_env, thread, start_depth,
+                                            WATCHDOG_TRACE_FRAMES, frames,
+                                            pcount);
+        if (JVMTI_ERROR_ILLEGAL_ARGUMENT == error)
+            start_depth = 0; // The stack got shorter
+        else if (JVMTI_ERROR_NONE != error)
+            return 0; // Most likely the thread has just finished
+        else if (*pcount < WATCHDOG_TRACE_FRAMES || start_depth < 0)
+            return 1;
+        else
+            start_depth = -WATCHDOG_TRACE_FRAMES; // The stack may be deeper
+    }
+    return 0; // The stack depth keeps changing, try again next round
+}
+
+static struct watched_thread * findThreadSlot(struct watched_thread * table,
+                                              size_t capacity,
+                                              jlong thread_id)
+{
+    size_t mask = capacity - 1;
+    size_t k    = hashThreadID(thread_id) & mask;
+    while (table[k].thread_id && table[k].thread_id != thread_id)
+        k = (k + 1) & mask;
+    return &table[k];
+}
+
+// Keeps the previous round's entry for a thread that couldn't be sampled this
+// round. Returns 0 if getting the thread's id failed.
+static int carryForward(JNIEnv * jni_env, jthread thread,
+                        struct watched_thread * table, size_t capacity)
+{
+    jlong                   thread_id;
+    struct watched_thread * old;
+    if (!g_watched_threads)
+        return 1;
+    thread_id = (*jni_env)->CallLongMethod(jni_env, thread,
+                                           g_thread_get_id_method);
+    if ((*jni_env)->ExceptionCheck(jni_env))
+    {
+        exceptionDescribe(jni_env);
+        return 0;
+    }
+    old = findThreadSlot(g_watched_threads, g_watched_thread_capacity,
+                         thread_id);
+    if (old->thread_id)
+        *findThreadSlot(table, capacity, thread_id) = *old;
+    return 1;
+}
+
+// Logs the Suneido stack of a thread that has been in the same Suneido call
+// for elapsed nanoseconds. The thread is suspended while its stack is captured
+// because reading the locals, and "this", of another thread's frames requires
+// it.
+static void reportThread(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                         jthread thread, jlong elapsed)
+{
+    jvmtiError            error;
+    jvmtiThreadInfo       info;
+    struct capture_params params;
+    struct stack_capture  capture;
+    int                   captured;
+    char                  name[WATCHDOG_MAX_NAME];
+    char                  title[WATCHDOG_MAX_NAME + 64];
+    strcpy(name, "?");
+    error = (*jvmti_env)->GetThreadInfo(jvmti_env, thread, &info);
+    if (JVMTI_ERROR_NONE == error)
+    {
+        if (info.name)
+        {
+            strncpy(name, info.name, sizeof(name) - 1);
+            name[sizeof(name) - 1] = '\0';
+            (*jvmti_env)->Deallocate(jvmti_env, (unsigned char *)info.name);
+        }
+        if (info.thread_group)
+            (*jni_env)->DeleteLocalRef(jni_env, info.thread_group);
+        if (info.context_class_loader)
+            (*jni_env)->DeleteLocalRef(jni_env, info.context_class_loader);
+    }
+    error = (*jvmti_env)->SuspendThread(jvmti_env, thread);
+    if (JVMTI_ERROR_THREAD_NOT_ALIVE == error)
+        return; // The thread finished after all
+    else if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(jvmti_env, error, "failed to suspend watched thread");
+        return;
+    }
+    memset(&params, 0, sizeof(params));
+    params.minimize_deopt = JNI_TRUE;
+    params.compress = JNI_TRUE;
+    params.locals = g_watchdog_locals;
+    params.hash = JNI_TRUE; // Tells repeated reports of one stack apart
+    captured = captureStack(jvmti_env, jni_env, thread, &params, &capture);
+    error = (*jvmti_env)->ResumeThread(jvmti_env, thread);
+    if (JVMTI_ERROR_NONE != error)
+        errorJVMTI(jvmti_env, error, "failed to resume watched thread");
+    if (captured)
+    {
+        sprintf(title, "thread \"%s\" in the same Suneido call for %ld s",
+                name, (long)(elapsed / 1000000000));
+        logCapture(jvmti_env, jni_env, &capture, title);
+    }
+    releaseCapture(jvmti_env, jni_env, &capture);
+}
+
+// Samples the bottom frames of every thread, carries forward the threads that
+// are still in the same outermost Suneido call as in the last round, and
+// reports those that have been in it for longer than the threshold. Tracking
+// the outermost call means a thread looping in Suneido code is still caught
+// when the calls it makes change from round to round. Returns 0 once JVMTI
+// refuses to list threads because the VM is dying.
+static int watchThreads(jvmtiEnv * jvmti_env, JNIEnv * jni_env)
+{
+    jvmtiError              error;
+    jlong                   now;
+    jthread *               threads = NULL;
+    jint                    thread_count = 0;
+    jvmtiFrameInfo          frames[WATCHDOG_TRACE_FRAMES];
+    jint                    frame_count;
+    struct watched_thread * table = NULL;
+    size_t                  capacity = WATCHDOG_MIN_CAPACITY;
+    struct watched_thread * old;
+    struct watched_thread * cur;
+    jboolean                is_suneido;
+    jlong                   thread_id;
+    jint                    k, j;
+    error = (*jvmti_env)->GetTime(jvmti_env, &now);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(jvmti_env, error, "failed to get time");
+        return 1;
+    }
+    error = (*jvmti_env)->GetAllThreads(jvmti_env, &thread_count, &threads);
+    if (JVMTI_ERROR_WRONG_PHASE == error)
+        return 0;
+    else if (JVMTI_ERROR_NONE != error)
+    {
+        errorJVMTI(jvmti_env, error, "from GetAllThreads()");
+        return 1;
+    }
+    // Keep the load factor of the new table at or below 1/2
+    while (capacity < (size_t)thread_count * 2)
+        capacity *= 2;
+    table = (struct watched_thread *)calloc(capacity,
+                                            sizeof(struct watched_thread));
+    if (!table)
+    {
+        error1("watchdog thread table calloc returned NULL");
+        goto watchThreads_end;
+    }
+    for (k = 0; k < thread_count; ++k)
+    {
+        if (!sampleBottomFrames(jvmti_env, threads[k], frames, &frame_count))
+        {
+            // Don't let one bad sample restart the clock on a hung thread
+            if (!carryForward(jni_env, threads[k], table, capacity))
+                goto watchThreads_end;
+            continue;
+        }
+        // Find the outermost Suneido frame among the sampled frames
+        for (j = frame_count - 1; 0 <= j; --j)
+        {
+            if (NATIVE_METHOD_JLOCATION == frames[j].location)
+                continue;
+            if (!isSuneidoMethod(jvmti_env, jni_env, frames[j].method,
+                                 &is_suneido))
+                goto watchThreads_end;
+            if (is_suneido)
+                break;
+        }
+        if (j < 0)
+            continue;
+        thread_id = (*jni_env)->CallLongMethod(jni_env, threads[k],
+                                               g_thread_get_id_method);
+        if ((*jni_env)->ExceptionCheck(jni_env))
+        {
+            exceptionDescribe(jni_env);
+            goto watchThreads_end;
+        }
+        cur = findThreadSlot(table, capacity, thread_id);
+        cur->thread_id = thread_id;
+        cur->method = frames[j].method;
+        cur->height = frame_count - j;
+        cur->since = now;
+        cur->reported = JNI_FALSE;
+        if (g_watched_threads)
+        {
+            old = findThreadSlot(g_watched_threads, g_watched_thread_capacity,
+                                 thread_id);
+            if (old->thread_id && old->method == cur->method &&
+                old->height == cur->height)
+            {
+                cur->since = old->since;
+                cur->reported = old->reported;
+            }
+        }
+        if (!cur->reported && g_watchdog_threshold <= now - cur->since)
+        {
+            reportThread(jvmti_env, jni_env, threads[k], now - cur->since);
+            cur->reported = JNI_TRUE;
+        }
+    }
+    // Threads that weren't seen this round are forgotten
+    free(g_watched_threads);
+    g_watched_threads = table;
+    g_watched_thread_capacity = capacity;
+    table = NULL;
+watchThreads_end:
+    free(table);
+    for (k = 0; k < thread_count; ++k)
+        (*jni_env)->DeleteLocalRef(jni_env, threads[k]);
+    (*jvmti_env)->Deallocate(jvmti_env, (unsigned char *)threads);
+    return 1;
+}
+
+#ifdef _MSC_VER
+#pragma warning (push)
+#pragma warning (disable : 4100) // unreferenced formal parameter
+#endif // _MSC_VER
+
+static void JNICALL watchdogThread(jvmtiEnv * jvmti_env, JNIEnv * jni_env,
+                                   void * arg)
+{
+    do
+    {
+        enterMonitor(jvmti_env, g_watchdog_lock);
+        (*jvmti_env)->RawMonitorWait(jvmti_env, g_watchdog_lock,
+                                     WATCHDOG_INTERVAL_MS);
+        exitMonitor(jvmti_env, g_watchdog_lock);
+    }
+    while (watchThreads(jvmti_env, jni_env));
+}
+
+#ifdef _MSC_VER
+#pragma warning (pop)
+#endif // _MSC_VER
+
+// =============================================================================
+//                               AGENT INIT
+// =============================================================================
+
+void addWatchdogCapabilities(jvmtiCapabilities * caps)
+{
+    caps->can_suspend = 1;
+}
+
+// Must be called from Agent_OnLoad()
+int initWatchdog(jvmtiEnv * jvmti_env, jint seconds, jboolean locals)
+{
+    jvmtiError error;
+    error = (*jvmti_env)->CreateRawMonitor(jvmti_env, "jsdebug watchdog",
+                                           &g_watchdog_lock);
+    if (JVMTI_ERROR_NONE != error)
+    {
+        fatalErrorJVMTI(jvmti_env, error, "failed to create watchdog lock");
+        return 0;
+    }
+    g_watched_methods = (struct watched_method *)calloc(
+        WATCHDOG_METHOD_CAPACITY, sizeof(struct watched_method));
+    if (!g_watched_methods)
+    {
+        fatalError1("watchdog calloc returned NULL");
+        return 0;
+    }
+    g_watched_method_capacity = WATCHDOG_METHOD_CAPACITY;
+    g_watchdog_threshold = (jlong)seconds * 1000000000;
+    g_watchdog_locals = locals;
+    // Return success
+    return 1;
+}
+
+// Starts the watchdog thread. Must be called from the VM init callback, once
+// g_stack_frame_class is known.
+int startWatchdog(jvmtiEnv * jvmti_env, JNIEnv * jni_env)
+{
+    jclass thread_class;
+    thread_class = (*jni_env)->FindClass(jni_env, THREAD_CLASS);
+    if (!thread_class)
+    {
+        exceptionDescribe(jni_env);
+        fatalError2("failed to find class ", THREAD_CLASS);
+        return 0;
+    }
+    g_thread_get_id_method = (*jni_env)->GetMethodID(jni_env, thread_class,
+                                                     "getId", "()J");
+    (*jni_env)->DeleteLocalRef(jni_env, thread_class);
+    if (!g_thread_get_id_method)
+    {
+        exceptionDescribe(jni_env);
+        fatalError1("failed to find method Thread.getId()");
+        return 0;
+    }
+    return startAgentThread(jvmti_env, jni_env, WATCHDOG_THREAD_NAME,
+                            watchdogThread, NULL);
+}